@@ -17,6 +17,7 @@ typedef FILE * TbFileHandle;
 
 #define Lb_SUCCESS ERR_OK
 #define Lb_FAIL ERR_CANT_OPEN
+#define Lb_NO_MEMORY ERR_NO_MEMORY
 
 #define LbFileOpen(fname, accmode) fopen(fname, accmode)
 #define LbFileSeek(fhandle, offset, origin) fseek(fhandle, offset, origin)
@@ -28,6 +28,16 @@ extern "C" {
 #endif
 /******************************************************************************/
 
+/** Job to be run for every index within given count. */
+typedef void (*AnimJobFunc)(void *ctx, int idx);
+/** Function running given job for all indexes, possibly on parallel threads;
+ * returns after all the jobs are finished.
+ */
+typedef void (*AnimParallelFunc)(AnimJobFunc job, void *ctx, int count);
+
+/** Length of the string listing chunks of the last played or recorded frame. */
+#define ANIM_PARSE_TAGS_LEN 152
+
 #pragma pack(1)
 
 enum FLI_Ani_Consts {
@@ -49,6 +59,13 @@ enum AnimationFlags {
     AniFlg_RECORD    = 0x0001, /**< The animation is being recorded rather than played. */
     AniFlg_APPEND    = 0x0002, /**< The new recorded frames are to be appended at end of existing file. */
     AniFlg_ALL_DELTA = 0x0004, /**< The recorded frames are all delta frames, there is no static background. */
+    AniFlg_NO_WRITE  = 0x0008, /**< The recorded frames are encoded, but not written; allows computing sizes without a file. */
+};
+
+enum AnimMakeKernels {
+    AniKrn_SCALAR    = 0, /**< Frame data is scanned by plain C code. */
+    AniKrn_SSE2,          /**< Frame data is scanned using SSE2 instructions. */
+    AniKrn_AVX2,          /**< Frame data is scanned using AVX2 instructions. */
 };
 
 struct FLCFileHeader {
@@ -92,6 +109,42 @@ struct FLCFrameDataChunk {
     ushort Type;
 };
 
+/**
+ * State of playback or recording, kept separately for an animation.
+ * Allows several animations to be played or recorded at the same time.
+ */
+struct AnimationContext {
+    /** Scratch buffer, of anim_buffer_size() for playback, or anim_scratch_size() for recording.
+     */
+    void *Scratch;
+	/** Palette of the last played / recorded frame.
+     */
+    ubyte Palette[0x300];
+	/** Names of chunks within the last played / recorded frame.
+     */
+    char ParseTags[ANIM_PARSE_TAGS_LEN];
+	/** Function running frame encoding jobs on parallel threads, or NULL.
+     */
+    AnimParallelFunc Parallel;
+};
+
+/**
+ * Region of a recorded frame which may differ from previous frame.
+ * Pixels outside of the region have to be the same as in previous frame.
+ */
+struct AnimFrameDamage {
+	/** First line which may differ.
+     */
+    ushort FirstLine;
+	/** Amount of lines which may differ; 0 if the whole frame is the same as previous one.
+     */
+    ushort Lines;
+	/** Begin and end column of the part which may differ, for every line within the range;
+     * line with begin not lower than end is the same. NULL if whole lines may differ.
+     */
+    const ushort *Spans;
+};
+
 struct Animation {
 	/** Buffer with animation frame pixel data.
      * Can be a screen buffer, or another chunkof memory where decoded frame
@@ -131,14 +184,31 @@ struct Animation {
      * to store information by the app using this Animation.
      */
     short Type;
+	/** State of this animation, or NULL to use the global state:
+     * anim_scratch, anim_palette and anim_parse_tags.
+     */
+    struct AnimationContext *Context;
+	/** Region of the frame being recorded which may differ from previous frame,
+     * or NULL if not known. Set only while the frame is recorded.
+     */
+    const struct AnimFrameDamage *Damage;
+	/** Buffer where alternative compressions of delta frames are encoded.
+     * Allocated by the library when recording is opened, and freed on close.
+     */
+    ubyte *EncodeBuf;
 };
 
 #pragma pack()
 /******************************************************************************/
+extern char anim_parse_tags[ANIM_PARSE_TAGS_LEN];
 extern ubyte anim_palette[0x300];
 extern void *anim_scratch;
 
 void anim_flic_init(struct Animation *p_anim, short anmtype, ushort flags);
+/** Makes the animation use its own state instead of the global one.
+ * Should be called after anim_flic_init(), before the animation is opened.
+ */
+void anim_flic_set_context(struct Animation *p_anim, struct AnimationContext *p_ctx);
 void anim_flic_set_frame_buffer(struct Animation *p_anim, ubyte *obuf,
   short x, short y, short scanln, ushort flags);
 void anim_flic_set_fname(struct Animation *p_anim, const char *format, ...);
@@ -157,6 +227,13 @@ u32 anim_frame_size(int width, int height, int depth);
  */
 u32 anim_buffer_size(int width, int height, int depth);
 
+/** Returns size of the FLI movie scratch buffer required for recording.
+ * The scratch keeps previous frame and the chunk buffer; regions where
+ * alternative compressions of a delta frame are encoded are allocated
+ * by the library, so the size is the same as it always was.
+ */
+u32 anim_scratch_size(int width, int height, int depth);
+
 TbResult anim_flic_show_open(struct Animation *p_anim);
 void anim_show_prep_next_frame(struct Animation *p_anim, ubyte *frmbuf);
 ubyte anim_show_frame(struct Animation *p_anim);
@@ -165,6 +242,24 @@ TbResult anim_flic_make_open(struct Animation *p_anim, int width, int height,
   int bpp, uint flags);
 void anim_make_prep_next_frame(struct Animation *p_anim, ubyte *frmbuf);
 TbBool anim_make_next_frame(struct Animation *p_anim, ubyte *palette);
+/** Records frame, knowing which region of it may differ from previous frame.
+ * Delta encoders examine only that region, and frame without changes
+ * is stored as empty delta. The damage may be NULL, if not known.
+ */
+TbBool anim_make_next_frame_damage(struct Animation *p_anim, ubyte *palette,
+  const struct AnimFrameDamage *p_damage);
+/** Sets function which runs frame encoding jobs on parallel threads,
+ * for animations using the global state.
+ * Without it, or with NULL, the jobs are run one by one; the encoded data
+ * is the same either way. Small frames are always encoded one job after another.
+ */
+void anim_make_set_parallel(AnimParallelFunc func);
+/** Limits instructions used when scanning frame data for recording to given set.
+ * Sets not supported by the build or the CPU are lowered to the widest supported one;
+ * returns the set which is used. The encoded data is the same for every set,
+ * so this is only useful for testing the kernels against each other.
+ */
+int anim_make_set_kernels(int kernels);
 
 // Low level interface
 void anim_show_FLI_SS2(struct Animation *p_anim);
@@ -29,12 +29,53 @@
 #include "privbflog.h"
 
 /******************************************************************************/
-char anim_parse_tags[152];
+char anim_parse_tags[ANIM_PARSE_TAGS_LEN];
 ubyte anim_palette[0x300];
 void *anim_scratch;
 
 TbBool anim_update_prev_frame(struct Animation *p_anim);
 
+/**
+ * Gives scratch buffer of the animation.
+ */
+void *anim_ctx_scratch(struct Animation *p_anim)
+{
+    if (p_anim->Context != NULL)
+        return p_anim->Context->Scratch;
+    return anim_scratch;
+}
+
+/**
+ * Gives palette of the last frame played or recorded within the animation.
+ */
+ubyte *anim_ctx_palette(struct Animation *p_anim)
+{
+    if (p_anim->Context != NULL)
+        return p_anim->Context->Palette;
+    return anim_palette;
+}
+
+/**
+ * Gives string listing chunks of the last frame played or recorded within the animation.
+ */
+char *anim_ctx_parse_tags(struct Animation *p_anim)
+{
+    if (p_anim->Context != NULL)
+        return p_anim->Context->ParseTags;
+    return anim_parse_tags;
+}
+
+/**
+ * Adds chunk name to the string listing chunks of the current frame.
+ */
+void anim_parse_tags_add(struct Animation *p_anim, const char *tag)
+{
+    char *tags;
+
+    tags = anim_ctx_parse_tags(p_anim);
+    strncat(tags, tag, ANIM_PARSE_TAGS_LEN - strlen(tags) - 1);
+}
+
 /**
  * Reads the data from FLI animation.
  * @return Returns false on error, true on success.
@@ -346,7 +387,7 @@ void anim_show_FLI_COLOUR256(struct Animation *p_anim)
     i_inject = (intptr_t)p_anim->FrameBuffer;
 
     // assuming run on little-endian CPU
-    opal = anim_palette;
+    opal = anim_ctx_palette(p_anim);
     num_i = 0;
     if (i_inject != -16)
         LbMemoryCopy(&num_i, p_anim->ChunkBuf, 2);
@@ -382,6 +423,7 @@ void anim_show_FLI_COLOUR256(struct Animation *p_anim)
 
 ubyte anim_show_FLI_FRAME(struct Animation *p_anim, struct FLCFrameDataChunk *p_fdthunk)
 {
+    char *tags;
     size_t sz;
     ubyte pal_change;
 
@@ -394,41 +436,42 @@ ubyte anim_show_FLI_FRAME(struct Animation *p_anim, struct FLCFrameDataChunk *p_
     {
     case FLI_COLOUR256:
         anim_show_FLI_COLOUR256(p_anim);
-        strncat(anim_parse_tags, "COLOUR256 ", sizeof(anim_parse_tags)-1);
+        anim_parse_tags_add(p_anim, "COLOUR256 ");
         pal_change = 1;
         break;
     case FLI_SS2:
         anim_show_FLI_SS2(p_anim);
-        strncat(anim_parse_tags, "SS2 ", sizeof(anim_parse_tags)-1);
+        anim_parse_tags_add(p_anim, "SS2 ");
         break;
     case FLI_COLOUR:
         anim_show_FLI_COLOUR256(p_anim); // reuse implementation
-        strncat(anim_parse_tags, "COLOUR ", sizeof(anim_parse_tags)-1);
+        anim_parse_tags_add(p_anim, "COLOUR ");
         pal_change = 1;
         break;
     case FLI_LC:
         anim_show_FLI_LC(p_anim);
-        strncat(anim_parse_tags, "LC ", sizeof(anim_parse_tags)-1);
+        anim_parse_tags_add(p_anim, "LC ");
         break;
     case FLI_BLACK:
         anim_show_FLI_BLACK(p_anim);
-        strncat(anim_parse_tags, "BLACK ", sizeof(anim_parse_tags)-1);
+        anim_parse_tags_add(p_anim, "BLACK ");
         break;
     case FLI_BRUN:
         anim_show_FLI_BRUN(p_anim);
-        strncat(anim_parse_tags, "BRUN ", sizeof(anim_parse_tags)-1);
+        anim_parse_tags_add(p_anim, "BRUN ");
         break;
     case FLI_COPY:
         anim_show_FLI_COPY(p_anim);
-        strncat(anim_parse_tags, "COPY ", sizeof(anim_parse_tags)-1);
+        anim_parse_tags_add(p_anim, "COPY ");
         break;
     case FLI_PSTAMP:
         p_anim->ChunkBuf += p_fdthunk->Size - 6;
-        strncat(anim_parse_tags, "PSTAMP ", sizeof(anim_parse_tags)-1);
+        anim_parse_tags_add(p_anim, "PSTAMP ");
         break;
     default:
-        sz = strlen(anim_parse_tags);
-        snprintf(anim_parse_tags + sz, sizeof(anim_parse_tags)-sz-1,
+        tags = anim_ctx_parse_tags(p_anim);
+        sz = strlen(tags);
+        snprintf(tags + sz, ANIM_PARSE_TAGS_LEN-sz-1,
           "N%04x ", (uint)p_fdthunk->Type);
         break;
     }
@@ -439,13 +482,13 @@ void anim_flic_find_next_frame_chunk(struct Animation *p_anim)
 {
     anim_read_data(p_anim, &p_anim->FLCFrameChunk, 16);
     while (p_anim->FLCFrameChunk.Type != FLI_FRAME_CHUNK) {
-        anim_read_data(p_anim, anim_scratch, p_anim->FLCFrameChunk.Size - 16);
+        anim_read_data(p_anim, anim_ctx_scratch(p_anim), p_anim->FLCFrameChunk.Size - 16);
         if (!anim_read_data(p_anim, &p_anim->FLCFrameChunk, 16)) {
             p_anim->FLCFrameChunk.Size = 16;
             break;
         }
     }
-    anim_read_data(p_anim, anim_scratch, p_anim->FLCFrameChunk.Size - 16);
+    anim_read_data(p_anim, anim_ctx_scratch(p_anim), p_anim->FLCFrameChunk.Size - 16);
     p_anim->anfield_4 += p_anim->FLCFrameChunk.Size;
 }
 
@@ -467,8 +510,8 @@ ubyte anim_show_frame(struct Animation *p_anim)
     ubyte pal_change;
 
     pal_change = 0;
-    p_anim->ChunkBuf = anim_scratch;
-    anim_parse_tags[0] = 0;
+    p_anim->ChunkBuf = anim_ctx_scratch(p_anim);
+    anim_ctx_parse_tags(p_anim)[0] = 0;
 
     LOGDBG("Frame chunk size %d, `%s` file", (int)p_anim->FLCFrameChunk.Size, p_anim->Filename);
     prefix_type = p_anim->FLCFrameChunk.Type;
@@ -488,7 +531,7 @@ ubyte anim_show_frame(struct Animation *p_anim)
             p_anim->ChunkBuf = last_unkbuf + fdthunk.Size;
         }
     }
-    LOGDBG("Chunks: %s", anim_parse_tags);
+    LOGDBG("Chunks: %s", anim_ctx_parse_tags(p_anim));
     return pal_change;
 }
 
@@ -499,6 +542,14 @@ void anim_flic_init(struct Animation *p_anim, short anmtype, ushort flags)
     p_anim->Type = anmtype;
     p_anim->Flags = flags;
     p_anim->FileHandle = INVALID_FILE;
+    p_anim->Context = NULL;
+    p_anim->Damage = NULL;
+    p_anim->EncodeBuf = NULL;
+}
+
+void anim_flic_set_context(struct Animation *p_anim, struct AnimationContext *p_ctx)
+{
+    p_anim->Context = p_ctx;
 }
 
 void anim_flic_set_frame_buffer(struct Animation *p_anim, ubyte *frmbuf,
@@ -516,7 +567,7 @@ void anim_flic_set_frame_buffer(struct Animation *p_anim, ubyte *frmbuf,
     {
         if (((p_anim->Flags & AniFlg_ALL_DELTA) != 0) && (p_anim->FrameNumber == 0)) {
             LOGDBG("Recording start in delata mode");
-            p_anim->PvFrameBuf = anim_scratch;
+            p_anim->PvFrameBuf = anim_ctx_scratch(p_anim);
             anim_update_prev_frame(p_anim);
         }
     }
@@ -560,6 +611,10 @@ TbBool anim_is_opened(struct Animation *p_anim)
 
 void anim_flic_close(struct Animation *p_anim)
 {
+    free(p_anim->EncodeBuf);
+    p_anim->EncodeBuf = NULL;
+    if ((p_anim->Flags & AniFlg_NO_WRITE) != 0)
+        return;
     if ((p_anim->Flags & (AniFlg_RECORD|AniFlg_APPEND)) != 0) {
         anim_rewrite_file_header(p_anim);
     }
@@ -20,20 +20,303 @@
 #include "bfflic.h"
 
 #include <stdlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// AVX2 kernels are compiled regardless of target flags, and used only if the CPU has it
+#define ANIM_SCAN_AVX2
+#include <immintrin.h>
+#endif
 #include "bffile.h"
 #include "bfmemut.h"
 #include "privbflog.h"
 /******************************************************************************/
-extern char anim_parse_tags[152];
+void *anim_ctx_scratch(struct Animation *p_anim);
+ubyte *anim_ctx_palette(struct Animation *p_anim);
+char *anim_ctx_parse_tags(struct Animation *p_anim);
+void anim_parse_tags_add(struct Animation *p_anim, const char *tag);
+
+/** Max amount of bands the frame lines are split into, when encoded by parallel jobs. */
+#define ANIM_MAKE_BANDS_MAX 32
+/** Min amount of lines in one band, to make a job worth its overhead. */
+#define ANIM_MAKE_BAND_LINES 16
+/** Min frame dimensions for which the parallel jobs function is used; smaller frames
+ * are encoded faster than the jobs can be handed over to other threads. */
+#define ANIM_MAKE_PARALLEL_WIDTH 256
+#define ANIM_MAKE_PARALLEL_LINES (4 * ANIM_MAKE_BAND_LINES)
+
+/**
+ * Jobs encoding blocks of one frame. Lines of BRUN and LC blocks are split into bands,
+ * each encoded into its own part of band area; the parts are joined afterwards.
+ */
+struct AnimMakeJobs {
+    struct Animation *p_anim;
+    /** Amount of bands of BRUN block, or 0 if the block is not encoded. */
+    short brun_bands;
+    short brun_band_lines;
+    /** Buffer for SS2 block, or NULL if the block is not encoded. */
+    ubyte *ss2_buf;
+    u32 ss2_size;
+    /** Amount of bands of LC block, or 0 if there are no changed lines to encode. */
+    short lc_bands;
+    short lc_band_lines;
+    short lc_first;
+    short lc_lines;
+    u32 line_max;
+    ubyte *band_area[2];
+    ubyte *band_end[2][ANIM_MAKE_BANDS_MAX];
+};
+
+/** Function running the encoding jobs, possibly on parallel threads; NULL runs them one by one. */
+static AnimParallelFunc anim_make_parallel = NULL;
+
+/** Widest set of instructions the scanning kernels are allowed to use. */
+static int anim_scan_kernels = AniKrn_AVX2;
 
 TbBool anim_read_data(struct Animation *p_anim, void *buf, u32 size);
 
+/**
+ * Returns index of the lowest bit set in non-zero mask.
+ */
+static inline int anim_scan_lowest_bit(u32 mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int n;
+
+    for (n = 0; (mask & 1) == 0; n++)
+        mask >>= 1;
+    return n;
+#endif
+}
+
+/**
+ * Counts bytes at start of two buffers which are equal; portable version.
+ * Whole words are compared first, then bytes of the word which differs.
+ */
+static int anim_scan_same_c(const ubyte *abuf, const ubyte *bbuf, int len)
+{
+    int i;
+
+    for (i = 0; i + (int)sizeof(uintptr_t) <= len; i += sizeof(uintptr_t))
+    {
+        uintptr_t aval, bval;
+        LbMemoryCopy(&aval, abuf + i, sizeof(uintptr_t));
+        LbMemoryCopy(&bval, bbuf + i, sizeof(uintptr_t));
+        if (aval != bval)
+            break;
+    }
+    while ((i < len) && (abuf[i] == bbuf[i]))
+        i++;
+    return i;
+}
+
+/**
+ * Counts bytes at start of the buffer which are equal to the first one; portable version.
+ * Bytes before the given index are known to be equal already.
+ */
+static int anim_scan_run_c(const ubyte *buf, int from, int len)
+{
+    int i;
+
+    for (i = from; i < len; i++)
+    {
+        if (buf[i] != buf[0])
+            break;
+    }
+    return i;
+}
+
+/**
+ * Finds first index at which 4 equal bytes start; portable version.
+ * Bytes up to 3 after the given length are read.
+ * @return Returns the index, or len if there is no such place.
+ */
+static int anim_scan_run4_c(const ubyte *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        if ((buf[i+1] == buf[i]) && (buf[i+2] == buf[i]) && (buf[i+3] == buf[i]))
+            break;
+    }
+    return i;
+}
+
+#if defined(__SSE2__)
+static int anim_scan_same_sse2(const ubyte *abuf, const ubyte *bbuf, int len)
+{
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        __m128i eq;
+        u32 mask;
+        eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(abuf + i)),
+          _mm_loadu_si128((const __m128i *)(bbuf + i)));
+        mask = ~_mm_movemask_epi8(eq) & 0xffff;
+        if (mask != 0)
+            return i + anim_scan_lowest_bit(mask);
+    }
+    return i + anim_scan_same_c(abuf + i, bbuf + i, len - i);
+}
+
+static int anim_scan_run_sse2(const ubyte *buf, int len)
+{
+    __m128i val;
+    int i;
+
+    val = _mm_set1_epi8(buf[0]);
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        u32 mask;
+        mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), val)) & 0xffff;
+        if (mask != 0)
+            return i + anim_scan_lowest_bit(mask);
+    }
+    return anim_scan_run_c(buf, i, len);
+}
+
+static int anim_scan_run4_sse2(const ubyte *buf, int len)
+{
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        __m128i val0, eq;
+        u32 mask;
+        val0 = _mm_loadu_si128((const __m128i *)(buf + i));
+        eq = _mm_and_si128(_mm_cmpeq_epi8(val0, _mm_loadu_si128((const __m128i *)(buf + i + 1))),
+          _mm_cmpeq_epi8(val0, _mm_loadu_si128((const __m128i *)(buf + i + 2))));
+        eq = _mm_and_si128(eq, _mm_cmpeq_epi8(val0, _mm_loadu_si128((const __m128i *)(buf + i + 3))));
+        mask = _mm_movemask_epi8(eq);
+        if (mask != 0)
+            return i + anim_scan_lowest_bit(mask);
+    }
+    return i + anim_scan_run4_c(buf + i, len - i);
+}
+#endif
+
+#if defined(ANIM_SCAN_AVX2)
+__attribute__((target("avx2")))
+static int anim_scan_same_avx2(const ubyte *abuf, const ubyte *bbuf, int len)
+{
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+        __m256i eq;
+        u32 mask;
+        eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(abuf + i)),
+          _mm256_loadu_si256((const __m256i *)(bbuf + i)));
+        mask = ~(u32)_mm256_movemask_epi8(eq);
+        if (mask != 0)
+            return i + anim_scan_lowest_bit(mask);
+    }
+    return i + anim_scan_same_c(abuf + i, bbuf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int anim_scan_run_avx2(const ubyte *buf, int len)
+{
+    __m256i val;
+    int i;
+
+    val = _mm256_set1_epi8(buf[0]);
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+        u32 mask;
+        mask = ~(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), val));
+        if (mask != 0)
+            return i + anim_scan_lowest_bit(mask);
+    }
+    return anim_scan_run_c(buf, i, len);
+}
+
+__attribute__((target("avx2")))
+static int anim_scan_run4_avx2(const ubyte *buf, int len)
+{
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+        __m256i val0, eq;
+        u32 mask;
+        val0 = _mm256_loadu_si256((const __m256i *)(buf + i));
+        eq = _mm256_and_si256(_mm256_cmpeq_epi8(val0, _mm256_loadu_si256((const __m256i *)(buf + i + 1))),
+          _mm256_cmpeq_epi8(val0, _mm256_loadu_si256((const __m256i *)(buf + i + 2))));
+        eq = _mm256_and_si256(eq, _mm256_cmpeq_epi8(val0, _mm256_loadu_si256((const __m256i *)(buf + i + 3))));
+        mask = _mm256_movemask_epi8(eq);
+        if (mask != 0)
+            return i + anim_scan_lowest_bit(mask);
+    }
+    return i + anim_scan_run4_c(buf + i, len - i);
+}
+#endif
+
+/**
+ * Counts bytes at start of two buffers which are equal.
+ * Uses the widest vector instructions the CPU supports, unless limited by anim_make_set_kernels();
+ * all versions give the same result.
+ */
+static int anim_scan_same(const ubyte *abuf, const ubyte *bbuf, int len)
+{
+#if defined(ANIM_SCAN_AVX2)
+    if ((anim_scan_kernels >= AniKrn_AVX2) && __builtin_cpu_supports("avx2"))
+        return anim_scan_same_avx2(abuf, bbuf, len);
+#endif
+#if defined(__SSE2__)
+    if (anim_scan_kernels >= AniKrn_SSE2)
+        return anim_scan_same_sse2(abuf, bbuf, len);
+#endif
+    return anim_scan_same_c(abuf, bbuf, len);
+}
+
+/**
+ * Counts bytes at start of the buffer which are equal to the first one.
+ * The length must be at least 1.
+ */
+static int anim_scan_run(const ubyte *buf, int len)
+{
+#if defined(ANIM_SCAN_AVX2)
+    if ((anim_scan_kernels >= AniKrn_AVX2) && __builtin_cpu_supports("avx2"))
+        return anim_scan_run_avx2(buf, len);
+#endif
+#if defined(__SSE2__)
+    if (anim_scan_kernels >= AniKrn_SSE2)
+        return anim_scan_run_sse2(buf, len);
+#endif
+    return anim_scan_run_c(buf, 1, len);
+}
+
+/**
+ * Finds first index at which 4 equal bytes start, or returns len if there is none.
+ * Bytes up to 3 after the given length are read.
+ */
+static int anim_scan_run4(const ubyte *buf, int len)
+{
+#if defined(ANIM_SCAN_AVX2)
+    if ((anim_scan_kernels >= AniKrn_AVX2) && __builtin_cpu_supports("avx2"))
+        return anim_scan_run4_avx2(buf, len);
+#endif
+#if defined(__SSE2__)
+    if (anim_scan_kernels >= AniKrn_SSE2)
+        return anim_scan_run4_sse2(buf, len);
+#endif
+    return anim_scan_run4_c(buf, len);
+}
+
 /**
  * Writes the data into FLI animation.
  * @return Returns false on error, true on success.
  */
 TbBool anim_write_data(struct Animation *p_anim, void *p_buf, u32 size)
 {
+    if ((p_anim->Flags & AniFlg_NO_WRITE) != 0)
+        return true;
     return LbFileWrite(p_anim->FileHandle, p_buf, size) == size;
 }
 
@@ -48,8 +331,31 @@ TbBool anim_store_data(struct Animation *p_anim, void *p_buf, u32 size)
     return true;
 }
 
+/**
+ * Gives range of columns within given line of the frame which may differ from previous frame.
+ * @return Returns false if the line is known to be the same as in previous frame.
+ */
+static TbBool anim_damage_line(struct Animation *p_anim, int line, int *p_beg, int *p_end)
+{
+    const struct AnimFrameDamage *p_damage;
+
+    p_damage = p_anim->Damage;
+    *p_beg = 0;
+    *p_end = p_anim->FLCFileHeader.Width;
+    if (p_damage == NULL)
+        return true;
+    if ((line < p_damage->FirstLine) || (line >= p_damage->FirstLine + p_damage->Lines))
+        return false;
+    if (p_damage->Spans == NULL)
+        return true;
+    *p_beg = p_damage->Spans[2 * (line - p_damage->FirstLine) + 0];
+    *p_end = p_damage->Spans[2 * (line - p_damage->FirstLine) + 1];
+    return (*p_beg < *p_end);
+}
+
 /**
  * Make copy of the current frame buffer to previous frame buffer.
+ * If damaged region of the frame is known, only that region is copied.
  * @return Returns false on error, true on success.
  */
 TbBool anim_update_prev_frame(struct Animation *p_anim)
@@ -57,13 +363,15 @@ TbBool anim_update_prev_frame(struct Animation *p_anim)
     ubyte *sbuf;
     ubyte *obuf;
     short h;
+    int beg, end;
 
     sbuf = p_anim->FrameBuffer;
     obuf = p_anim->PvFrameBuf;
 
-    for (h = p_anim->FLCFileHeader.Height; h > 0; h--)
+    for (h = 0; h < p_anim->FLCFileHeader.Height; h++)
     {
-        LbMemoryCopy(obuf, sbuf, p_anim->FLCFileHeader.Width);
+        if (anim_damage_line(p_anim, h, &beg, &end))
+            LbMemoryCopy(obuf + beg, sbuf + beg, end - beg);
         obuf += p_anim->FLCFileHeader.Width;
         sbuf += p_anim->Scanline;
     }
@@ -100,7 +408,7 @@ u32 anim_make_FLI_COLOUR256(struct Animation *p_anim, ubyte *palette)
     if (palette == NULL) {
         return 0;
     }
-    if (memcmp(anim_palette, palette, 768) == 0) {
+    if (memcmp(anim_ctx_palette(p_anim), palette, 768) == 0) {
         return 0;
     }
     change_count = (ushort *)p_anim->ChunkBuf;
@@ -116,7 +424,7 @@ u32 anim_make_FLI_COLOUR256(struct Animation *p_anim, ubyte *palette)
         ubyte *anipal;
         ubyte *srcpal;
 
-        anipal = &anim_palette[3 * colridx];
+        anipal = &anim_ctx_palette(p_anim)[3 * colridx];
         srcpal = &palette[3 * colridx];
 
         if (memcmp(anipal, srcpal, 3) == 0) {
@@ -128,6 +436,7 @@ u32 anim_make_FLI_COLOUR256(struct Animation *p_anim, ubyte *palette)
                 kept_chunk_len = 0;
                 p_anim->ChunkBuf++;
                 kept_count = (ubyte *)p_anim->ChunkBuf;
+                *kept_count = 0;
                 p_anim->ChunkBuf++;
             }
             ++change_chunk_len;
@@ -147,41 +456,29 @@ u32 anim_make_FLI_COLOUR256(struct Animation *p_anim, ubyte *palette)
 }
 
 /**
- * Compress data into FLI's BRUN block (8-bit Run-Length compression).
- * @return Returns packed size of the block which was compressed.
+ * Compress given amount of frame lines into FLI's BRUN packets.
+ * Every line is encoded independently, so the lines may be split into bands.
  */
-u32 anim_make_FLI_BRUN(struct Animation *p_anim)
+static void anim_make_FLI_BRUN_lines(struct Animation *p_anim, ubyte *sbuf, short nlines)
 {
-    ubyte *blk_begin;
-    ubyte *sbuf;
     short h;
 
-    blk_begin = p_anim->ChunkBuf;
-    sbuf = p_anim->FrameBuffer;
-
-    for (h = p_anim->FLCFileHeader.Height; h > 0; h--)
+    for (h = nlines; h > 0; h--)
     {
         ubyte *ssbuf;
         short w;
 
         ssbuf = sbuf;
+        // Packets count is not used by players, as lines end at frame width
+        *p_anim->ChunkBuf = 0;
         p_anim->ChunkBuf++;
         for (w = p_anim->FLCFileHeader.Width; w > 0; )
         {
             short count;
-            short k;
 
-            count = 0;
             // Counting size of RLE block
-            for (k = 1; w > 1; k++)
-            {
-                if (ssbuf[k] != ssbuf[0])
-                    break;
-                if (count == 127)
-                    break;
-                w--;
-                count++;
-            }
+            count = anim_scan_run(ssbuf, (w < 128) ? w : 128) - 1;
+            w -= count;
             // If RLE block would be valid
             if (count > 0)
             {
@@ -199,19 +496,9 @@ u32 anim_make_FLI_BRUN(struct Animation *p_anim)
             {
                 if (w > 1)
                 {
-                    count = 0;
                     // Find the next block of at least 4 same pixels
-                    for (k = 0; w > 0; k++)
-                    {
-                        if ((ssbuf[k+1] == ssbuf[k]) &&
-                          (ssbuf[k+2] == ssbuf[k]) &&
-                          (ssbuf[k+3] == ssbuf[k]))
-                            break;
-                        if (count == -127)
-                            break;
-                        count--;
-                        w--;
-                    }
+                    count = -anim_scan_run4(ssbuf, (w < 127) ? w : 127);
+                    w += count;
                 }
                 else
                 {
@@ -230,6 +517,18 @@ u32 anim_make_FLI_BRUN(struct Animation *p_anim)
         }
         sbuf += p_anim->Scanline;
     }
+}
+
+/**
+ * Compress data into FLI's BRUN block (8-bit Run-Length compression).
+ * @return Returns packed size of the block which was compressed.
+ */
+u32 anim_make_FLI_BRUN(struct Animation *p_anim)
+{
+    ubyte *blk_begin;
+
+    blk_begin = p_anim->ChunkBuf;
+    anim_make_FLI_BRUN_lines(p_anim, p_anim->FrameBuffer, p_anim->FLCFileHeader.Height);
     // Make the block size even (req. by FLI spec)
     if ((intptr_t)p_anim->ChunkBuf & 1) {
         *p_anim->ChunkBuf = '\0';
@@ -258,11 +557,14 @@ u32 anim_make_FLI_SS2(struct Animation *p_anim)
     short ndiff;
     short wend;
     short wendt;
+    int skip;
+    int end;
     cbuf = p_anim->FrameBuffer;
     pbuf = p_anim->PvFrameBuf;
 
     blk_begin = p_anim->ChunkBuf;
     lines_count = (ushort *)p_anim->ChunkBuf;
+    *lines_count = 0;
     p_anim->ChunkBuf += 2;
     pckt_count = (ushort *)p_anim->ChunkBuf;
 
@@ -273,17 +575,27 @@ u32 anim_make_FLI_SS2(struct Animation *p_anim)
         pbf = pbuf;
         if (wend == 0) {
             pckt_count = (ushort *)p_anim->ChunkBuf;
+            *pckt_count = 0;
             p_anim->ChunkBuf += 2;
             (*lines_count)++;
         }
+        if (!anim_damage_line(p_anim, p_anim->FLCFileHeader.Height - h, &skip, &end) &&
+          ((p_anim->FLCFileHeader.Width & 1) == 0))
+        {
+            // Unchanged line; with even width, pixel pairs do not reach the next line
+            wend--;
+            cbuf += p_anim->Scanline;
+            pbuf += p_anim->Scanline;
+            continue;
+        }
+        // Pixel pairs before the damaged part of line are known to be identical
+        skip = (skip < end) ? skip / 2 : 0;
         for (w = p_anim->FLCFileHeader.Width; w > 0; )
         {
-            for (k = 0; w > 0; k++)
-            {
-                if (*(ushort *)(pbf + 2 * k) != *(ushort *)(cbf + 2 * k))
-                    break;
-                w -= 2;
-            }
+            // Count identical pixel pairs; odd width compares one pixel beyond the line
+            k = skip + anim_scan_same(pbf + 2 * skip, cbf + 2 * skip, 2 * ((w + 1) / 2 - skip)) / 2;
+            w -= 2 * k;
+            skip = 0;
             if (2 * k == p_anim->FLCFileHeader.Width)
             {
                 wend--;
@@ -295,6 +607,7 @@ u32 anim_make_FLI_SS2(struct Animation *p_anim)
                 if (wend != 0) {
                     (*pckt_count) = wend;
                     pckt_count = (ushort *)p_anim->ChunkBuf;
+                    *pckt_count = 0;
                     p_anim->ChunkBuf += 2;
                 }
                 wendt = 2*k;
@@ -337,7 +650,8 @@ u32 anim_make_FLI_SS2(struct Animation *p_anim)
                     wend = 0;
                     (*pckt_count)++;
                 } else {
-                    if (w == 2) {
+                    // Last pair, which may lack its second pixel, is always stored as it is
+                    if (w <= 2) {
                         ndiff = 1;
                         w -= 2;
                     } else {
@@ -391,224 +705,232 @@ u32 anim_make_FLI_SS2(struct Animation *p_anim)
 }
 
 /**
- * Compress data into FLI's LC block.
- * @return Returns packed size of the block which was compressed.
+ * Finds range of lines which differ from previous frame, for FLI's LC block.
+ * @return Returns amount of lines starting with the first which differs, or 0 if none.
  */
-u32 anim_make_FLI_LC(struct Animation *p_anim)
+static short anim_make_FLI_LC_range(struct Animation *p_anim, short *p_first)
 {
-    ubyte *blk_begin;
     ubyte *cbuf;
     ubyte *pbuf;
-    ubyte *cbf;
-    ubyte *pbf;
     short h;
-    short w;
     short hend;
-    short wend;
-    short hdim;
-    short wendt;
-    short k;
-    short nsame;
-    short ndiff;
+    int beg, end;
     int blksize;
 
-    blk_begin = p_anim->ChunkBuf;
     cbuf = p_anim->FrameBuffer;
     pbuf = p_anim->PvFrameBuf;
-    // Find first line with differences
+    // Find first line with differences; only damaged part of every line is compared
     for (hend = p_anim->FLCFileHeader.Height; hend > 0;  hend--)
     {
-        wend = 0;
-        for (w = p_anim->FLCFileHeader.Width; w > 0; w--)
-        {
-            if (cbuf[wend] != pbuf[wend])
-                break;
-            ++wend;
-        }
-        if (wend != p_anim->FLCFileHeader.Width)
+        if (anim_damage_line(p_anim, p_anim->FLCFileHeader.Height - hend, &beg, &end) &&
+          (anim_scan_same(cbuf + beg, pbuf + beg, end - beg) != end - beg))
             break;
         cbuf += p_anim->Scanline;
         pbuf += p_anim->Scanline;
     }
-    if (hend != 0)
+    if (hend == 0)
+        return 0;
+    // Recompute to get first line with differences
+    hend = p_anim->FLCFileHeader.Height - hend;
+    blksize = p_anim->FLCFileHeader.Width * (p_anim->FLCFileHeader.Height - 1);
+    cbuf = p_anim->FrameBuffer + blksize;
+    pbuf = p_anim->PvFrameBuf + blksize;
+    // Find last line with differences
+    for (h = p_anim->FLCFileHeader.Height; h > 0; h--) {
+        if (anim_damage_line(p_anim, h - 1, &beg, &end) &&
+          (anim_scan_same(cbuf + beg, pbuf + beg, end - beg) != end - beg))
+            break;
+        cbuf -= p_anim->Scanline;
+        pbuf -= p_anim->Scanline;
+    }
+    *p_first = hend;
+    return h - hend;
+}
+
+/**
+ * Compress given amount of frame lines, starting at given line, into FLI's LC packets.
+ * Every line is encoded independently, so the lines may be split into bands.
+ */
+static void anim_make_FLI_LC_lines(struct Animation *p_anim, ubyte *cbuf, ubyte *pbuf,
+  short line, short nlines)
+{
+    ubyte *cbf;
+    ubyte *pbf;
+    short h;
+    short w;
+    short wend;
+    short wendt;
+    short k;
+    short nsame;
+    short ndiff;
+    int skip;
+    int end;
+
+    for (h = nlines; h > 0; h--, line++)
     {
-        // Recompute to get first line with differences
-        hend = p_anim->FLCFileHeader.Height - hend;
-        blksize = p_anim->FLCFileHeader.Width * (p_anim->FLCFileHeader.Height - 1);
-        cbuf = p_anim->FrameBuffer + blksize;
-        pbuf = p_anim->PvFrameBuf + blksize;
-        // Find last line with differences
-        for (h = p_anim->FLCFileHeader.Height; h > 0; h--) {
-            wend = 0;
-            for (w = p_anim->FLCFileHeader.Width; w > 0; w--) {
-                if (cbuf[wend] != pbuf[wend])
-                    break;
-                wend++;
-            }
-            if (wend != p_anim->FLCFileHeader.Width)
-                break;
-            cbuf -= p_anim->Scanline;
-            pbuf -= p_anim->Scanline;
-        }
-        hdim = h - hend;
-        blksize = p_anim->FLCFileHeader.Width * hend;
-        cbuf = p_anim->FrameBuffer + blksize;
-        pbuf = p_anim->PvFrameBuf + blksize;
-        // Store amount of empty lines to skip
-        *(ushort *)p_anim->ChunkBuf = hend;
-        p_anim->ChunkBuf += 2;
-        // Store amount of following encoded lines
-        *(ushort *)p_anim->ChunkBuf = hdim;
-        p_anim->ChunkBuf += 2;
+        ubyte *pckt_count;
+        TbBool damaged;
 
-        for (h = hdim; h > 0; h--)
+        cbf = cbuf;
+        pbf = pbuf;
+        // Remember pointer to amount of encoded packets within line
+        pckt_count = p_anim->ChunkBuf;
+        *pckt_count = 0;
+        p_anim->ChunkBuf++;
+        // Line which is not damaged needs no packets
+        damaged = anim_damage_line(p_anim, line, &skip, &end);
+        for (w = damaged ? p_anim->FLCFileHeader.Width : 0; w > 0; )
         {
-            ubyte *pckt_count;
-
-            cbf = cbuf;
-            pbf = pbuf;
-            // Remember pointer to amount of encoded packets within line
-            pckt_count = p_anim->ChunkBuf;
-            *pckt_count = 0;
-            p_anim->ChunkBuf++;
-            for (w = p_anim->FLCFileHeader.Width; w > 0; )
+            // Skip identical pixels at line start; pixels before damaged part are known to be
+            wend = skip + anim_scan_same(cbf + skip, pbf + skip, w - skip);
+            w -= wend;
+            skip = 0;
+            wendt = wend;
+            // If whole line was identical, move to next one
+            if (p_anim->FLCFileHeader.Width == wend) continue;
+            // If all pixels until EOLN were identical, finish packets for this line
+            if (w <= 0) break;
+            // Store empty pixel counts above 255 as separate packets
+            while (wend > 255) {
+                // Store packet skip pixels count
+                *(ubyte *)p_anim->ChunkBuf = 255;
+                p_anim->ChunkBuf++;
+                // Store packet RLE pixels count
+                *(ubyte *)p_anim->ChunkBuf = 0;
+                p_anim->ChunkBuf++;
+                wend -= 255;
+                (*(ubyte *)pckt_count)++;
+            }
+            // Now the remaining empty pixel count is guaranteed to fit one byte
+            cbf += wendt;
+            pbf += wendt;
+            // Count consecutive identical pixels
+            k = 0;
+            nsame = 0;
+            // If not in delta mode, store pixels again if it decreases encoded size
+            if ((p_anim->Flags & AniFlg_ALL_DELTA) == 0)
             {
-                // Skip identical pixels at line start
-                for (wend = 0; w > 0; wend++) {
-                    if (cbf[wend] != pbf[wend]) break;
+                while (w > 1) {
+                    if (nsame == -127) // We can store up to 127 in one packet
+                        break;
+                    // If 3 pixels in a row did not changed from previous frame, stop counting
+                    if ((cbf[k+0] == pbf[k+0]) &&
+                      (cbf[k+1] == pbf[k+1]) &&
+                      (cbf[k+2] == pbf[k+2]))
+                        break;
+                    if (cbf[k+1] != cbf[0])
+                        break;
                     w--;
+                    k++;
+                    nsame--;
                 }
-                wendt = wend;
-                // If whole line was identical, move to next one
-                if (p_anim->FLCFileHeader.Width == wend) continue;
-                // If all pixels until EOLN were identical, finish packets for this line
-                if (w <= 0) break;
-                // Store empty pixel counts above 255 as separate packets
-                while (wend > 255) {
-                    // Store packet skip pixels count
-                    *(ubyte *)p_anim->ChunkBuf = 255;
-                    p_anim->ChunkBuf++;
-                    // Store packet RLE pixels count
-                    *(ubyte *)p_anim->ChunkBuf = 0;
-                    p_anim->ChunkBuf++;
-                    wend -= 255;
-                    (*(ubyte *)pckt_count)++;
+            }
+            else // Delta only mode - never store unchanged pixels
+            {
+                while (w > 1) {
+                    if (nsame == -127) // We can store up to 127 in one packet
+                        break;
+                    // If even one pixel did not changed from previous frame, stop counting
+                    if (cbf[k+0] == pbf[k+0])
+                        break;
+                    if (cbf[k+1] != cbf[0])
+                        break;
+                    w--;
+                    k++;
+                    nsame--;
                 }
-                // Now the remaining empty pixel count is guaranteed to fit one byte
-                cbf += wendt;
-                pbf += wendt;
-                // Count consecutive identical pixels
-                k = 0;
-                nsame = 0;
-                // If not in delta mode, store pixels again if it decreases encoded size
-                if ((p_anim->Flags & AniFlg_ALL_DELTA) == 0)
-                {
-                    while (w > 1) {
-                        if (nsame == -127) // We can store up to 127 in one packet
-                            break;
-                        // If 3 pixels in a row did not changed from previous frame, stop counting
-                        if ((cbf[k+0] == pbf[k+0]) &&
-                          (cbf[k+1] == pbf[k+1]) &&
-                          (cbf[k+2] == pbf[k+2]))
-                            break;
-                        if (cbf[k+1] != cbf[0])
-                            break;
-                        w--;
-                        k++;
-                        nsame--;
-                    }
+            }
+            if ( nsame ) {
+                if (nsame != -127) {
+                    nsame--;
+                    w--;
                 }
-                else // Delta only mode - never store unchanged pixels
-                {
-                    while (w > 1) {
-                        if (nsame == -127) // We can store up to 127 in one packet
-                            break;
-                        // If even one pixel did not changed from previous frame, stop counting
-                        if (cbf[k+0] == pbf[k+0])
-                            break;
-                        if (cbf[k+1] != cbf[0])
-                            break;
-                        w--;
-                        k++;
-                        nsame--;
+                // Store packet skip pixels count
+                *(ubyte *)p_anim->ChunkBuf = wend;
+                p_anim->ChunkBuf++;
+                // Store packet RLE pixels count (negative count means replicate)
+                *(ubyte *)p_anim->ChunkBuf = nsame;
+                p_anim->ChunkBuf++;
+                // Store packet RLE pixel value
+                *(ubyte *)p_anim->ChunkBuf = cbf[0];
+                cbf -= nsame;
+                pbf -= nsame;
+                p_anim->ChunkBuf++;
+                (*(ubyte *)pckt_count)++;
+            } else {
+                if (w == 1) {
+                    ndiff = nsame + 1;
+                    w--;
+                } else {
+                    k = 0;
+                    ndiff = 0;
+                    // If not in delta mode, store pixels again if it decreases encoded size
+                    if ((p_anim->Flags & AniFlg_ALL_DELTA) == 0)
+                    {
+                        while (w != 0) {
+                            if (ndiff == 127)
+                                break;
+                            if ((cbf[k+0] == pbf[k+0]) &&
+                              (cbf[k+1] == pbf[k+1]) &&
+                              (cbf[k+2] == pbf[k+2]))
+                                break;
+                            if ((cbf[k+1] == cbf[k+0]) &&
+                              (cbf[k+2] == cbf[k+0]) &&
+                              (cbf[k+3] == cbf[k+0]))
+                                break;
+                            w--;
+                            k++;
+                            ndiff++;
+                        }
                     }
-                }
-                if ( nsame ) {
-                    if (nsame != -127) {
-                        nsame--;
-                        w--;
+                    else // Delta only mode - never store unchanged pixels
+                    {
+                        while (w != 0) {
+                            if (ndiff == 127)
+                                break;
+                            if (cbf[k+0] == pbf[k+0])
+                                break;
+                            if ((cbf[k+1] == cbf[k+0]) &&
+                              (cbf[k+2] == cbf[k+0]) &&
+                              (cbf[k+3] == cbf[k+0]))
+                                break;
+                            w--;
+                            k++;
+                            ndiff++;
+                        }
                     }
-                    // Store packet skip pixels count
+                }
+                if (ndiff != 0) {
                     *(ubyte *)p_anim->ChunkBuf = wend;
                     p_anim->ChunkBuf++;
-                    // Store packet RLE pixels count (negative count means replicate)
-                    *(ubyte *)p_anim->ChunkBuf = nsame;
-                    p_anim->ChunkBuf++;
-                    // Store packet RLE pixel value
-                    *(ubyte *)p_anim->ChunkBuf = cbf[0];
-                    cbf -= nsame;
-                    pbf -= nsame;
+                    *(ubyte *)p_anim->ChunkBuf = ndiff;
                     p_anim->ChunkBuf++;
+                    LbMemoryCopy(p_anim->ChunkBuf, cbf, ndiff);
+                    p_anim->ChunkBuf += ndiff;
+                    cbf += ndiff;
+                    pbf += ndiff;
                     (*(ubyte *)pckt_count)++;
-                } else {
-                    if (w == 1) {
-                        ndiff = nsame + 1;
-                        w--;
-                    } else {
-                        k = 0;
-                        ndiff = 0;
-                        // If not in delta mode, store pixels again if it decreases encoded size
-                        if ((p_anim->Flags & AniFlg_ALL_DELTA) == 0)
-                        {
-                            while (w != 0) {
-                                if (ndiff == 127)
-                                    break;
-                                if ((cbf[k+0] == pbf[k+0]) &&
-                                  (cbf[k+1] == pbf[k+1]) &&
-                                  (cbf[k+2] == pbf[k+2]))
-                                    break;
-                                if ((cbf[k+1] == cbf[k+0]) &&
-                                  (cbf[k+2] == cbf[k+0]) &&
-                                  (cbf[k+3] == cbf[k+0]))
-                                    break;
-                                w--;
-                                k++;
-                                ndiff++;
-                            }
-                        }
-                        else // Delta only mode - never store unchanged pixels
-                        {
-                            while (w != 0) {
-                                if (ndiff == 127)
-                                    break;
-                                if (cbf[k+0] == pbf[k+0])
-                                    break;
-                                if ((cbf[k+1] == cbf[k+0]) &&
-                                  (cbf[k+2] == cbf[k+0]) &&
-                                  (cbf[k+3] == cbf[k+0]))
-                                    break;
-                                w--;
-                                k++;
-                                ndiff++;
-                            }
-                        }
-                    }
-                    if (ndiff != 0) {
-                        *(ubyte *)p_anim->ChunkBuf = wend;
-                        p_anim->ChunkBuf++;
-                        *(ubyte *)p_anim->ChunkBuf = ndiff;
-                        p_anim->ChunkBuf++;
-                        LbMemoryCopy(p_anim->ChunkBuf, cbf, ndiff);
-                        p_anim->ChunkBuf += ndiff;
-                        cbf += ndiff;
-                        pbf += ndiff;
-                        (*(ubyte *)pckt_count)++;
-                    }
                 }
             }
-            cbuf += p_anim->Scanline;
-            pbuf += p_anim->Scanline;
         }
+        cbuf += p_anim->Scanline;
+        pbuf += p_anim->Scanline;
+    }
+}
+
+/**
+ * Stores header of FLI's LC block with changes, or whole block of frame without changes.
+ */
+static void anim_make_FLI_LC_head(struct Animation *p_anim, short hend, short hdim)
+{
+    if (hdim != 0)
+    {
+        // Store amount of empty lines to skip
+        *(ushort *)p_anim->ChunkBuf = hend;
+        p_anim->ChunkBuf += 2;
+        // Store amount of following encoded lines
+        *(ushort *)p_anim->ChunkBuf = hdim;
+        p_anim->ChunkBuf += 2;
     }
     else // All lines were identical - empty frame
     {
@@ -622,6 +944,29 @@ u32 anim_make_FLI_LC(struct Animation *p_anim)
         *(sbyte *)p_anim->ChunkBuf = 0;
         p_anim->ChunkBuf++;
     }
+}
+
+/**
+ * Compress data into FLI's LC block.
+ * @return Returns packed size of the block which was compressed.
+ */
+u32 anim_make_FLI_LC(struct Animation *p_anim)
+{
+    ubyte *blk_begin;
+    short hend;
+    short hdim;
+    int blksize;
+
+    blk_begin = p_anim->ChunkBuf;
+    hend = 0;
+    hdim = anim_make_FLI_LC_range(p_anim, &hend);
+    anim_make_FLI_LC_head(p_anim, hend, hdim);
+    if (hdim != 0)
+    {
+        blksize = p_anim->FLCFileHeader.Width * hend;
+        anim_make_FLI_LC_lines(p_anim, p_anim->FrameBuffer + blksize,
+          p_anim->PvFrameBuf + blksize, hend, hdim);
+    }
     // Make the block size even (req. by FLI spec)
     if ((intptr_t)p_anim->ChunkBuf & 1) {
         *p_anim->ChunkBuf = '\0';
@@ -643,6 +988,82 @@ u32 anim_buffer_size(int width, int height, int depth)
     return abs(width)*abs(height)*n + 32767;
 }
 
+/**
+ * Returns max size of one line encoded into BRUN or LC packets.
+ * Both need less than 2 bytes per pixel in the worst case.
+ */
+static u32 anim_make_line_max(int width, int depth)
+{
+    return 2 * anim_frame_size(width, 1, depth) + 8;
+}
+
+u32 anim_scratch_size(int width, int height, int depth)
+{
+    // Previous frame and chunk buffer
+    return anim_frame_size(width, height, depth) + anim_buffer_size(width, height, depth);
+}
+
+/**
+ * Returns size of the buffer where alternative compressions of delta frames are encoded.
+ */
+static u32 anim_make_encode_size(int width, int height, int depth)
+{
+    // Regions for BRUN and SS2 candidates; one more byte allows the candidate data
+    // to start at the same address parity as in chunk buffer; then band areas where
+    // lines of BRUN and LC blocks are encoded by parallel jobs
+    return 2 * anim_buffer_size(width, height, depth) + 1 +
+      2 * abs(height) * anim_make_line_max(width, depth);
+}
+
+void anim_make_set_parallel(AnimParallelFunc func)
+{
+    anim_make_parallel = func;
+}
+
+int anim_make_set_kernels(int kernels)
+{
+    int best = AniKrn_SCALAR;
+#if defined(__SSE2__)
+    best = AniKrn_SSE2;
+#endif
+#if defined(ANIM_SCAN_AVX2)
+    if (__builtin_cpu_supports("avx2"))
+        best = AniKrn_AVX2;
+#endif
+    anim_scan_kernels = (kernels < best) ? kernels : best;
+    return anim_scan_kernels;
+}
+
+/**
+ * Returns colour depth of the recorded animation.
+ */
+static int anim_make_depth(struct Animation *p_anim)
+{
+#if defined(LB_ENABLE_FLIC_FULL_HEADER)
+    return p_anim->FLCFileHeader.Depth;
+#else
+    return 8;
+#endif
+}
+
+/**
+ * Gives start of region for encoding candidate chunk data, with index starting at 1.
+ * Regions are within encode buffer, and start at the same address parity as the chunk
+ * data, so that the even size padding is the same as if encoded in place.
+ */
+static ubyte *anim_make_candidate_buf(struct Animation *p_anim, ubyte *dataptr, int idx)
+{
+    ubyte *buf;
+    int width, height, depth;
+
+    width = p_anim->FLCFileHeader.Width;
+    height = p_anim->FLCFileHeader.Height;
+    depth = anim_make_depth(p_anim);
+    buf = p_anim->EncodeBuf + (idx - 1) * anim_buffer_size(width, height, depth);
+    buf += ((intptr_t)buf ^ (intptr_t)dataptr) & 1;
+    return buf;
+}
+
 TbResult anim_flic_make_open(struct Animation *p_anim, int width, int height, int bpp, uint flags)
 {
     if (flags & p_anim->Flags) {
@@ -653,8 +1074,9 @@ TbResult anim_flic_make_open(struct Animation *p_anim, int width, int height, in
         LOGSYNC("Record new anim, '%s' file", p_anim->Filename);
         p_anim->Flags |= flags;
 
-        p_anim->FileHandle = LbFileOpen(p_anim->Filename, Lb_FILE_MODE_NEW);
-        if (p_anim->FileHandle == INVALID_FILE) {
+        if ((p_anim->Flags & AniFlg_NO_WRITE) == 0)
+            p_anim->FileHandle = LbFileOpen(p_anim->Filename, Lb_FILE_MODE_NEW);
+        if (((p_anim->Flags & AniFlg_NO_WRITE) == 0) && (p_anim->FileHandle == INVALID_FILE)) {
             LOGERR("Cannot open anim file");
             return Lb_FAIL;
         }
@@ -685,7 +1107,7 @@ TbResult anim_flic_make_open(struct Animation *p_anim, int width, int height, in
             p_anim->FileHandle = INVALID_FILE;
             return Lb_FAIL;
         }
-        LbMemorySet(anim_palette, -1, sizeof(anim_palette));
+        LbMemorySet(anim_ctx_palette(p_anim), -1, sizeof(anim_palette));
     }
     if ((flags & AniFlg_APPEND) != 0)  {
         LOGSYNC("Resume recording, '%s' file",p_anim->Filename);
@@ -719,12 +1141,181 @@ TbResult anim_flic_make_open(struct Animation *p_anim, int width, int height, in
         LbFileSeek(p_anim->FileHandle, 0, Lb_FILE_SEEK_END);
         p_anim->FrameNumber = p_anim->FLCFileHeader.NumberOfFrames;
     }
+    if ((flags & (AniFlg_RECORD|AniFlg_APPEND)) != 0) {
+        free(p_anim->EncodeBuf);
+        p_anim->EncodeBuf = malloc(anim_make_encode_size(p_anim->FLCFileHeader.Width,
+          p_anim->FLCFileHeader.Height, anim_make_depth(p_anim)));
+        if (p_anim->EncodeBuf == NULL) {
+            LOGERR("Cannot allocate anim encode buffer");
+            if (p_anim->FileHandle != INVALID_FILE)
+                LbFileClose(p_anim->FileHandle);
+            p_anim->FileHandle = INVALID_FILE;
+            return Lb_NO_MEMORY;
+        }
+    }
     return Lb_SUCCESS;
 }
 
+/**
+ * Runs one job of encoding frame blocks; BRUN bands go first, then SS2 block, then LC bands.
+ */
+static void anim_make_job(void *ctx, int idx)
+{
+    struct AnimMakeJobs *p_jobs;
+    struct Animation anim;
+    short first, nlines;
+    u32 offs;
+
+    p_jobs = (struct AnimMakeJobs *)ctx;
+    // Every job writes through own copy of the animation, having its own chunk pointer
+    anim = *p_jobs->p_anim;
+    if (idx < p_jobs->brun_bands)
+    {
+        first = idx * p_jobs->brun_band_lines;
+        nlines = anim.FLCFileHeader.Height - first;
+        if (nlines > p_jobs->brun_band_lines)
+            nlines = p_jobs->brun_band_lines;
+        anim.ChunkBuf = p_jobs->band_area[0] + first * p_jobs->line_max;
+        anim_make_FLI_BRUN_lines(&anim, anim.FrameBuffer + first * anim.Scanline, nlines);
+        p_jobs->band_end[0][idx] = anim.ChunkBuf;
+        return;
+    }
+    idx -= p_jobs->brun_bands;
+    if (p_jobs->ss2_buf != NULL)
+    {
+        if (idx == 0) {
+            anim.ChunkBuf = p_jobs->ss2_buf;
+            p_jobs->ss2_size = anim_make_FLI_SS2(&anim);
+            return;
+        }
+        idx--;
+    }
+    first = idx * p_jobs->lc_band_lines;
+    nlines = p_jobs->lc_lines - first;
+    if (nlines > p_jobs->lc_band_lines)
+        nlines = p_jobs->lc_band_lines;
+    anim.ChunkBuf = p_jobs->band_area[1] + first * p_jobs->line_max;
+    // Same addressing as anim_make_FLI_LC() uses for the first changed line and the following ones
+    offs = anim.FLCFileHeader.Width * p_jobs->lc_first + first * anim.Scanline;
+    anim_make_FLI_LC_lines(&anim, anim.FrameBuffer + offs, anim.PvFrameBuf + offs,
+      p_jobs->lc_first + first, nlines);
+    p_jobs->band_end[1][idx] = anim.ChunkBuf;
+}
+
+/**
+ * Joins encoded bands into one block at chunk pointer, and pads the block to even size.
+ */
+static void anim_make_join_bands(struct Animation *p_anim, struct AnimMakeJobs *p_jobs, int kind,
+  short nbands, short band_lines)
+{
+    ubyte *band;
+    short i;
+
+    for (i = 0; i < nbands; i++)
+    {
+        band = p_jobs->band_area[kind] + i * band_lines * p_jobs->line_max;
+        LbMemoryCopy(p_anim->ChunkBuf, band, p_jobs->band_end[kind][i] - band);
+        p_anim->ChunkBuf += p_jobs->band_end[kind][i] - band;
+    }
+    // Make the block size even (req. by FLI spec)
+    if ((intptr_t)p_anim->ChunkBuf & 1) {
+        *p_anim->ChunkBuf = '\0';
+        p_anim->ChunkBuf++;
+    }
+}
+
+/**
+ * Gives amount of bands to split given amount of lines into, and lines in each band.
+ */
+static short anim_make_bands(short nlines, short *p_band_lines)
+{
+    short nbands;
+
+    nbands = (nlines + ANIM_MAKE_BAND_LINES - 1) / ANIM_MAKE_BAND_LINES;
+    if (nbands > ANIM_MAKE_BANDS_MAX)
+        nbands = ANIM_MAKE_BANDS_MAX;
+    if (nbands < 1)
+        nbands = 1;
+    *p_band_lines = (nlines + nbands - 1) / nbands;
+    return nbands;
+}
+
+/**
+ * Encodes blocks of the frame: BRUN into brun_buf, SS2 into ss2_buf and LC into lc_buf;
+ * a block with NULL buffer is not encoded. If parallel jobs function is set and the frame
+ * is big enough, the blocks are encoded at the same time, with lines of BRUN and LC blocks
+ * split into bands.
+ * The result is the same either way.
+ */
+static void anim_make_blocks(struct Animation *p_anim, ubyte *brun_buf, s32 *p_brun_size,
+  ubyte *ss2_buf, s32 *p_ss2_size, ubyte *lc_buf, s32 *p_lc_size)
+{
+    struct AnimMakeJobs jobs;
+    AnimParallelFunc parallel;
+    int width, height, depth;
+    int njobs;
+
+    width = p_anim->FLCFileHeader.Width;
+    height = p_anim->FLCFileHeader.Height;
+    if (p_anim->Context != NULL)
+        parallel = p_anim->Context->Parallel;
+    else
+        parallel = anim_make_parallel;
+    if ((width < ANIM_MAKE_PARALLEL_WIDTH) || (height < ANIM_MAKE_PARALLEL_LINES))
+        parallel = NULL;
+    if (parallel == NULL)
+    {
+        if (brun_buf != NULL) {
+            p_anim->ChunkBuf = brun_buf;
+            *p_brun_size = anim_make_FLI_BRUN(p_anim);
+        }
+        if (ss2_buf != NULL) {
+            p_anim->ChunkBuf = ss2_buf;
+            *p_ss2_size = anim_make_FLI_SS2(p_anim);
+        }
+        if (lc_buf != NULL) {
+            p_anim->ChunkBuf = lc_buf;
+            *p_lc_size = anim_make_FLI_LC(p_anim);
+        }
+        return;
+    }
+    depth = anim_make_depth(p_anim);
+    LbMemorySet(&jobs, 0, sizeof(jobs));
+    jobs.p_anim = p_anim;
+    jobs.line_max = anim_make_line_max(width, depth);
+    jobs.band_area[0] = p_anim->EncodeBuf + 2 * anim_buffer_size(width, height, depth) + 1;
+    jobs.band_area[1] = jobs.band_area[0] + height * jobs.line_max;
+    if (brun_buf != NULL)
+        jobs.brun_bands = anim_make_bands(height, &jobs.brun_band_lines);
+    jobs.ss2_buf = ss2_buf;
+    if (lc_buf != NULL)
+    {
+        // Range of changed lines is needed to split them into bands
+        jobs.lc_lines = anim_make_FLI_LC_range(p_anim, &jobs.lc_first);
+        if (jobs.lc_lines > 0)
+            jobs.lc_bands = anim_make_bands(jobs.lc_lines, &jobs.lc_band_lines);
+    }
+    njobs = jobs.brun_bands + ((ss2_buf != NULL) ? 1 : 0) + jobs.lc_bands;
+    if (njobs > 0)
+        parallel(anim_make_job, &jobs, njobs);
+    if (brun_buf != NULL) {
+        p_anim->ChunkBuf = brun_buf;
+        anim_make_join_bands(p_anim, &jobs, 0, jobs.brun_bands, jobs.brun_band_lines);
+        *p_brun_size = p_anim->ChunkBuf - brun_buf;
+    }
+    if (ss2_buf != NULL) {
+        *p_ss2_size = jobs.ss2_size;
+    }
+    if (lc_buf != NULL) {
+        p_anim->ChunkBuf = lc_buf;
+        anim_make_FLI_LC_head(p_anim, jobs.lc_first, jobs.lc_lines);
+        anim_make_join_bands(p_anim, &jobs, 1, jobs.lc_bands, jobs.lc_band_lines);
+        *p_lc_size = p_anim->ChunkBuf - lc_buf;
+    }
+}
+
 void anim_make_prep_next_frame(struct Animation *p_anim, ubyte *frmbuf)
 {
-    u32 max_chunk_size;
     int width, height, depth;
 
     if (((p_anim->Flags & AniFlg_APPEND) != 0) && (frmbuf != NULL)) {
@@ -740,10 +1331,9 @@ void anim_make_prep_next_frame(struct Animation *p_anim, ubyte *frmbuf)
 #else
     depth = 8;
 #endif
-    p_anim->PvFrameBuf = anim_scratch;
-    p_anim->ChunkBuf = anim_scratch + anim_frame_size(width, height, depth);
-    max_chunk_size = anim_buffer_size(width, height, depth);
-    LbMemorySet(p_anim->ChunkBuf, 0, max_chunk_size);
+    p_anim->PvFrameBuf = anim_ctx_scratch(p_anim);
+    // No need to clear the chunk buffer, encoders write every byte of their data
+    p_anim->ChunkBuf = p_anim->PvFrameBuf + anim_frame_size(width, height, depth);
 
     // Store frame chunk
     p_anim->FLCFrameChunk.Type = FLI_FRAME_CHUNK;
@@ -753,13 +1343,20 @@ void anim_make_prep_next_frame(struct Animation *p_anim, ubyte *frmbuf)
 }
 
 TbBool anim_make_next_frame(struct Animation *p_anim, ubyte *palette)
+{
+    return anim_make_next_frame_damage(p_anim, palette, NULL);
+}
+
+TbBool anim_make_next_frame_damage(struct Animation *p_anim, ubyte *palette,
+  const struct AnimFrameDamage *p_damage)
 {
     struct FLCFrameDataChunk lochunk;
     struct FLCFrameDataChunk *p_fdthunk;
     s32 scrpoints, brun_size, lc_size, ss2_size;
 
     LOGDBG("Start making frame %d", (int)p_anim->FrameNumber);
-    anim_parse_tags[0] = 0;
+    p_anim->Damage = p_damage;
+    anim_ctx_parse_tags(p_anim)[0] = 0;
     // Store frame header initially filled by `prep_next_frame`
     anim_store_data(p_anim, &p_anim->FLCFrameChunk, sizeof(struct FLCFrameChunk));
 
@@ -781,7 +1378,7 @@ TbBool anim_make_next_frame(struct Animation *p_anim, ubyte *palette)
         p_anim->FLCFrameChunk.Chunks++;
         p_fdthunk->Type = FLI_COLOUR256;
         p_fdthunk->Size = p_anim->ChunkBuf - (ubyte *)p_fdthunk;
-        strncat(anim_parse_tags, "COLOUR256 ", sizeof(anim_parse_tags)-1);
+        anim_parse_tags_add(p_anim, "COLOUR256 ");
 
         // Remember where chunk header starts
         p_fdthunk = (struct FLCFrameDataChunk *)p_anim->ChunkBuf;
@@ -798,76 +1395,82 @@ TbBool anim_make_next_frame(struct Animation *p_anim, ubyte *palette)
         // Note that SS2 compression stores pixels in pairs, so
         // odd transperent pixels would be turned solid - hence no SS2
         dataptr = p_anim->ChunkBuf;
-        p_anim->ChunkBuf = dataptr;
-        lc_size = anim_make_FLI_LC(p_anim);
+        anim_make_blocks(p_anim, NULL, NULL, NULL, NULL, dataptr, &lc_size);
+        p_anim->ChunkBuf = dataptr + lc_size;
         {
             // Store the LC compressed data
             p_anim->FLCFrameChunk.Chunks++;
             p_fdthunk->Type = FLI_LC;
-            strncat(anim_parse_tags, "LC ", sizeof(anim_parse_tags)-1);
+            anim_parse_tags_add(p_anim, "LC ");
         }
     }
     else if (p_anim->FrameNumber == 0)
     {
-        if (anim_make_FLI_BRUN(p_anim)) {
+        ubyte *dataptr;
+        dataptr = p_anim->ChunkBuf;
+        anim_make_blocks(p_anim, dataptr, &brun_size, NULL, NULL, NULL, NULL);
+        p_anim->ChunkBuf = dataptr + brun_size;
+        if (brun_size) {
             p_anim->FLCFrameChunk.Chunks++;
             p_fdthunk->Type = FLI_BRUN;
-            strncat(anim_parse_tags, "BRUN ", sizeof(anim_parse_tags)-1);
+            anim_parse_tags_add(p_anim, "BRUN ");
         } else {
+            p_anim->ChunkBuf = dataptr;
             anim_make_FLI_COPY(p_anim);
             p_anim->FLCFrameChunk.Chunks++;
             p_fdthunk->Type = FLI_COPY;
-            strncat(anim_parse_tags, "COPY ", sizeof(anim_parse_tags)-1);
+            anim_parse_tags_add(p_anim, "COPY ");
         }
     }
     else
     {
         ubyte *dataptr;
-        // Determining the best compression method
+        ubyte *brun_buf;
+        ubyte *ss2_buf;
+        // Determining the best compression method; every candidate is encoded
+        // into its own region, so the best one does not need encoding again
         dataptr = p_anim->ChunkBuf;
-        brun_size = anim_make_FLI_BRUN(p_anim);
-        LbMemorySet(dataptr, 0, brun_size);
-        p_anim->ChunkBuf = dataptr;
-        ss2_size = anim_make_FLI_SS2(p_anim);
-        LbMemorySet(dataptr, 0, ss2_size);
-        p_anim->ChunkBuf = dataptr;
-        lc_size = anim_make_FLI_LC(p_anim);
+        brun_buf = anim_make_candidate_buf(p_anim, dataptr, 1);
+        ss2_buf = anim_make_candidate_buf(p_anim, dataptr, 2);
+        if ((p_damage != NULL) && (p_damage->Lines == 0) && (p_anim->FLCFileHeader.Height >= 3))
+        {
+            // Frame without changes gets empty SS2 or LC, made by skipping all lines; BRUN
+            // takes at least 3 bytes per line, so it is longer than empty LC and never chosen
+            brun_buf = NULL;
+            brun_size = scrpoints + 16;
+        }
+        anim_make_blocks(p_anim, brun_buf, &brun_size, ss2_buf, &ss2_size, dataptr, &lc_size);
+        p_anim->ChunkBuf = dataptr + lc_size;
         if ((lc_size < ss2_size) && (lc_size < brun_size)) {
             // Store the LC compressed data
             p_anim->FLCFrameChunk.Chunks++;
             p_fdthunk->Type = FLI_LC;
-            strncat(anim_parse_tags, "LC ", sizeof(anim_parse_tags)-1);
+            anim_parse_tags_add(p_anim, "LC ");
         } else if (ss2_size < brun_size) {
-            // Clear the LC compressed data
-            LbMemorySet(dataptr, 0, lc_size);
-            p_anim->ChunkBuf = dataptr;
-            // Compress with SS2 method
-            anim_make_FLI_SS2(p_anim);
+            // Replace the LC compressed data with SS2 one
+            LbMemoryCopy(dataptr, ss2_buf, ss2_size);
+            p_anim->ChunkBuf = dataptr + ss2_size;
             p_anim->FLCFrameChunk.Chunks++;
             p_fdthunk->Type = FLI_SS2;
-            strncat(anim_parse_tags, "SS2 ", sizeof(anim_parse_tags)-1);
+            anim_parse_tags_add(p_anim, "SS2 ");
         } else if (brun_size < scrpoints + 16) {
-            // Clear the LC compressed data
-            LbMemorySet(dataptr, 0, lc_size);
-            p_anim->ChunkBuf = dataptr;
-            // Compress with BRUN method
-            anim_make_FLI_BRUN(p_anim);
+            // Replace the LC compressed data with BRUN one
+            LbMemoryCopy(dataptr, brun_buf, brun_size);
+            p_anim->ChunkBuf = dataptr + brun_size;
             p_anim->FLCFrameChunk.Chunks++;
             p_fdthunk->Type = FLI_BRUN;
-            strncat(anim_parse_tags, "BRUN ", sizeof(anim_parse_tags)-1);
+            anim_parse_tags_add(p_anim, "BRUN ");
         } else {
-            // Clear the LC compressed data
-            LbMemorySet(dataptr, 0, lc_size);
             p_anim->ChunkBuf = dataptr;
             // Store uncompressed frame data
             anim_make_FLI_COPY(p_anim);
             p_anim->FLCFrameChunk.Chunks++;
             p_fdthunk->Type = FLI_COPY;
-            strncat(anim_parse_tags, "COPY ", sizeof(anim_parse_tags)-1);
+            anim_parse_tags_add(p_anim, "COPY ");
         }
     }
     p_fdthunk->Size = p_anim->ChunkBuf - (ubyte *)p_fdthunk;
-    LOGDBG("Chunks: %s", anim_parse_tags);
+    LOGDBG("Chunks: %s", anim_ctx_parse_tags(p_anim));
     {
         ubyte *chunk_buf_start;
         int width, height, depth;
@@ -879,19 +1482,21 @@ TbBool anim_make_next_frame(struct Animation *p_anim, ubyte *palette)
 #else
         depth = 8;
 #endif
-        chunk_buf_start = anim_scratch + anim_frame_size(width, height, depth);
+        chunk_buf_start = (ubyte *)anim_ctx_scratch(p_anim) + anim_frame_size(width, height, depth);
 
         p_anim->FLCFrameChunk.Size = p_anim->ChunkBuf - chunk_buf_start;
         LbMemoryCopy(chunk_buf_start, &p_anim->FLCFrameChunk, sizeof(struct FLCFrameChunk));
 
         if (!anim_write_data(p_anim, chunk_buf_start, p_anim->FLCFrameChunk.Size)) {
             LOGDBG("Finished frame with error");
+            p_anim->Damage = NULL;
             return false;
         }
     }
     anim_update_prev_frame(p_anim);
+    p_anim->Damage = NULL;
     if (palette != NULL)
-        LbMemoryCopy(anim_palette, palette, sizeof(anim_palette));
+        LbMemoryCopy(anim_ctx_palette(p_anim), palette, sizeof(anim_palette));
     p_anim->FLCFileHeader.NumberOfFrames++;
     p_anim->FrameNumber++;
     p_anim->FLCFileHeader.Size += p_anim->FLCFrameChunk.Size;
@@ -0,0 +1,160 @@
+/******************************************************************************/
+// PNG and PAL to RAW/DAT/SPR files converter for KeeperFX
+/******************************************************************************/
+/** @file atlaspack.cpp
+ *     Atlas packing support.
+ * @par Purpose:
+ *     Places sprites of various sizes on one or more atlas pages,
+ *     with skyline bottom-left algorithm.
+ * @par Comment:
+ *     None.
+ * @author   Tomasz Lis <listom@gmail.com>
+ * @par  Copying and copyrights:
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ */
+/******************************************************************************/
+
+#include "atlaspack.hpp"
+#include "prog_options.hpp"
+
+#include <algorithm>
+#include <climits>
+
+SkylinePage::SkylinePage(int nwidth, int nheight):width(nwidth),height(nheight)
+{
+    nodes.push_back(SkylineNode{0, 0, width});
+}
+
+/**
+ * Checks whether rectangle can be placed at left edge of given skyline node.
+ * @return The Y coordinate at which the rectangle would be placed, or -1 if it doesn't fit.
+ */
+int SkylinePage::fitAt(unsigned idx, int rwidth, int rheight) const
+{
+    int rx = nodes[idx].x;
+    if (rx + rwidth > width)
+        return -1;
+    int ry = 0;
+    int width_left = rwidth;
+    for (unsigned i = idx; width_left > 0; i++)
+    {
+        if (ry < nodes[i].y)
+            ry = nodes[i].y;
+        if (ry + rheight > height)
+            return -1;
+        width_left -= nodes[i].width;
+    }
+    return ry;
+}
+
+/**
+ * Updates skyline after placing rectangle at left edge of given node.
+ */
+void SkylinePage::placeAt(unsigned idx, int rx, int ry, int rwidth, int rheight)
+{
+    nodes.insert(nodes.begin()+idx, SkylineNode{rx, ry + rheight, rwidth});
+    // Shrink or remove nodes which are now below the new one
+    unsigned i = idx + 1;
+    while (i < nodes.size())
+    {
+        const SkylineNode& prev = nodes[i-1];
+        int shrink = prev.x + prev.width - nodes[i].x;
+        if (shrink <= 0)
+            break;
+        nodes[i].x += shrink;
+        nodes[i].width -= shrink;
+        if (nodes[i].width > 0)
+            break;
+        nodes.erase(nodes.begin()+i);
+    }
+    // Merge neighbouring nodes at the same level
+    for (i = 1; i < nodes.size(); )
+    {
+        if (nodes[i-1].y == nodes[i].y) {
+            nodes[i-1].width += nodes[i].width;
+            nodes.erase(nodes.begin()+i);
+        } else {
+            i++;
+        }
+    }
+}
+
+/**
+ * Allocates area for rectangle of given size, choosing the position with lowest bottom edge.
+ * @return True if the rectangle was placed, false if there is no space for it.
+ */
+bool SkylinePage::insert(int rwidth, int rheight, int& rx, int& ry)
+{
+    int best_bottom = INT_MAX;
+    int best_width = INT_MAX;
+    int best_idx = -1;
+    for (unsigned i = 0; i < nodes.size(); i++)
+    {
+        int y = fitAt(i, rwidth, rheight);
+        if (y < 0)
+            continue;
+        if ((y + rheight < best_bottom) || ((y + rheight == best_bottom) && (nodes[i].width < best_width)))
+        {
+            best_bottom = y + rheight;
+            best_width = nodes[i].width;
+            best_idx = i;
+            ry = y;
+        }
+    }
+    if (best_idx < 0)
+        return false;
+    rx = nodes[best_idx].x;
+    placeAt(best_idx, rx, ry, rwidth, rheight);
+    return true;
+}
+
+/**
+ * Places given rectangles on atlas pages of given size, opening new pages when needed.
+ * Rectangles are placed from the tallest; empty rectangles are put at start of first page.
+ */
+short atlas_pack(std::vector<AtlasRect>& rects, int page_width, int page_height, int& num_pages)
+{
+    std::vector<unsigned> order;
+    order.reserve(rects.size());
+    for (unsigned i = 0; i < rects.size(); i++)
+    {
+        AtlasRect& rect = rects[i];
+        rect.page = 0;
+        rect.x = 0;
+        rect.y = 0;
+        if ((rect.width <= 0) || (rect.height <= 0))
+            continue;
+        if ((rect.width > page_width) || (rect.height > page_height)) {
+            LogErr("Sprite %u of size %dx%d does not fit on atlas page of size %dx%d.",
+                i,rect.width,rect.height,page_width,page_height);
+            return ERR_LIMIT_EXCEED;
+        }
+        order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&rects](unsigned a, unsigned b) {
+        if (rects[a].height != rects[b].height)
+            return rects[a].height > rects[b].height;
+        return rects[a].width > rects[b].width;
+    });
+    std::vector<SkylinePage> pages;
+    for (auto idx = order.begin(); idx != order.end(); idx++)
+    {
+        AtlasRect& rect = rects[*idx];
+        unsigned n;
+        for (n = 0; n < pages.size(); n++)
+        {
+            if (pages[n].insert(rect.width, rect.height, rect.x, rect.y))
+                break;
+        }
+        if (n == pages.size()) {
+            pages.push_back(SkylinePage(page_width, page_height));
+            pages[n].insert(rect.width, rect.height, rect.x, rect.y);
+        }
+        rect.page = n;
+    }
+    num_pages = std::max((int)pages.size(), 1);
+    return ERR_OK;
+}
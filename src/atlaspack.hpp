@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+
+/**
+ * Rectangle to be placed on atlas page; size is given, page and position are computed.
+ */
+struct AtlasRect {
+    int width;
+    int height;
+    int page;
+    int x;
+    int y;
+};
+
+/**
+ * One node of the skyline; a horizontal segment of the top edge of used area.
+ */
+struct SkylineNode {
+    int x;
+    int y;
+    int width;
+};
+
+/**
+ * Atlas page, with area allocated using skyline bottom-left algorithm.
+ */
+class SkylinePage
+{
+public:
+    SkylinePage(int nwidth, int nheight);
+    bool insert(int rwidth, int rheight, int& rx, int& ry);
+private:
+    int fitAt(unsigned idx, int rwidth, int rheight) const;
+    void placeAt(unsigned idx, int rx, int ry, int rwidth, int rheight);
+    int width;
+    int height;
+    std::vector<SkylineNode> nodes;
+};
+
+short atlas_pack(std::vector<AtlasRect>& rects, int page_width, int page_height, int& num_pages);
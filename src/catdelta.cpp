@@ -0,0 +1,279 @@
+/******************************************************************************/
+// PNG and PAL to RAW/DAT/SPR files converter for KeeperFX
+/******************************************************************************/
+/** @file catdelta.cpp
+ *     Sprite catalogue delta support.
+ * @par Purpose:
+ *     Creates compact description of differences between two builds of
+ *     sprite catalogue DAT/TAB files, and applies it to the older build.
+ * @par Comment:
+ *     Sprite boundaries are taken from the TAB files; every TAB entry format
+ *     starts with 32-bit offset of the sprite data, so the format details
+ *     are not needed.
+ * @author   Tomasz Lis <listom@gmail.com>
+ * @par  Copying and copyrights:
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ */
+/******************************************************************************/
+
+#include "catdelta.hpp"
+#include "datahash.hpp"
+#include "prog_options.hpp"
+
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+
+/** Identifier at start of delta files */
+static const char delta_magic[4] = {'P','C','D','1'};
+/** Segment source value marking data stored within the delta */
+#define DELTA_LITERAL 0xffffffffu
+
+/**
+ * Head of delta file; identifies files the delta applies to, and the ones it creates.
+ */
+struct CatalogueDeltaHead {
+    uint32_t entry_len;
+    uint32_t old_dat_len;
+    uint64_t old_dat_hash;
+    uint32_t old_tab_len;
+    uint64_t old_tab_hash;
+    uint32_t new_dat_len;
+    uint64_t new_dat_hash;
+    uint32_t new_tab_len;
+    uint64_t new_tab_hash;
+    uint32_t num_segments;
+    uint32_t num_tab_changes;
+};
+
+/**
+ * Part of new DAT file; either range of old DAT, or data stored within the delta.
+ */
+struct CatalogueDeltaSegment {
+    uint32_t src;
+    uint32_t len;
+};
+
+/**
+ * Appends little-endian number of given size in bytes to the buffer.
+ */
+static void buf_put_le(std::vector<unsigned char>& buf, uint64_t val, int len)
+{
+    for (int i = 0; i < len; i++)
+        buf.push_back((val >> (8 * i)) & 0xff);
+}
+
+/**
+ * Reads little-endian number of given size from the buffer, advancing the position.
+ * @return False if the buffer is too short.
+ */
+static bool buf_get_le(const std::vector<unsigned char>& buf, size_t& pos, uint64_t& val, int len)
+{
+    if (buf.size() - pos < (size_t)len)
+        return false;
+    val = 0;
+    for (int i = 0; i < len; i++)
+        val |= (uint64_t)buf[pos + i] << (8 * i);
+    pos += len;
+    return true;
+}
+
+static uint64_t buf_hash(const std::vector<unsigned char>& buf)
+{
+    return buf.empty() ? 0 : data_hash64(&buf.front(), buf.size());
+}
+
+/**
+ * Splits DAT file into ranges at every sprite data offset from TAB file.
+ * Ranges cover the whole file; the first one may be the file head, and padding
+ * between sprites is included in range of the preceding sprite.
+ */
+static void catalogue_ranges(std::vector<size_t>& bounds, const std::vector<unsigned char>& dat,
+    const std::vector<unsigned char>& tab, size_t entry_len)
+{
+    bounds.clear();
+    bounds.push_back(0);
+    bounds.push_back(dat.size());
+    for (size_t pos = 0; pos + entry_len <= tab.size(); pos += entry_len)
+    {
+        uint32_t offset = tab[pos] | (tab[pos+1] << 8) | (tab[pos+2] << 16) | ((uint32_t)tab[pos+3] << 24);
+        if (offset < dat.size())
+            bounds.push_back(offset);
+    }
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+}
+
+/**
+ * Creates delta which turns old DAT/TAB files into new ones.
+ * Ranges of new DAT which exist anywhere in old DAT are copied from it, other ranges are
+ * stored in the delta; only TAB entries which differ are stored.
+ */
+short catalogue_delta_create(const std::vector<unsigned char>& old_dat, const std::vector<unsigned char>& old_tab,
+    const std::vector<unsigned char>& new_dat, const std::vector<unsigned char>& new_tab, size_t entry_len,
+    std::vector<unsigned char>& delta, CatalogueDeltaStats& stats)
+{
+    if ((entry_len < sizeof(uint32_t)) || (old_dat.size() > UINT32_MAX) || (new_dat.size() > UINT32_MAX))
+        return ERR_LIMIT_EXCEED;
+    memset(&stats, 0, sizeof(stats));
+    // Index content of every range of old DAT
+    std::vector<size_t> bounds;
+    std::unordered_multimap<uint64_t, size_t> old_ranges;
+    catalogue_ranges(bounds, old_dat, old_tab, entry_len);
+    for (size_t i = 0; i + 1 < bounds.size(); i++)
+        old_ranges.insert(std::make_pair(data_hash64(&old_dat[bounds[i]], bounds[i+1] - bounds[i]), i));
+    std::vector<size_t> old_bounds = bounds;
+    // Find every range of new DAT within old one, joining neighbouring segments
+    std::vector<CatalogueDeltaSegment> segments;
+    catalogue_ranges(bounds, new_dat, new_tab, entry_len);
+    for (size_t i = 0; i + 1 < bounds.size(); i++)
+    {
+        size_t len = bounds[i+1] - bounds[i];
+        uint64_t hash = data_hash64(&new_dat[bounds[i]], len);
+        uint32_t src = DELTA_LITERAL;
+        auto range = old_ranges.equal_range(hash);
+        for (auto it = range.first; it != range.second; it++)
+        {
+            size_t k = it->second;
+            if ((old_bounds[k+1] - old_bounds[k] == len) && (memcmp(&old_dat[old_bounds[k]], &new_dat[bounds[i]], len) == 0)) {
+                src = old_bounds[k];
+                break;
+            }
+        }
+        stats.ranges++;
+        if (src == DELTA_LITERAL) {
+            stats.changed++;
+            stats.literal_bytes += len;
+        } else {
+            stats.copied_bytes += len;
+        }
+        if (!segments.empty()) {
+            CatalogueDeltaSegment& prev = segments.back();
+            if (((src == DELTA_LITERAL) && (prev.src == DELTA_LITERAL)) ||
+                ((src != DELTA_LITERAL) && (prev.src != DELTA_LITERAL) && (prev.src + prev.len == src))) {
+                prev.len += len;
+                continue;
+            }
+        }
+        segments.push_back(CatalogueDeltaSegment{src, (uint32_t)len});
+    }
+    // List TAB entries which changed, or were added
+    std::vector<uint32_t> tab_changes;
+    for (size_t pos = 0; pos + entry_len <= new_tab.size(); pos += entry_len)
+    {
+        if ((pos + entry_len > old_tab.size()) || (memcmp(&old_tab[pos], &new_tab[pos], entry_len) != 0))
+            tab_changes.push_back(pos / entry_len);
+    }
+    stats.tab_changes = tab_changes.size();
+    // Write the delta
+    delta.assign(delta_magic, delta_magic + sizeof(delta_magic));
+    buf_put_le(delta, entry_len, 4);
+    buf_put_le(delta, old_dat.size(), 4);
+    buf_put_le(delta, buf_hash(old_dat), 8);
+    buf_put_le(delta, old_tab.size(), 4);
+    buf_put_le(delta, buf_hash(old_tab), 8);
+    buf_put_le(delta, new_dat.size(), 4);
+    buf_put_le(delta, buf_hash(new_dat), 8);
+    buf_put_le(delta, new_tab.size(), 4);
+    buf_put_le(delta, buf_hash(new_tab), 8);
+    buf_put_le(delta, segments.size(), 4);
+    buf_put_le(delta, tab_changes.size(), 4);
+    size_t pos = 0;
+    for (auto seg = segments.begin(); seg != segments.end(); seg++)
+    {
+        buf_put_le(delta, seg->src, 4);
+        buf_put_le(delta, seg->len, 4);
+        if (seg->src == DELTA_LITERAL)
+            delta.insert(delta.end(), new_dat.begin() + pos, new_dat.begin() + pos + seg->len);
+        pos += seg->len;
+    }
+    for (auto idx = tab_changes.begin(); idx != tab_changes.end(); idx++)
+    {
+        buf_put_le(delta, *idx, 4);
+        delta.insert(delta.end(), new_tab.begin() + *idx * entry_len, new_tab.begin() + (*idx + 1) * entry_len);
+    }
+    return ERR_OK;
+}
+
+/**
+ * Applies delta to old DAT/TAB files data, creating the new files data.
+ * The old data, and the result, are checked to be the ones the delta was made for.
+ */
+short catalogue_delta_apply(const std::vector<unsigned char>& old_dat, const std::vector<unsigned char>& old_tab,
+    const std::vector<unsigned char>& delta, std::vector<unsigned char>& new_dat, std::vector<unsigned char>& new_tab)
+{
+    if ((delta.size() < sizeof(delta_magic)) || (memcmp(&delta.front(), delta_magic, sizeof(delta_magic)) != 0)) {
+        LogErr("Not a sprite catalogue delta file.");
+        return ERR_BAD_FILE;
+    }
+    size_t pos = sizeof(delta_magic);
+    CatalogueDeltaHead head;
+    {
+        uint64_t vals[11];
+        static const int lens[11] = {4, 4, 8, 4, 8, 4, 8, 4, 8, 4, 4};
+        for (int i = 0; i < 11; i++)
+        {
+            if (!buf_get_le(delta, pos, vals[i], lens[i])) {
+                LogErr("Delta file is truncated.");
+                return ERR_BAD_FILE;
+            }
+        }
+        head = CatalogueDeltaHead{(uint32_t)vals[0], (uint32_t)vals[1], vals[2], (uint32_t)vals[3], vals[4],
+            (uint32_t)vals[5], vals[6], (uint32_t)vals[7], vals[8], (uint32_t)vals[9], (uint32_t)vals[10]};
+    }
+    if ((old_dat.size() != head.old_dat_len) || (buf_hash(old_dat) != head.old_dat_hash) ||
+        (old_tab.size() != head.old_tab_len) || (buf_hash(old_tab) != head.old_tab_hash)) {
+        LogErr("Delta was made for different DAT/TAB files.");
+        return ERR_BAD_FILE;
+    }
+    new_dat.clear();
+    new_dat.reserve(head.new_dat_len);
+    for (uint32_t i = 0; i < head.num_segments; i++)
+    {
+        uint64_t src, len;
+        if (!buf_get_le(delta, pos, src, 4) || !buf_get_le(delta, pos, len, 4)) {
+            LogErr("Delta file is truncated.");
+            return ERR_BAD_FILE;
+        }
+        if (src == DELTA_LITERAL) {
+            if (delta.size() - pos < len) {
+                LogErr("Delta file is truncated.");
+                return ERR_BAD_FILE;
+            }
+            new_dat.insert(new_dat.end(), delta.begin() + pos, delta.begin() + pos + len);
+            pos += len;
+        } else {
+            if ((src > old_dat.size()) || (old_dat.size() - src < len)) {
+                LogErr("Delta refers to data outside of the DAT file.");
+                return ERR_BAD_FILE;
+            }
+            new_dat.insert(new_dat.end(), old_dat.begin() + src, old_dat.begin() + src + len);
+        }
+    }
+    new_tab = old_tab;
+    new_tab.resize(head.new_tab_len, 0);
+    for (uint32_t i = 0; i < head.num_tab_changes; i++)
+    {
+        uint64_t idx;
+        if (!buf_get_le(delta, pos, idx, 4) || (delta.size() - pos < head.entry_len)) {
+            LogErr("Delta file is truncated.");
+            return ERR_BAD_FILE;
+        }
+        if ((idx + 1) * head.entry_len > new_tab.size()) {
+            LogErr("Delta refers to entry outside of the TAB file.");
+            return ERR_BAD_FILE;
+        }
+        memcpy(&new_tab[idx * head.entry_len], &delta[pos], head.entry_len);
+        pos += head.entry_len;
+    }
+    if ((new_dat.size() != head.new_dat_len) || (buf_hash(new_dat) != head.new_dat_hash) ||
+        (buf_hash(new_tab) != head.new_tab_hash)) {
+        LogErr("Files created from delta are incorrect.");
+        return ERR_BAD_FILE;
+    }
+    return ERR_OK;
+}
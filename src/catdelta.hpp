@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+/**
+ * Summary of differences found when creating sprite catalogue delta.
+ */
+struct CatalogueDeltaStats {
+    /** Amount of data ranges in new DAT; each is a sprite, or the file head */
+    unsigned ranges;
+    /** Amount of ranges which were not found in old DAT, and are stored in the delta */
+    unsigned changed;
+    size_t literal_bytes;
+    size_t copied_bytes;
+    /** Amount of TAB entries stored in the delta */
+    unsigned tab_changes;
+};
+
+short catalogue_delta_create(const std::vector<unsigned char>& old_dat, const std::vector<unsigned char>& old_tab,
+    const std::vector<unsigned char>& new_dat, const std::vector<unsigned char>& new_tab, size_t entry_len,
+    std::vector<unsigned char>& delta, CatalogueDeltaStats& stats);
+short catalogue_delta_apply(const std::vector<unsigned char>& old_dat, const std::vector<unsigned char>& old_tab,
+    const std::vector<unsigned char>& delta, std::vector<unsigned char>& new_dat, std::vector<unsigned char>& new_tab);
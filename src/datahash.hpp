@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+/**
+ * Finalization step of 64-bit hash; spreads bits of given value over whole word.
+ */
+inline uint64_t hash_mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Computes fast non-cryptographic 64-bit hash of given data buffer.
+ * Processes input in 8-byte words; the result depends on data length as well.
+ */
+inline uint64_t data_hash64(const void *data, size_t len, uint64_t seed = 0)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+    while (len >= 8)
+    {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        h = (h ^ hash_mix64(k)) * 0x9e3779b97f4a7c15ULL;
+        p += 8;
+        len -= 8;
+    }
+    if (len > 0)
+    {
+        uint64_t k = 0;
+        memcpy(&k, p, len);
+        h = (h ^ hash_mix64(k)) * 0x9e3779b97f4a7c15ULL;
+    }
+    return hash_mix64(h);
+}
@@ -0,0 +1,265 @@
+/******************************************************************************/
+// PNG and PAL to RAW/DAT/SPR files converter for KeeperFX
+/******************************************************************************/
+/** @file embedout.cpp
+ *     Embedded data output support.
+ * @par Purpose:
+ *     Writes data of output files as C source or relocatable ELF object,
+ *     so that it can be linked into a program instead of being loaded.
+ * @par Comment:
+ *     None.
+ * @author   Tomasz Lis <listom@gmail.com>
+ * @par  Copying and copyrights:
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ */
+/******************************************************************************/
+
+#include "embedout.hpp"
+#include "prog_options.hpp"
+
+#include <cstdio>
+#include <cstdint>
+#include <cctype>
+
+/**
+ * Makes C identifier from base name of given file, without extension.
+ */
+std::string embed_symbol_name(const std::string& fname)
+{
+    size_t beg = fname.find_last_of("/\\");
+    beg = (beg == std::string::npos) ? 0 : beg + 1;
+    size_t end = fname.find_last_of('.');
+    if ((end == std::string::npos) || (end < beg))
+        end = fname.length();
+    std::string name;
+    for (size_t i = beg; i < end; i++)
+    {
+        unsigned char c = fname[i];
+        name += isalnum(c) ? (char)c : '_';
+    }
+    if (name.empty() || isdigit((unsigned char)name[0]))
+        name.insert(0, "_");
+    return name;
+}
+
+/**
+ * Writes C header declaring the embedded data arrays and their lengths.
+ */
+short embed_write_header(const std::string& fname_hdr, const std::string& fname_inp, const std::vector<EmbedBlob>& blobs)
+{
+    FILE* hdrfile = fopen(fname_hdr.c_str(),"w");
+    if (hdrfile == NULL) {
+        perror(fname_hdr.c_str());
+        return ERR_CANT_OPEN;
+    }
+    fprintf(hdrfile, "/* Generated by pngpal2raw from \"%s\"; do not edit. */\n", fname_inp.c_str());
+    fprintf(hdrfile, "#pragma once\n\n#include <stdint.h>\n\n");
+    fprintf(hdrfile, "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
+    for (auto blob = blobs.begin(); blob != blobs.end(); blob++)
+    {
+        fprintf(hdrfile, "extern const unsigned char %s[];\n", blob->name.c_str());
+        fprintf(hdrfile, "extern const uint32_t %s_len;\n", blob->name.c_str());
+    }
+    fprintf(hdrfile, "\n#ifdef __cplusplus\n}\n#endif\n");
+    if (fclose(hdrfile) != 0) {
+        perror(fname_hdr.c_str());
+        return ERR_FILE_WRITE;
+    }
+    return ERR_OK;
+}
+
+/**
+ * Writes C source defining the embedded data as aligned constant arrays.
+ */
+short embed_write_c_source(const std::string& fname_src, const std::string& fname_inp, const std::vector<EmbedBlob>& blobs)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    FILE* srcfile = fopen(fname_src.c_str(),"w");
+    if (srcfile == NULL) {
+        perror(fname_src.c_str());
+        return ERR_CANT_OPEN;
+    }
+    fprintf(srcfile, "/* Generated by pngpal2raw from \"%s\"; do not edit. */\n", fname_inp.c_str());
+    fprintf(srcfile, "#include <stdint.h>\n\n");
+    fprintf(srcfile, "#if defined(_MSC_VER)\n#define EMBED_ALIGNED __declspec(align(%d))\n", EMBED_DATA_ALIGN);
+    fprintf(srcfile, "#else\n#define EMBED_ALIGNED __attribute__((aligned(%d)))\n#endif\n", EMBED_DATA_ALIGN);
+    for (auto blob = blobs.begin(); blob != blobs.end(); blob++)
+    {
+        // Empty arrays are not allowed in C, so these get one unused byte
+        fprintf(srcfile, "\nEMBED_ALIGNED const unsigned char %s[%lu] = {\n", blob->name.c_str(),
+            (unsigned long)((blob->len > 0) ? blob->len : 1));
+        if (blob->len == 0)
+            fprintf(srcfile, "    0x00,\n");
+        char line[4 + 16*5 + 2];
+        for (size_t i = 0; i < blob->len; i += 16)
+        {
+            char *pos = line;
+            for (int k = 0; k < 4; k++)
+                *pos++ = ' ';
+            for (size_t k = i; (k < i + 16) && (k < blob->len); k++)
+            {
+                *pos++ = '0';
+                *pos++ = 'x';
+                *pos++ = hex_digits[blob->data[k] >> 4];
+                *pos++ = hex_digits[blob->data[k] & 0x0f];
+                *pos++ = ',';
+            }
+            *pos++ = '\n';
+            *pos = '\0';
+            fputs(line, srcfile);
+        }
+        fprintf(srcfile, "};\nconst uint32_t %s_len = %lu;\n", blob->name.c_str(), (unsigned long)blob->len);
+    }
+    if (fclose(srcfile) != 0) {
+        perror(fname_src.c_str());
+        return ERR_FILE_WRITE;
+    }
+    return ERR_OK;
+}
+
+/**
+ * Appends little-endian number of given size in bytes to the buffer.
+ */
+static void buf_put_le(std::vector<unsigned char>& buf, uint64_t val, int len)
+{
+    for (int i = 0; i < len; i++)
+        buf.push_back((val >> (8 * i)) & 0xff);
+}
+
+/**
+ * Pads the buffer with zeros, to make its size a multiple of given alignment.
+ */
+static void buf_align(std::vector<unsigned char>& buf, size_t align)
+{
+    while (buf.size() % align != 0)
+        buf.push_back(0);
+}
+
+/**
+ * Adds global data symbol to ELF symbol table; the symbol is placed in .rodata section.
+ */
+static void elf_add_symbol(std::vector<unsigned char>& symtab, std::vector<unsigned char>& strtab,
+    const std::string& name, uint64_t value, uint64_t size)
+{
+    buf_put_le(symtab, strtab.size(), 4); // st_name
+    buf_put_le(symtab, (1 << 4) | 1, 1);  // st_info: STB_GLOBAL, STT_OBJECT
+    buf_put_le(symtab, 0, 1);             // st_other
+    buf_put_le(symtab, 1, 2);             // st_shndx: .rodata
+    buf_put_le(symtab, value, 8);
+    buf_put_le(symtab, size, 8);
+    strtab.insert(strtab.end(), name.begin(), name.end());
+    strtab.push_back(0);
+}
+
+/**
+ * Adds ELF section header.
+ */
+static void elf_add_section(std::vector<unsigned char>& shdrs, uint32_t name, uint32_t type, uint64_t flags,
+    uint64_t offset, uint64_t size, uint32_t link, uint32_t info, uint64_t align, uint64_t entsize)
+{
+    buf_put_le(shdrs, name, 4);
+    buf_put_le(shdrs, type, 4);
+    buf_put_le(shdrs, flags, 8);
+    buf_put_le(shdrs, 0, 8); // sh_addr
+    buf_put_le(shdrs, offset, 8);
+    buf_put_le(shdrs, size, 8);
+    buf_put_le(shdrs, link, 4);
+    buf_put_le(shdrs, info, 4);
+    buf_put_le(shdrs, align, 8);
+    buf_put_le(shdrs, entsize, 8);
+}
+
+/**
+ * Writes relocatable 64-bit ELF object for the host architecture, with the embedded data in .rodata section.
+ * Every data array is aligned, and followed by 32-bit length symbol; the data needs no relocations.
+ */
+short embed_write_elf_object(const std::string& fname_obj, const std::vector<EmbedBlob>& blobs)
+{
+#if defined(__x86_64__)
+    const unsigned machine = 62; // EM_X86_64
+#elif defined(__aarch64__)
+    const unsigned machine = 183; // EM_AARCH64
+#else
+    const unsigned machine = 0;
+#endif
+    if (machine == 0) {
+        LogErr("%s: ELF objects can only be created on x86-64 and AArch64 hosts",fname_obj.c_str());
+        return ERR_BAD_FILE;
+    }
+    const size_t ehdr_len = 64;
+    std::vector<unsigned char> rodata, symtab, strtab;
+    strtab.push_back(0);
+    symtab.resize(24, 0); // Null symbol
+    for (auto blob = blobs.begin(); blob != blobs.end(); blob++)
+    {
+        buf_align(rodata, EMBED_DATA_ALIGN);
+        elf_add_symbol(symtab, strtab, blob->name, rodata.size(), blob->len);
+        rodata.insert(rodata.end(), blob->data, blob->data + blob->len);
+    }
+    buf_align(rodata, 4);
+    for (auto blob = blobs.begin(); blob != blobs.end(); blob++)
+    {
+        elf_add_symbol(symtab, strtab, blob->name + "_len", rodata.size(), 4);
+        buf_put_le(rodata, blob->len, 4);
+    }
+    static const char shstrtab[] = "\0.rodata\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+    // Place sections one after another, behind the ELF header
+    std::vector<unsigned char> body;
+    size_t rodata_pos = ehdr_len;
+    body.insert(body.end(), rodata.begin(), rodata.end());
+    buf_align(body, 8);
+    size_t symtab_pos = ehdr_len + body.size();
+    body.insert(body.end(), symtab.begin(), symtab.end());
+    size_t strtab_pos = ehdr_len + body.size();
+    body.insert(body.end(), strtab.begin(), strtab.end());
+    size_t shstrtab_pos = ehdr_len + body.size();
+    body.insert(body.end(), shstrtab, shstrtab + sizeof(shstrtab));
+    buf_align(body, 8);
+    size_t shdrs_pos = ehdr_len + body.size();
+    std::vector<unsigned char> shdrs;
+    elf_add_section(shdrs, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    elf_add_section(shdrs, 1, 1, 0x2, rodata_pos, rodata.size(), 0, 0, EMBED_DATA_ALIGN, 0); // SHT_PROGBITS, SHF_ALLOC
+    elf_add_section(shdrs, 9, 2, 0, symtab_pos, symtab.size(), 3, 1, 8, 24); // SHT_SYMTAB, all but first are global
+    elf_add_section(shdrs, 17, 3, 0, strtab_pos, strtab.size(), 0, 0, 1, 0); // SHT_STRTAB
+    elf_add_section(shdrs, 25, 3, 0, shstrtab_pos, sizeof(shstrtab), 0, 0, 1, 0);
+    elf_add_section(shdrs, 35, 1, 0, shdrs_pos, 0, 0, 0, 1, 0); // Marks the stack as non-executable
+    std::vector<unsigned char> ehdr;
+    {
+        static const unsigned char ident[16] = {0x7f, 'E', 'L', 'F', 2, 1, 1}; // ELFCLASS64, ELFDATA2LSB, EV_CURRENT
+        ehdr.insert(ehdr.end(), ident, ident + sizeof(ident));
+        buf_put_le(ehdr, 1, 2); // e_type: ET_REL
+        buf_put_le(ehdr, machine, 2);
+        buf_put_le(ehdr, 1, 4); // e_version
+        buf_put_le(ehdr, 0, 8); // e_entry
+        buf_put_le(ehdr, 0, 8); // e_phoff
+        buf_put_le(ehdr, shdrs_pos, 8);
+        buf_put_le(ehdr, 0, 4); // e_flags
+        buf_put_le(ehdr, ehdr_len, 2);
+        buf_put_le(ehdr, 0, 2); // e_phentsize
+        buf_put_le(ehdr, 0, 2); // e_phnum
+        buf_put_le(ehdr, 64, 2); // e_shentsize
+        buf_put_le(ehdr, shdrs.size() / 64, 2);
+        buf_put_le(ehdr, 4, 2); // e_shstrndx
+    }
+    FILE* objfile = fopen(fname_obj.c_str(),"wb");
+    if (objfile == NULL) {
+        perror(fname_obj.c_str());
+        return ERR_CANT_OPEN;
+    }
+    if ((fwrite(&ehdr.front(), ehdr.size(), 1, objfile) != 1) ||
+        (fwrite(&body.front(), body.size(), 1, objfile) != 1) ||
+        (fwrite(&shdrs.front(), shdrs.size(), 1, objfile) != 1))
+    {
+        perror(fname_obj.c_str());
+        fclose(objfile);
+        return ERR_FILE_WRITE;
+    }
+    if (fclose(objfile) != 0) {
+        perror(fname_obj.c_str());
+        return ERR_FILE_WRITE;
+    }
+    return ERR_OK;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+/** Alignment of every data array within embedded output */
+#define EMBED_DATA_ALIGN 16
+
+/**
+ * Block of data to be embedded into program, under given symbol name.
+ */
+struct EmbedBlob {
+    std::string name;
+    const unsigned char *data;
+    size_t len;
+};
+
+std::string embed_symbol_name(const std::string& fname);
+short embed_write_header(const std::string& fname_hdr, const std::string& fname_inp, const std::vector<EmbedBlob>& blobs);
+short embed_write_c_source(const std::string& fname_src, const std::string& fname_inp, const std::vector<EmbedBlob>& blobs);
+short embed_write_elf_object(const std::string& fname_obj, const std::vector<EmbedBlob>& blobs);
@@ -0,0 +1,329 @@
+/******************************************************************************/
+// PNG and PAL to RAW/DAT/SPR files converter for KeeperFX
+/******************************************************************************/
+/** @file filemap.cpp
+ *     Memory mapped files support.
+ * @par Purpose:
+ *     Allows to create output files by writing directly into memory,
+ *     with the data placed at final offsets by any thread.
+ * @par Comment:
+ *     None.
+ * @author   Tomasz Lis <listom@gmail.com>
+ * @par  Copying and copyrights:
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ */
+/******************************************************************************/
+
+#include "filemap.hpp"
+#include "prog_options.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+MappedFile::MappedFile():ptr(NULL),len(0)
+#if defined(_WIN32)
+    ,file_handle(INVALID_HANDLE_VALUE),map_handle(NULL)
+#else
+    ,fd(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+/**
+ * Creates new file of given size, and maps it into memory for writing.
+ * Any previous file of that name is truncated. The data is initially zero-filled.
+ */
+short MappedFile::create(const std::string& fname_out, size_t size)
+{
+    close();
+    fname = fname_out;
+#if defined(_WIN32)
+    file_handle = CreateFileA(fname.c_str(), GENERIC_READ|GENERIC_WRITE, 0, NULL,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_handle == INVALID_HANDLE_VALUE) {
+        LogErr("%s: Cannot create file",fname.c_str());
+        return ERR_CANT_OPEN;
+    }
+    if (size == 0)
+        return ERR_OK;
+    map_handle = CreateFileMappingA(file_handle, NULL, PAGE_READWRITE,
+        (DWORD)((unsigned long long)size >> 32), (DWORD)(size & 0xffffffff), NULL);
+    if (map_handle == NULL) {
+        LogErr("%s: Cannot map file",fname.c_str());
+        close();
+        return ERR_FILE_WRITE;
+    }
+    ptr = (unsigned char *)MapViewOfFile(map_handle, FILE_MAP_WRITE, 0, 0, size);
+    if (ptr == NULL) {
+        LogErr("%s: Cannot map file",fname.c_str());
+        close();
+        return ERR_FILE_WRITE;
+    }
+#else
+    fd = ::open(fname.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) {
+        perror(fname.c_str());
+        return ERR_CANT_OPEN;
+    }
+    if (size == 0)
+        return ERR_OK;
+    if (ftruncate(fd, size) != 0) {
+        perror(fname.c_str());
+        close();
+        return ERR_FILE_WRITE;
+    }
+    void *mptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mptr == MAP_FAILED) {
+        perror(fname.c_str());
+        close();
+        return ERR_FILE_WRITE;
+    }
+    ptr = (unsigned char *)mptr;
+#endif
+    len = size;
+    return ERR_OK;
+}
+
+/**
+ * Opens existing file, and maps it into memory for reading.
+ */
+short MappedFile::open(const std::string& fname_inp)
+{
+    close();
+    fname = fname_inp;
+    size_t size;
+#if defined(_WIN32)
+    file_handle = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_handle == INVALID_HANDLE_VALUE)
+        return ERR_CANT_OPEN;
+    LARGE_INTEGER fsize;
+    if (!GetFileSizeEx(file_handle, &fsize)) {
+        close();
+        return ERR_FILE_READ;
+    }
+    size = fsize.QuadPart;
+    if (size == 0)
+        return ERR_OK;
+    map_handle = CreateFileMappingA(file_handle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (map_handle == NULL) {
+        close();
+        return ERR_FILE_READ;
+    }
+    ptr = (unsigned char *)MapViewOfFile(map_handle, FILE_MAP_COPY, 0, 0, size);
+    if (ptr == NULL) {
+        close();
+        return ERR_FILE_READ;
+    }
+#else
+    fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0)
+        return ERR_CANT_OPEN;
+    off_t fsize = lseek(fd, 0, SEEK_END);
+    if (fsize < 0) {
+        close();
+        return ERR_FILE_READ;
+    }
+    size = fsize;
+    if (size == 0)
+        return ERR_OK;
+    void *mptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (mptr == MAP_FAILED) {
+        close();
+        return ERR_FILE_READ;
+    }
+    ptr = (unsigned char *)mptr;
+#endif
+    len = size;
+    return ERR_OK;
+}
+
+/**
+ * Unmaps the file data from memory, and closes the file.
+ */
+short MappedFile::close(void)
+{
+    short ret = ERR_OK;
+#if defined(_WIN32)
+    if (ptr != NULL) {
+        if (!FlushViewOfFile(ptr, len))
+            ret = ERR_FILE_WRITE;
+        UnmapViewOfFile(ptr);
+    }
+    if (map_handle != NULL)
+        CloseHandle(map_handle);
+    if (file_handle != INVALID_HANDLE_VALUE)
+        CloseHandle(file_handle);
+    map_handle = NULL;
+    file_handle = INVALID_HANDLE_VALUE;
+#else
+    if (ptr != NULL) {
+        if (munmap(ptr, len) != 0) {
+            perror(fname.c_str());
+            ret = ERR_FILE_WRITE;
+        }
+    }
+    if (fd >= 0) {
+        if (::close(fd) != 0) {
+            perror(fname.c_str());
+            ret = ERR_FILE_WRITE;
+        }
+    }
+    fd = -1;
+#endif
+    ptr = NULL;
+    len = 0;
+    return ret;
+}
+
+/**
+ * Copies given range of input file to current position of output file.
+ * Where possible, the data is copied by the kernel without passing through user space,
+ * which on some file systems allows sharing the blocks instead of copying them.
+ */
+short file_copy_range(FILE *fout, FILE *finp, long offset, size_t len)
+{
+#if defined(HAVE_COPY_FILE_RANGE)
+    if (fflush(fout) == 0)
+    {
+        loff_t off_in = offset;
+        loff_t off_out = ftell(fout);
+        size_t done = 0;
+        while (done < len)
+        {
+            ssize_t n = copy_file_range(fileno(finp), &off_in, fileno(fout), &off_out, len - done, 0);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        if (fseek(fout, off_out, SEEK_SET) != 0)
+            return ERR_FILE_WRITE;
+        if (done == len)
+            return ERR_OK;
+        // Not supported for these files; copy the remaining part in user space
+        offset = off_in;
+        len -= done;
+    }
+#endif
+    if (fseek(finp, offset, SEEK_SET) != 0)
+        return ERR_FILE_READ;
+    std::vector<unsigned char> buf(std::min(len, (size_t)0x10000));
+    while (len > 0)
+    {
+        size_t n = std::min(len, buf.size());
+        if (fread(&buf.front(), n, 1, finp) != 1)
+            return ERR_FILE_READ;
+        if (fwrite(&buf.front(), n, 1, fout) != 1)
+            return ERR_FILE_WRITE;
+        len -= n;
+    }
+    return ERR_OK;
+}
+
+/**
+ * Replaces target file with new file, unless the target already has identical content.
+ * If the content is the same, the new file is removed and the target is left untouched,
+ * so its modification time doesn't change.
+ */
+short file_replace_if_changed(const std::string& fname_new, const std::string& fname, bool& changed)
+{
+    changed = true;
+    {
+        MappedFile newfile, oldfile;
+        if ((oldfile.open(fname) == ERR_OK) && (newfile.open(fname_new) == ERR_OK) &&
+            (oldfile.size() == newfile.size()))
+        {
+            changed = (newfile.size() > 0) && (memcmp(oldfile.data(), newfile.data(), newfile.size()) != 0);
+        }
+    }
+    if (!changed) {
+        if (remove(fname_new.c_str()) != 0) {
+            perror(fname_new.c_str());
+            return ERR_FILE_WRITE;
+        }
+        return ERR_OK;
+    }
+#if defined(_WIN32)
+    remove(fname.c_str());
+#endif
+    if (rename(fname_new.c_str(), fname.c_str()) != 0) {
+        perror(fname.c_str());
+        return ERR_FILE_WRITE;
+    }
+    return ERR_OK;
+}
+
+/**
+ * Checks whether two files have identical content.
+ */
+short file_content_equal(const std::string& fname1, const std::string& fname2, bool& equal)
+{
+    equal = false;
+    MappedFile file1, file2;
+    short ret = file1.open(fname1);
+    if (ret != ERR_OK) {
+        perror(fname1.c_str());
+        return ret;
+    }
+    ret = file2.open(fname2);
+    if (ret != ERR_OK) {
+        perror(fname2.c_str());
+        return ret;
+    }
+    equal = (file1.size() == file2.size()) &&
+        ((file1.size() == 0) || (memcmp(file1.data(), file2.data(), file1.size()) == 0));
+    return ERR_OK;
+}
+
+/**
+ * Reads whole file into memory buffer.
+ * Used where the file is to be replaced while its old content is still needed.
+ */
+short file_read_data(const std::string& fname, std::vector<unsigned char>& data)
+{
+    data.clear();
+    MappedFile file;
+    short ret = file.open(fname);
+    if (ret != ERR_OK) {
+        perror(fname.c_str());
+        return ret;
+    }
+    data.assign(file.data(), file.data() + file.size());
+    return ERR_OK;
+}
+
+/**
+ * Reads whole file into memory buffer, if the file exists.
+ * Missing file is not an error; it gives empty buffer, with exists flag cleared.
+ */
+short file_read_data_if_exists(const std::string& fname, std::vector<unsigned char>& data, bool& exists)
+{
+    data.clear();
+    FILE* file = fopen(fname.c_str(),"rb");
+    if ((file == NULL) && (errno == ENOENT)) {
+        exists = false;
+        return ERR_OK;
+    }
+    if (file != NULL)
+        fclose(file);
+    exists = true;
+    return file_read_data(fname, data);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdio>
+
+/**
+ * File mapped into memory, allowing to access its data at any offset.
+ * Files opened for reading are mapped privately; changes to the data are not written back.
+ */
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+    short create(const std::string& fname, size_t size);
+    short open(const std::string& fname);
+    short close(void);
+    /** Gives pointer to the mapped file data */
+    unsigned char *data(void)
+    { return ptr; }
+    /** Gives size of the mapped file data */
+    size_t size(void) const
+    { return len; }
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+    std::string fname;
+    unsigned char *ptr;
+    size_t len;
+#if defined(_WIN32)
+    void *file_handle;
+    void *map_handle;
+#else
+    int fd;
+#endif
+};
+
+short file_copy_range(FILE *fout, FILE *finp, long offset, size_t len);
+short file_replace_if_changed(const std::string& fname_new, const std::string& fname, bool& changed);
+short file_content_equal(const std::string& fname1, const std::string& fname2, bool& equal);
+short file_read_data(const std::string& fname, std::vector<unsigned char>& data);
+short file_read_data_if_exists(const std::string& fname, std::vector<unsigned char>& data, bool& exists);
@@ -21,8 +21,11 @@
 
 #include "imagedata.hpp"
 #include "prog_options.hpp"
+#include "datahash.hpp"
 
 #include <png.h>
+#include <cstring>
+#include <cerrno>
 
 short load_inp_png_file(ImageData& img, const std::string& fname_inp, ProgramOptions& opts)
 {
@@ -32,12 +35,13 @@ short load_inp_png_file(ImageData& img, const std::string& fname_inp, ProgramOpt
         return ERR_CANT_OPEN;
     }
     png_byte header[8];
-    if (fread(header,8,1,pngfile) != 1) {
+    size_t len = fread(header,1,8,pngfile);
+    if ((len < 8) && ferror(pngfile)) {
         perror(fname_inp.c_str());
         fclose(pngfile);
         return ERR_FILE_READ;
     }
-    if (png_sig_cmp(header,0,8)) {
+    if ((len < 8) || png_sig_cmp(header,0,8)) {
         LogErr("%s: Not a PNG file",fname_inp.c_str());
         fclose(pngfile);
         return ERR_BAD_FILE;
@@ -110,3 +114,153 @@ short load_inp_png_file(ImageData& img, const std::string& fname_inp, ProgramOpt
     return ERR_OK;
 }
 
+
+/**
+ * Computes hash of whole content of given file.
+ */
+short load_inp_file_hash(const std::string& fname_inp, uint64_t& hash)
+{
+    FILE* inpfile = fopen(fname_inp.c_str(),"rb");
+    if (inpfile == NULL) {
+        perror(fname_inp.c_str());
+        return ERR_CANT_OPEN;
+    }
+    std::vector<unsigned char> buf;
+    buf.resize(0x10000);
+    hash = 0;
+    while (1)
+    {
+        size_t len = fread(&buf.front(),1,buf.size(),inpfile);
+        if (len > 0)
+            hash = data_hash64(&buf.front(), len, hash);
+        if (len < buf.size())
+            break;
+    }
+    if (ferror(inpfile)) {
+        perror(fname_inp.c_str());
+        fclose(inpfile);
+        return ERR_FILE_READ;
+    }
+    fclose(inpfile);
+    return ERR_OK;
+}
+
+/**
+ * Reads PNG signature and IHDR chunk, without decoding the image.
+ * Does not report errors, so it can be used for many files at once; errno is kept for failed reads,
+ * and set to 0 if the file is a PNG which ends before its header does.
+ */
+short load_inp_png_header(const std::string& fname_inp, PngHeader& head)
+{
+    FILE* pngfile = fopen(fname_inp.c_str(),"rb");
+    if (pngfile == NULL) {
+        return ERR_CANT_OPEN;
+    }
+    // Signature, then IHDR chunk length and type, then its data
+    png_byte header[29];
+    size_t len = fread(header,1,sizeof(header),pngfile);
+    if ((len < sizeof(header)) && ferror(pngfile)) {
+        int err = errno;
+        fclose(pngfile);
+        errno = err;
+        return ERR_FILE_READ;
+    }
+    fclose(pngfile);
+    if ((len < 8) || png_sig_cmp(header,0,8)) {
+        return ERR_BAD_FILE;
+    }
+    if (len < sizeof(header)) {
+        errno = 0;
+        return ERR_FILE_READ;
+    }
+    if (memcmp(header+12,"IHDR",4) != 0) {
+        return ERR_BAD_FILE;
+    }
+    head.width = png_get_uint_32(header+16);
+    head.height = png_get_uint_32(header+20);
+    head.bit_depth = header[24];
+    head.color_type = header[25];
+    head.interlace_type = header[28];
+    return ERR_OK;
+}
+
+/**
+ * Reads dimensions of a PNG image from its header, without decoding the image.
+ */
+short load_inp_png_dimensions(const std::string& fname_inp, png_uint_32& width, png_uint_32& height)
+{
+    PngHeader head;
+    short ret = load_inp_png_header(fname_inp, head);
+    if (ret == ERR_BAD_FILE) {
+        LogErr("%s: Not a PNG file",fname_inp.c_str());
+        return ret;
+    }
+    if ((ret == ERR_FILE_READ) && (errno == 0)) {
+        LogErr("%s: File too short",fname_inp.c_str());
+        return ret;
+    }
+    if (ret != ERR_OK) {
+        perror(fname_inp.c_str());
+        return ret;
+    }
+    width = head.width;
+    height = head.height;
+    return ERR_OK;
+}
+
+/**
+ * Makes this image a view into given area of another image.
+ * The view shares pixel data of the source image, and is not cropped.
+ */
+void ImageData::setView(ImageData& src, int x, int y, int w, int h)
+{
+    int bytesPerPixel = (src.colorBPP()+7) >> 3;
+    png_bytep * src_rows = src.rowPointers();
+    png_ptr = src.png_ptr;
+    info_ptr = src.info_ptr;
+    end_info = src.end_info;
+    width = w;
+    height = h;
+    crop_x = 0;
+    crop_y = 0;
+    crop_width = w;
+    crop_height = h;
+    color_type = src.color_type;
+    col_bits = src.col_bits;
+    transparency_threshold = src.transparency_threshold;
+    view_x = x;
+    view_y = y;
+    std::vector<png_bytep> rows;
+    rows.resize(h);
+    for (int i = 0; i < h; i++)
+        rows[i] = src_rows[y+i] + x*bytesPerPixel;
+    view_rows.swap(rows);
+    view_index.clear();
+    transMap.clear();
+    if (!src.transMap.empty())
+    {
+        transMap.resize2d(w,h);
+        for (int i = 0; i < h; i++)
+            std::copy(src.transMap[y+i].begin()+x, src.transMap[y+i].begin()+x+w, transMap[i].begin());
+    }
+}
+
+/**
+ * Gives decoded image of given file, loading it on first use.
+ */
+short ImageCache::load(ImageData *&img, const std::string& fname_inp, ProgramOptions& opts)
+{
+    auto it = decoded.find(fname_inp);
+    if (it != decoded.end()) {
+        img = &it->second;
+        return ERR_OK;
+    }
+    ImageData& dimg = decoded[fname_inp];
+    short ret = load_inp_png_file(dimg, fname_inp, opts);
+    if (ret != ERR_OK) {
+        decoded.erase(fname_inp);
+        return ret;
+    }
+    img = &dimg;
+    return ERR_OK;
+}
@@ -3,6 +3,8 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <map>
+#include <cstdint>
 #include <png.h>
 
 // Needs to be greater than max(sizeof(struct JontySpriteV1),sizeof(struct JontySpriteV2))
@@ -56,9 +58,20 @@ class ImageData
 public:
     ImageData():png_ptr(NULL),info_ptr(NULL),end_info(NULL),width(0),height(0),
           crop_x(0), crop_y(0), crop_width(-1), crop_height(-1),
-          color_type(0),col_bits(0),transparency_threshold(196){}
+          color_type(0),col_bits(0),transparency_threshold(196),view_x(0),view_y(0),dup_of(-1),reuse_data(false),cached(false){}
     int colorBPP(void) const
     { return col_bits; }
+    /** Gives rows of pixel data; RGB(A) after loading, palette indexes after color conversion */
+    png_bytep * rowPointers(void)
+    {
+        if (!view_rows.empty())
+            return &view_rows.front();
+        return png_get_rows(png_ptr, info_ptr);
+    }
+    /** Informs whether the pixel data is shared with another image, rather than owned */
+    bool isView(void) const
+    { return !view_rows.empty(); }
+    void setView(ImageData& src, int x, int y, int w, int h);
     png_structp png_ptr;
     png_infop info_ptr;
     png_infop end_info;
@@ -70,6 +83,44 @@ public:
     int transparency_threshold;
     /** Any additional data required for specific output file format */
     unsigned char additional_data[ADDITIONAL_DATA_LEN];
+    /** Position of a view within its source image */
+    int view_x, view_y;
+    /** Row pointers of a view into another image; empty if this image owns its data */
+    std::vector<png_bytep> view_rows;
+    /** Palette indexes buffer of a view, filled by color conversion */
+    std::vector<png_byte> view_index;
+    /** Index of earlier image with identical content and conversion parameters, or -1 */
+    int dup_of;
+    /** Whether the image is not loaded, and its encoded data is taken from existing output file */
+    bool reuse_data;
+    /** Whether palette indexes and transparency were taken from quantized images cache */
+    bool cached;
+};
+
+/**
+ * Properties of PNG image read from its header.
+ */
+struct PngHeader {
+    png_uint_32 width, height;
+    int bit_depth;
+    int color_type;
+    int interlace_type;
+};
+
+/**
+ * Cache of decoded images, allowing many image areas to share one decode of a file.
+ */
+class ImageCache
+{
+public:
+    short load(ImageData *&img, const std::string& fname_inp, ProgramOptions& opts);
+    /** Decoded images, by file name */
+    std::map<std::string, ImageData> decoded;
+    /** Whole images converted to palette indexes, by file name */
+    std::map<std::string, ImageData> indexed;
 };
 
 short load_inp_png_file(ImageData& img, const std::string& fname_inp, ProgramOptions& opts);
+short load_inp_file_hash(const std::string& fname_inp, uint64_t& hash);
+short load_inp_png_header(const std::string& fname_inp, PngHeader& head);
+short load_inp_png_dimensions(const std::string& fname_inp, png_uint_32& width, png_uint_32& height);
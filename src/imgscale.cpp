@@ -0,0 +1,147 @@
+/******************************************************************************/
+// PNG and PAL to RAW/DAT/SPR files converter for KeeperFX
+/******************************************************************************/
+/** @file imgscale.cpp
+ *     Image scaling support.
+ * @par Purpose:
+ *     Downscales RGB(A) images by integer factors, for creating sprites
+ *     at several zoom levels from one decoded image.
+ * @par Comment:
+ *     None.
+ * @author   Tomasz Lis <listom@gmail.com>
+ * @par  Copying and copyrights:
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ */
+/******************************************************************************/
+
+#include "imgscale.hpp"
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/** Amount of entries in table converting linear intensity back to sRGB */
+#define LINEAR_TO_SRGB_STEPS 4096
+
+/**
+ * Tables for conversion between sRGB and linear color intensities.
+ */
+struct SrgbTables {
+    SrgbTables()
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            double v = i / 255.0;
+            to_linear[i] = (v <= 0.04045) ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+        }
+        for (int i = 0; i < LINEAR_TO_SRGB_STEPS; i++)
+        {
+            double v = i / (double)(LINEAR_TO_SRGB_STEPS - 1);
+            v = (v <= 0.0031308) ? v * 12.92 : 1.055 * pow(v, 1/2.4) - 0.055;
+            to_srgb[i] = (unsigned char)(v * 255.0 + 0.5);
+        }
+    }
+    float to_linear[256];
+    unsigned char to_srgb[LINEAR_TO_SRGB_STEPS];
+};
+
+static const SrgbTables& srgb_tables(void)
+{
+    static const SrgbTables tables;
+    return tables;
+}
+
+/**
+ * Converts row of pixels into linear intensities, with color premultiplied by alpha.
+ * Every output pixel has 4 floats: red, green, blue and alpha.
+ */
+static void row_to_linear(float *out, png_bytep inp, int width, int bytes_per_pixel, const SrgbTables& tbl)
+{
+    for (int x = 0; x < width; x++)
+    {
+        float alpha = (bytes_per_pixel > 3) ? inp[3] / 255.0f : 1.0f;
+        out[0] = tbl.to_linear[inp[0]] * alpha;
+        out[1] = tbl.to_linear[inp[1]] * alpha;
+        out[2] = tbl.to_linear[inp[2]] * alpha;
+        out[3] = alpha;
+        out += 4;
+        inp += bytes_per_pixel;
+    }
+}
+
+/**
+ * Adds sums of every horizontal block of pixels in linear row into accumulator.
+ */
+static void row_accumulate_blocks(float *acc, const float *lin, int src_width, int dst_width, int factor)
+{
+    for (int x = 0; x < dst_width; x++)
+    {
+        int x_end = std::min((x + 1) * factor, src_width);
+        const float *pix = lin + 4 * x * factor;
+        const float *pix_end = lin + 4 * x_end;
+#if defined(__SSE2__)
+        // All 4 channels of a pixel are summed at once
+        __m128 sum = _mm_loadu_ps(acc);
+        for (; pix < pix_end; pix += 4)
+            sum = _mm_add_ps(sum, _mm_loadu_ps(pix));
+        _mm_storeu_ps(acc, sum);
+#else
+        for (; pix < pix_end; pix += 4)
+        {
+            acc[0] += pix[0];
+            acc[1] += pix[1];
+            acc[2] += pix[2];
+            acc[3] += pix[3];
+        }
+#endif
+        acc += 4;
+    }
+}
+
+/**
+ * Downscales area of RGB(A) image by given integer factor, averaging every block of factor x factor
+ * pixels in linear light. Colors are weighted by alpha, so transparent pixels don't darken
+ * the edges. Blocks at right and bottom edge may be partial, and are averaged over pixels they have.
+ */
+void image_downscale_box(png_bytep *dst_rows, int dst_width, int dst_height,
+    png_bytep const *src_rows, int src_x, int src_y, int src_width, int src_height,
+    int bytes_per_pixel, int factor)
+{
+    const SrgbTables& tbl = srgb_tables();
+    std::vector<float> lin(4 * src_width);
+    std::vector<float> acc(4 * dst_width);
+    for (int y = 0; y < dst_height; y++)
+    {
+        std::fill(acc.begin(), acc.end(), 0.0f);
+        int y_end = std::min((y + 1) * factor, src_height);
+        for (int sy = y * factor; sy < y_end; sy++)
+        {
+            row_to_linear(&lin.front(), src_rows[src_y + sy] + src_x * bytes_per_pixel, src_width, bytes_per_pixel, tbl);
+            row_accumulate_blocks(&acc.front(), &lin.front(), src_width, dst_width, factor);
+        }
+        png_bytep out = dst_rows[y];
+        for (int x = 0; x < dst_width; x++)
+        {
+            const float *sum = &acc[4 * x];
+            int count = (std::min((x + 1) * factor, src_width) - x * factor) * (y_end - y * factor);
+            if (sum[3] > 0.0f) {
+                for (int c = 0; c < 3; c++)
+                {
+                    float v = std::min(sum[c] / sum[3], 1.0f);
+                    out[c] = tbl.to_srgb[(int)(v * (LINEAR_TO_SRGB_STEPS - 1) + 0.5f)];
+                }
+            } else {
+                out[0] = out[1] = out[2] = 0;
+            }
+            if (bytes_per_pixel > 3)
+                out[3] = (png_byte)(sum[3] * 255.0f / count + 0.5f);
+            out += bytes_per_pixel;
+        }
+    }
+}
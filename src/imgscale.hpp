@@ -0,0 +1,7 @@
+#pragma once
+
+#include <png.h>
+
+void image_downscale_box(png_bytep *dst_rows, int dst_width, int dst_height,
+    png_bytep const *src_rows, int src_x, int src_y, int src_width, int src_height,
+    int bytes_per_pixel, int factor);
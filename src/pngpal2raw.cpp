@@ -26,12 +26,29 @@
 #include <getopt.h>
 #include <cstdint>
 #include <cstring>
+#include <cerrno>
 #include <cmath>
 #include <fstream>
 #include <sstream>
+#include <unordered_map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <chrono>
 #include <png.h>
 
 #include "ci_string.hpp"
+#include "datahash.hpp"
+#include "filemap.hpp"
+#include "workers.hpp"
+#include "atlaspack.hpp"
+#include "sprblit.hpp"
+#include "sprformat.hpp"
+#include "sprread.hpp"
+#include "embedout.hpp"
+#include "catdelta.hpp"
+#include "quantcache.hpp"
+#include "imgscale.hpp"
 #include "prog_options.hpp"
 #include "imagedata.hpp"
 #include "bfflic.h"
@@ -285,8 +302,11 @@ short convert_rgb_to_indexed(WorkingSet& ws, ImageData& img, bool hasAlpha)
         checkTrans=checkTransparent3;
     }
 
-    png_bytep* row_pointers=png_get_rows(img.png_ptr, img.info_ptr);
+    png_bytep* row_pointers=img.rowPointers();
 
+    // Pixel data of a view is shared, so indexes are stored in a separate buffer
+    if (img.isView())
+        img.view_index.resize(img.crop_width*img.crop_height);
     img.transMap.resize2d(img.width,img.height);
     img.transMap.zeroize2d();
     ws.mapErrorR.resize2d(img.crop_height+2*SHIFT,img.crop_width+2*SHIFT);
@@ -300,7 +320,7 @@ short convert_rgb_to_indexed(WorkingSet& ws, ImageData& img, bool hasAlpha)
     //for (int y=img.height-1; y>=0; --y)
     for (int y = 0; y < img.crop_height; y++)
     {
-        png_bytep row = row_pointers[y];
+        png_bytep row = img.isView() ? &img.view_index[y*img.crop_width] : row_pointers[y];
         png_bytep pixel = row_pointers[img.crop_y+y] + img.crop_x*bytesPerPixel;
         ColorTranparency::Column& transPtr = img.transMap[y];
 
@@ -319,6 +339,12 @@ short convert_rgb_to_indexed(WorkingSet& ws, ImageData& img, bool hasAlpha)
         LogDbg("Line %d non-transparent pixels %d", y, (int)std::count(transPtr.begin(), transPtr.end(), false));
     }
 
+    if (img.isView())
+    {
+        for (int y = 0; y < img.crop_height; y++)
+            img.view_rows[y] = &img.view_index[y*img.crop_width];
+        img.view_rows.resize(img.crop_height);
+    }
     img.col_bits = ws.requestedColorBPP();
     img.crop_x = 0;
     img.crop_y = 0;
@@ -347,10 +373,31 @@ inline void write_int32_le_file (FILE *fp, unsigned long x)
 }
 
 /**
- * Packs a line of width pixels (1 byte per pixel) in row, with 8/nbits pixels packed into each byte.
- * @return the new number of bytes in row
+ * Writes 2-byte little-endian number to given buffer.
+ */
+inline void write_int16_le_buf (unsigned char *buff, unsigned short x)
+{
+    buff[0] = (x&255);
+    buff[1] = ((x>>8)&255);
+}
+
+/**
+ * Writes 4-byte little-endian number to given buffer.
+ */
+inline void write_int32_le_buf (unsigned char *buff, unsigned long x)
+{
+    buff[0] = (x&255);
+    buff[1] = ((x>>8)&255);
+    buff[2] = ((x>>16)&255);
+    buff[3] = ((x>>24)&255);
+}
+
+/**
+ * Packs a line of width pixels (1 byte per pixel) from inp_row, with 8/nbits pixels packed into each byte.
+ * The packed line is stored in out_row; input row is not modified.
+ * @return the number of bytes stored in out_row
  */
-int raw_pack(png_bytep row, const ColorTranparency::Column& inp_trans, int width, int nbits)
+int raw_pack(png_bytep out_row, const png_bytep inp_row, const ColorTranparency::Column& inp_trans, int width, int nbits)
 {
     int pixelsPerByte = 8 / nbits;
     if (pixelsPerByte <= 1)
@@ -358,7 +405,9 @@ int raw_pack(png_bytep row, const ColorTranparency::Column& inp_trans, int width
         for (int i = 0; i < width; ++i)
         {
             if (inp_trans[i])
-                row[i] = 0; // transparent color is 0
+                out_row[i] = 0; // transparent color is 0
+            else
+                out_row[i] = inp_row[i];
         }
         return width;
     }
@@ -369,12 +418,12 @@ int raw_pack(png_bytep row, const ColorTranparency::Column& inp_trans, int width
     for (int i = 0; i < width; ++i)
     {
         if (!inp_trans[i])
-            outByte += (row[i] & ander);
+            outByte += (inp_row[i] & ander);
         else
             outByte += (0 & ander); // transparent color is 0
         if (++count == pixelsPerByte)
         {
-            row[outIndex] = outByte;
+            out_row[outIndex] = outByte;
             count = 0;
             ++outIndex;
             outByte = 0;
@@ -385,7 +434,7 @@ int raw_pack(png_bytep row, const ColorTranparency::Column& inp_trans, int width
     if (count > 0)
     {
         outByte <<= nbits * (pixelsPerByte - count);
-        row[outIndex] = outByte;
+        out_row[outIndex] = outByte;
         ++outIndex;
     }
 
@@ -423,90 +472,6 @@ int hspr_pack(png_bytep out_row, const png_bytep inp_row, const ColorTranparency
     return outIndex;
 }
 
-#pragma pack(1)
-
-/**
- * Structure defining TAB file entry for Small Sprite format DAT/TAB files.
- */
-struct SmallSpriteV1 {
-    /** Offset of the sprite data in DAT file. */
-    uint32_t Data;
-    /** Width of the sprite data. */
-    unsigned char SWidth;
-    /** Height of the sprite data. */
-    unsigned char SHeight;
-};
-
-/**
- * Structure defining TAB file entry for Jonty Sprite format JTY/TAB files.
- */
-struct JontySpriteV1 {
-    /** Offset of the sprite data in DAT file. */
-    uint32_t Data;
-    /** Width of the sprite data. */
-    unsigned char SWidth;
-    /** Height of the sprite data. */
-    unsigned char SHeight;
-    /** Width of the animation frame (same for whole animation). */
-    unsigned char FrameWidth;
-    /** Height of the animation frame (same for whole animation). */
-    unsigned char FrameHeight;
-    /** Flags informing whether the animation is rotable; 0 - non-rotable, 2 - rotable. */
-    unsigned char Rotable;
-    /** Amount of frames making up the animation (same for whole animation). */
-    unsigned char FramesCount;
-    /** Offset of the sprite within frame; width shift. */
-    char FrameOffsW;
-    /** Offset of the sprite within frame; height shift. */
-    char FrameOffsH;
-    /** Unidentified negative value A. */
-    signed short unkn6;
-    /** Unidentified negative value B. */
-    signed short unkn8;
-};
-
-/**
- * Structure defining TAB file entry for Small Sprite format Ver2 DAT/TAB files.
- */
-struct SmallSpriteV2 {
-    /** Offset of the sprite data in DAT file. */
-    uint32_t Data;
-    /** Width of the sprite data. */
-    unsigned short SWidth;
-    /** Height of the sprite data. */
-    unsigned short SHeight;
-};
-
-/**
- * Structure defining TAB file entry for Jonty Sprite format Ver2 JTY/TAB files.
- */
-struct JontySpriteV2 {
-    /** Offset of the sprite data in DAT file. */
-    uint32_t Data;
-    /** Width of the sprite data. */
-    unsigned short SWidth;
-    /** Height of the sprite data. */
-    unsigned short SHeight;
-    /** Width of the animation frame (same for whole animation). */
-    unsigned short FrameWidth;
-    /** Height of the animation frame (same for whole animation). */
-    unsigned short FrameHeight;
-    /** Flags informing whether the animation is rotable; 0 - non-rotable, 2 - rotable. */
-    unsigned char Rotable;
-    /** Amount of frames making up the animation (same for whole animation). */
-    unsigned char FramesCount;
-    /** Offset of the sprite within frame; width shift. */
-    short FrameOffsW;
-    /** Offset of the sprite within frame; height shift. */
-    short FrameOffsH;
-    /** Unidentified negative value A. */
-    signed short unkn6;
-    /** Unidentified negative value B. */
-    signed short unkn8;
-};
-
-#pragma pack()
-
 /**
  * Packs a line of pixels (1 byte per pixel) so that transparent bytes are RLE-encoded into SmallSprite.
  * @return the new number of bytes in row.
@@ -570,6 +535,185 @@ int sspr_pack(png_bytep out_row, const png_bytep inp_row, const ColorTranparency
     return outIndex;
 }
 
+/**
+ * Encodes given area of an image into SmallSprite format, appending it at end of the data buffer.
+ */
+void sspr_pack_sprite(std::vector<png_byte>& data, ImageData& img, int x, int y, int width, int height, const ColorPalette& palette)
+{
+    png_bytep * row_pointers = img.rowPointers();
+    for (int ry = 0; ry < height; ry++)
+    {
+        size_t pos = data.size();
+        data.resize(pos + width*3 + 1);
+        int newLength = sspr_pack(&data[pos], row_pointers[y+ry], img.transMap[y+ry], width, x, palette);
+        data.resize(pos + newLength);
+    }
+    {
+        // End an image with (-128) - it's available in u2 encoding, and only values -127..127
+        //are used for defining size of data and transparency, so this special value wasn't used before
+        data.push_back((png_byte)-128);
+    }
+}
+
+/**
+ * Packs a line of pixels (1 byte per pixel) so that transparent bytes are RLE-encoded into SmallSprite Ver3.
+ * Runs have signed 16-bit little-endian lengths; positive for filled pixels which follow, negative
+ * for transparent area. Transparent area at end of the line is not stored.
+ * @return the new number of bytes in row.
+ */
+int sspr3_pack(png_bytep out_row, const png_bytep inp_row, const ColorTranparency::Column& inp_trans, int width, int wskip)
+{
+    int area;
+    int outIndex=0;
+    int i=0;
+    while (i < width)
+    {
+        // Filled
+        area = 0;
+        while ( (i+area < width) && (!inp_trans[wskip+i+area]) ) {
+            area++;
+        }
+        while (area > 0) {
+            int part_area = std::min(area, (int)SHRT_MAX);
+            area -= part_area;
+            write_int16_le_buf(out_row+outIndex, part_area);
+            outIndex += 2;
+            memcpy(out_row+outIndex, inp_row+wskip+i, part_area);
+            outIndex += part_area;
+            i += part_area;
+        }
+        // Transparent
+        area = 0;
+        while ( (i+area < width) && inp_trans[wskip+i+area] ) {
+            area++;
+        }
+        if (i+area >= width) {
+            i += area;
+            area = 0;
+        }
+        while (area > 0) {
+            int part_area = std::min(area, (int)SHRT_MAX);
+            area -= part_area;
+            write_int16_le_buf(out_row+outIndex, -part_area);
+            outIndex += 2;
+            i += part_area;
+        }
+    }
+    { // End a line with 0
+        write_int16_le_buf(out_row+outIndex, 0);
+        outIndex += 2;
+    }
+    return outIndex;
+}
+
+/**
+ * Encodes given area of an image into SmallSprite Ver3 format, appending it at end of the data buffer.
+ * The sprite starts with 32-bit offsets of each row, relative to start of the sprite,
+ * so that rows above clipping window can be skipped without decoding them.
+ */
+void sspr3_pack_sprite(std::vector<png_byte>& data, ImageData& img, int x, int y, int width, int height, const ColorPalette& palette)
+{
+    png_bytep * row_pointers = img.rowPointers();
+    size_t start = data.size();
+    data.resize(start + 4*height);
+    for (int ry = 0; ry < height; ry++)
+    {
+        size_t pos = data.size();
+        write_int32_le_buf(&data[start + 4*ry], pos - start);
+        // Every run takes at least one pixel, and has 2-byte length
+        data.resize(pos + width*3 + 2);
+        int newLength = sspr3_pack(&data[pos], row_pointers[y+ry], img.transMap[y+ry], width, x);
+        data.resize(pos + newLength);
+    }
+}
+
+/**
+ * Function encoding given area of an image into sprite catalogue data buffer.
+ */
+typedef void (*sprite_pack_t)(std::vector<png_byte>&, ImageData&, int, int, int, int, const ColorPalette&);
+
+/**
+ * Buffer for encoded data of a sprite catalogue DAT file.
+ * Sprites are encoded at end of the buffer; with deduplication enabled,
+ * a sprite identical to one stored before is dropped, and offset of the
+ * previous copy is used instead.
+ */
+class SpriteDataBuffer
+{
+public:
+    SpriteDataBuffer(bool dedup_enable, size_t nalign = 1):dedup(dedup_enable),align(nalign),dup_count(0),dup_bytes(0){}
+    /**
+     * Pads the data with zeros, so that next sprite starts at multiple of the alignment.
+     * @return Offset at which the next sprite data starts.
+     */
+    size_t startSprite(void)
+    {
+        data.resize((data.size() + align - 1) / align * align);
+        return data.size();
+    }
+    /**
+     * Finishes adding sprite which data starts at given offset and reaches end of the buffer.
+     * @return Offset at which the sprite data can be found.
+     */
+    uint32_t commitSprite(size_t start)
+    {
+        size_t len = data.size() - start;
+        if (!dedup) {
+            sprites.push_back(SpriteBlob{start, len});
+            return start;
+        }
+        uint64_t hash = data_hash64(&data[start], len);
+        auto range = known.equal_range(hash);
+        for (auto it = range.first; it != range.second; it++)
+        {
+            const SpriteBlob& blob = it->second;
+            if ((blob.len == len) && (memcmp(&data[blob.offset], &data[start], len) == 0)) {
+                data.resize(start);
+                dup_count++;
+                dup_bytes += len;
+                sprites.push_back(blob);
+                return blob.offset;
+            }
+        }
+        known.insert(std::make_pair(hash, SpriteBlob{start, len}));
+        sprites.push_back(SpriteBlob{start, len});
+        return start;
+    }
+    /**
+     * Adds sprite with the same data as previously added sprite of given index, without encoding it.
+     * @return Offset at which the sprite data can be found.
+     */
+    uint32_t repeatSprite(unsigned idx)
+    {
+        SpriteBlob blob = sprites[idx];
+        if (dedup) {
+            dup_count++;
+            dup_bytes += blob.len;
+            sprites.push_back(blob);
+            return blob.offset;
+        }
+        size_t start = startSprite();
+        data.resize(start + blob.len);
+        memcpy(&data[start], &data[blob.offset], blob.len);
+        sprites.push_back(SpriteBlob{start, blob.len});
+        return start;
+    }
+    std::vector<png_byte> data;
+    bool dedup;
+    /** Alignment of offsets at which every sprite data starts */
+    size_t align;
+    unsigned dup_count;
+    size_t dup_bytes;
+    struct SpriteBlob {
+        size_t offset;
+        size_t len;
+    };
+    /** Data location of each sprite, in order of adding */
+    std::vector<SpriteBlob> sprites;
+private:
+    std::unordered_multimap<uint64_t, SpriteBlob> known;
+};
+
 std::string file_name_get_path(const std::string &fname_inp)
 {
     size_t tmp1,tmp2;
@@ -609,6 +753,42 @@ std::string file_name_change_extension(const std::string &fname_inp, const std::
     return fname;
 }
 
+/**
+ * Adds suffix to file name, before its extension.
+ */
+std::string file_name_add_suffix(const std::string &fname_inp, const std::string &suffix)
+{
+    std::string fname = fname_inp;
+    size_t base_pos = fname.length() - file_name_strip_path(fname).length();
+    size_t tmp2 = fname.find_last_of('.');
+    if ((tmp2 != std::string::npos) && (tmp2 > base_pos))
+        fname.insert(tmp2, suffix);
+    else
+        fname += suffix;
+    return fname;
+}
+
+/**
+ * Removes palette column, given as pal=<file> anywhere after the image name, from list file line.
+ * @return Palette file name, or empty string if the line has no palette column.
+ */
+std::string imagelist_line_take_palette(std::string& line)
+{
+    istringstream iss(line);
+    std::string str, rest, fname_pal;
+    if (!(iss >> rest))
+        return fname_pal;
+    while (iss >> str)
+    {
+        if ((str.length() > 4) && (ci_string(str.substr(0,4).c_str()).compare("pal=") == 0))
+            fname_pal = str.substr(4);
+        else
+            rest += " " + str;
+    }
+    line = rest;
+    return fname_pal;
+}
+
 int load_imagelist(ProgramOptions &opts, const std::string &fname, int anum = -1)
 {
     std::ifstream infile;
@@ -618,6 +798,7 @@ int load_imagelist(ProgramOptions &opts, const std::string &fname, int anum = -1
         perror(fname.c_str());
         return false;
     }
+    opts.fname_lists.push_back(fname);
     int fd[4] = {0,0,0,0};
     {
         // Initial line - animation name and format-specific parameters
@@ -627,13 +808,46 @@ int load_imagelist(ProgramOptions &opts, const std::string &fname, int anum = -1
         iss >> str >> fd[0] >> fd[1] >> fd[2] >> fd[3];
     }
     while (infile.good()) {
-        std::string str;
+        std::string line, str, mode;
         int dm[4] = {-1,-1,-1,-1};
-        std::getline(infile, str, '\n');
-        istringstream iss(str);
+        std::getline(infile, line, '\n');
+        std::string fname_pal = imagelist_line_take_palette(line);
+        if (!fname_pal.empty())
+            fname_pal = lstpath+"/"+fname_pal;
+        {
+            istringstream iss(line);
+            iss >> str >> mode;
+        }
+        if (ci_string(mode.c_str()).compare("grid") == 0) {
+            // Sprite sheet sliced into cells: name grid w h [cols rows]
+            int gw = -1, gh = -1, cols = -1, rows = -1;
+            istringstream iss(line);
+            iss >> str >> mode >> gw >> gh >> cols >> rows;
+            if ((gw <= 0) || (gh <= 0)) {
+                LogErr("%s: Incorrect grid cell size for \"%s\".",fname.c_str(),str.c_str());
+                return false;
+            }
+            if ((cols <= 0) || (rows <= 0)) {
+                png_uint_32 width, height;
+                if (load_inp_png_dimensions(lstpath+"/"+str, width, height) != ERR_OK)
+                    return false;
+                cols = width / gw;
+                rows = height / gh;
+            }
+            for (int gy = 0; gy < rows; gy++) {
+                for (int gx = 0; gx < cols; gx++) {
+                    opts.inp.push_back(ImageArea(lstpath+"/"+str,anum,gx*gw,gy*gh,gw,gh,fd[0],fd[1],fd[2],fd[3]));
+                    opts.inp.back().fname_pal = fname_pal;
+                }
+            }
+            LogDbg("%s anim=%d grid(%d %d %d %d) fd(%d %d %d %d)\n",str.c_str(),anum,gw,gh,cols,rows,fd[0],fd[1],fd[2],fd[3]);
+            continue;
+        }
+        istringstream iss(line);
         iss >> str >> dm[0] >> dm[1] >> dm[2] >> dm[3];
         if (!str.empty()) {
             opts.inp.push_back(ImageArea(lstpath+"/"+str,anum,dm[0],dm[1],dm[2],dm[3],fd[0],fd[1],fd[2],fd[3]));
+            opts.inp.back().fname_pal = fname_pal;
             LogDbg("%s anim=%d dm(%d %d %d %d) fd(%d %d %d %d)\n",str.c_str(),anum,dm[0],dm[1],dm[2],dm[3],fd[0],fd[1],fd[2],fd[3]);
         }
     }
@@ -649,6 +863,7 @@ int load_animlist(ProgramOptions &opts, const std::string &fname)
         perror(fname.c_str());
         return false;
     }
+    opts.fname_lists.push_back(fname);
     int i = 0;
     while (infile.good()) {
         std::string str;
@@ -671,7 +886,7 @@ int count_img_unused_lines_top(ImageData& img, ProgramOptions& opts, bool hasAlp
         checkTrans=checkTransparent3;
     }
 
-    png_bytep* row_pointers=png_get_rows(img.png_ptr, img.info_ptr);
+    png_bytep* row_pointers=img.rowPointers();
 
     for (unsigned y = 0; y < img.height; y++)
     {
@@ -700,7 +915,7 @@ int count_img_unused_lines_bottom(ImageData& img, ProgramOptions& opts, bool has
         checkTrans=checkTransparent3;
     }
 
-    png_bytep* row_pointers=png_get_rows(img.png_ptr, img.info_ptr);
+    png_bytep* row_pointers=img.rowPointers();
 
     for (int y = img.height - 1; y >= 0; y--)
     {
@@ -729,7 +944,7 @@ int count_img_unused_lines_left(ImageData& img, ProgramOptions& opts, bool hasAl
         checkTrans=checkTransparent3;
     }
 
-    png_bytep* row_pointers=png_get_rows(img.png_ptr, img.info_ptr);
+    png_bytep* row_pointers=img.rowPointers();
 
     for (unsigned x = 0; x < img.width; x++)
     {
@@ -756,7 +971,7 @@ int count_img_unused_lines_right(ImageData& img, ProgramOptions& opts, bool hasA
         checkTrans=checkTransparent3;
     }
 
-    png_bytep* row_pointers=png_get_rows(img.png_ptr, img.info_ptr);
+    png_bytep* row_pointers=img.rowPointers();
 
     for (unsigned x = img.width - 1; x >= 0; x--)
     {
@@ -774,11 +989,11 @@ int count_img_unused_lines_right(ImageData& img, ProgramOptions& opts, bool hasA
     return img.width - img.width/2;
 }
 
-short load_inp_additional_data(ImageData& img, const ImageArea& inp, ProgramOptions& opts)
+/**
+ * Sets the image crop area to part of the image given in input image area.
+ */
+void set_image_crop(ImageData& img, const ImageArea& inp)
 {
-    struct JontySpriteV1 *jtab1;
-    struct JontySpriteV2 *jtab2;
-    int ntop,nbottom,nright,nleft;
     if ((inp.x > 0) && (inp.x < (int)img.width)) {
         img.crop_x = inp.x;
     } else {
@@ -799,32 +1014,32 @@ short load_inp_additional_data(ImageData& img, const ImageArea& inp, ProgramOpti
     } else {
         img.crop_height = img.height - img.crop_y;
     }
-    switch (opts.fmt)
+}
+
+short load_inp_additional_data(ImageData& img, const ImageArea& inp, ProgramOptions& opts)
+{
+    struct JontySpriteV2 *jtab2;
+    int ntop,nbottom,nright,nleft;
+    // Views are created from the crop area already
+    if (!img.isView())
+        set_image_crop(img, inp);
+    if (opts.hasFormat(OutFmt_JSPR) || opts.hasFormat(OutFmt_JSPR2) || opts.hasFormat(OutFmt_JSPR3) || opts.atlas)
     {
-    case OutFmt_JSPR:
-        ntop = count_img_unused_lines_top(img, opts, (img.color_type & PNG_COLOR_MASK_ALPHA) != 0);
-        nbottom = count_img_unused_lines_bottom(img, opts, (img.color_type & PNG_COLOR_MASK_ALPHA) != 0);
-        nright = count_img_unused_lines_right(img, opts, (img.color_type & PNG_COLOR_MASK_ALPHA) != 0);
-        nleft = count_img_unused_lines_left(img, opts, (img.color_type & PNG_COLOR_MASK_ALPHA) != 0);
-        jtab1 = (struct JontySpriteV1 *)img.additional_data;
-        jtab1->Data = -1; // To be correctly set later
-        jtab1->SWidth = img.width-nright-nleft;
-        jtab1->SHeight = img.height-ntop-nbottom;
-        jtab1->FrameWidth = img.width;
-        jtab1->FrameHeight = img.height;
-        jtab1->FrameOffsW = nleft;
-        jtab1->FrameOffsH = ntop;
-        jtab1->Rotable = inp.fd[0];
-        jtab1->FramesCount = inp.fd[1];
-        jtab1->unkn6 = inp.fd[2];
-        jtab1->unkn8 = inp.fd[3];
-        break;
-    case OutFmt_JSPR2:
+        jtab2 = (struct JontySpriteV2 *)img.additional_data;
+        // Trimmed bounds of cached images are already known, and their pixels are indexes
+        if (img.cached) {
+            jtab2->Rotable = inp.fd[0];
+            jtab2->FramesCount = inp.fd[1];
+            jtab2->unkn6 = inp.fd[2];
+            jtab2->unkn8 = inp.fd[3];
+            return ERR_OK;
+        }
+        // Jonty Sprite entry is prepared in Ver2 layout; Ver1 writer narrows the values
+        // Atlas packing uses the same trimmed sprite bounds
         ntop = count_img_unused_lines_top(img, opts, (img.color_type & PNG_COLOR_MASK_ALPHA) != 0);
         nbottom = count_img_unused_lines_bottom(img, opts, (img.color_type & PNG_COLOR_MASK_ALPHA) != 0);
         nright = count_img_unused_lines_right(img, opts, (img.color_type & PNG_COLOR_MASK_ALPHA) != 0);
         nleft = count_img_unused_lines_left(img, opts, (img.color_type & PNG_COLOR_MASK_ALPHA) != 0);
-        jtab2 = (struct JontySpriteV2 *)img.additional_data;
         jtab2->Data = -1; // To be correctly set later
         jtab2->SWidth = img.width-nright-nleft;
         jtab2->SHeight = img.height-ntop-nbottom;
@@ -836,17 +1051,227 @@ short load_inp_additional_data(ImageData& img, const ImageArea& inp, ProgramOpti
         jtab2->FramesCount = inp.fd[1];
         jtab2->unkn6 = inp.fd[2];
         jtab2->unkn8 = inp.fd[3];
-        break;
+    }
+    return ERR_OK;
+}
+
+/**
+ * Gives max sprite dimension which TAB entries of given output format can store, or 0 if not limited.
+ */
+int format_max_sprite_dimension(int fmt)
+{
+    switch (fmt)
+    {
     case OutFmt_SSPR:
+    case OutFmt_JSPR:
+        return UCHAR_MAX;
     case OutFmt_SSPR2:
-    default:
-        break;
+    case OutFmt_JSPR2:
+    case OutFmt_SSPR3:
+    case OutFmt_JSPR3:
+        return USHRT_MAX;
     }
-    return ERR_OK;
+    return 0;
+}
+
+/**
+ * Informs whether writing given output creates a TAB file besides the main one.
+ */
+bool output_writes_tab(const OutputFile& out, const ProgramOptions& opts)
+{
+    switch (out.fmt)
+    {
+    case OutFmt_RAW:
+    case OutFmt_BMP:
+        return opts.atlas;
+    case OutFmt_HSPR:
+    case OutFmt_FLIC:
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Checks input images and list parameters without decoding the images, only reading PNG headers.
+ * Reports problems which would make the conversion fail or produce incorrect values,
+ * and estimates memory and work required for the conversion.
+ * @return Amount of errors found.
+ */
+unsigned inspect_input_files(ProgramOptions& opts)
+{
+    auto start = std::chrono::steady_clock::now();
+    unsigned num_errors = 0;
+    unsigned num_warnings = 0;
+    {
+        std::vector<std::string> fnames_pal(1, opts.fname_pal);
+        for (auto inp = opts.inp.begin(); inp != opts.inp.end(); inp++)
+        {
+            if (!inp->fname_pal.empty() && (std::find(fnames_pal.begin(), fnames_pal.end(), inp->fname_pal) == fnames_pal.end()))
+                fnames_pal.push_back(inp->fname_pal);
+        }
+        for (auto fname_pal = fnames_pal.begin(); fname_pal != fnames_pal.end(); fname_pal++)
+        {
+            FILE* palfile = fopen(fname_pal->c_str(),"rb");
+            if (palfile == NULL) {
+                perror(fname_pal->c_str());
+                num_errors++;
+            } else {
+                fclose(palfile);
+            }
+        }
+    }
+    // Read headers of every file once, in parallel
+    std::vector<std::string> fnames;
+    std::unordered_map<std::string,unsigned> fname_idx;
+    for (auto inp = opts.inp.begin(); inp != opts.inp.end(); inp++)
+    {
+        if (fname_idx.insert(std::make_pair(inp->fname, (unsigned)fnames.size())).second)
+            fnames.push_back(inp->fname);
+    }
+    std::vector<PngHeader> heads(fnames.size());
+    std::vector<short> results(fnames.size());
+    std::vector<int> errnos(fnames.size());
+    parallel_for(fnames.size(), [&](int i) {
+        results[i] = load_inp_png_header(fnames[i], heads[i]);
+        errnos[i] = errno;
+    });
+    size_t decode_mem = 0;
+    for (unsigned i = 0; i < fnames.size(); i++)
+    {
+        const PngHeader& head = heads[i];
+        if (results[i] == ERR_BAD_FILE) {
+            LogErr("%s: Not a PNG file",fnames[i].c_str());
+            num_errors++;
+        } else
+        if ((results[i] == ERR_FILE_READ) && (errnos[i] == 0)) {
+            LogErr("%s: File too short",fnames[i].c_str());
+            num_errors++;
+        } else
+        if (results[i] != ERR_OK) {
+            LogErr("%s: %s",fnames[i].c_str(),strerror(errnos[i]));
+            num_errors++;
+        } else
+        if ((head.color_type & PNG_COLOR_MASK_COLOR) == 0) {
+            LogErr("%s: Grayscale image not supported",fnames[i].c_str());
+            num_errors++;
+        } else
+        if ((head.width == 0) || (head.height == 0)) {
+            LogErr("%s: Image has no pixels",fnames[i].c_str());
+            num_errors++;
+        } else {
+            // Palette images may have transparency chunk, so are expanded to RGBA
+            int bytes_per_pixel = (head.color_type == PNG_COLOR_TYPE_RGB) ? 3 : 4;
+            decode_mem += (size_t)head.width * head.height * bytes_per_pixel;
+        }
+    }
+    // Check the image areas
+    int max_dim = 0;
+    bool jspr_v1 = opts.hasFormat(OutFmt_JSPR);
+    bool jspr = jspr_v1 || opts.hasFormat(OutFmt_JSPR2) || opts.hasFormat(OutFmt_JSPR3);
+    for (auto out = opts.outs.begin(); out != opts.outs.end(); out++)
+    {
+        int dim = format_max_sprite_dimension(out->fmt);
+        if ((dim > 0) && ((max_dim == 0) || (dim < max_dim)))
+            max_dim = dim;
+    }
+    size_t index_mem = 0;
+    size_t dither_mem = 0;
+    unsigned long long num_pixels = 0;
+    for (unsigned i = 0; i < opts.inp.size(); i++)
+    {
+        const ImageArea& inp = opts.inp[i];
+        unsigned n = fname_idx[inp.fname];
+        if (results[n] != ERR_OK)
+            continue;
+        const PngHeader& head = heads[n];
+        if (((inp.x > 0) && (inp.x >= (int)head.width)) || ((inp.y > 0) && (inp.y >= (int)head.height))) {
+            LogErr("%s: Image %u area at (%d,%d) starts outside of the %ux%u image",
+                inp.fname.c_str(),i,inp.x,inp.y,(unsigned)head.width,(unsigned)head.height);
+            num_errors++;
+            continue;
+        }
+        ImageData img;
+        img.width = head.width;
+        img.height = head.height;
+        set_image_crop(img, inp);
+        if (((inp.w > 0) && (img.crop_width < inp.w)) || ((inp.h > 0) && (img.crop_height < inp.h))) {
+            LogMsg("%s: Image %u area of size %dx%d exceeds the image, clamped to %dx%d",
+                inp.fname.c_str(),i,inp.w,inp.h,img.crop_width,img.crop_height);
+            num_warnings++;
+        }
+        if ((max_dim > 0) && ((img.crop_width > max_dim) || (img.crop_height > max_dim))) {
+            LogErr("%s: Image %u size %dx%d exceeds sprite catalogue limit of %d",
+                inp.fname.c_str(),i,img.crop_width,img.crop_height,max_dim);
+            num_errors++;
+        }
+        if (jspr)
+        {
+            if ((inp.fd[0] < 0) || (inp.fd[0] > UCHAR_MAX) || (inp.fd[1] < 0) || (inp.fd[1] > UCHAR_MAX)) {
+                LogErr("%s: Image %u rotable flags %d or frames count %d doesn't fit in unsigned char",
+                    inp.fname.c_str(),i,inp.fd[0],inp.fd[1]);
+                num_errors++;
+            }
+            if ((inp.fd[2] < SHRT_MIN) || (inp.fd[2] > SHRT_MAX) || (inp.fd[3] < SHRT_MIN) || (inp.fd[3] > SHRT_MAX)) {
+                LogErr("%s: Image %u values %d and %d don't fit in signed short",
+                    inp.fname.c_str(),i,inp.fd[2],inp.fd[3]);
+                num_errors++;
+            }
+            // Frame offsets depend on transparency, which is not known without decoding
+            if (jspr_v1 && ((img.crop_width > SCHAR_MAX) || (img.crop_height > SCHAR_MAX))) {
+                LogMsg("%s: Image %u size %dx%d may not allow storing frame offsets in JSPR1",
+                    inp.fname.c_str(),i,img.crop_width,img.crop_height);
+                num_warnings++;
+            }
+        }
+        // Palette indexes, transparency bits, and error diffusion maps which are reused between images
+        size_t pixels = (size_t)img.crop_width * img.crop_height;
+        size_t img_mem = pixels + (size_t)img.width * img.height / 8;
+        size_t img_dither_mem = 3 * sizeof(float) * (img.crop_width + 2*SHIFT) * (img.crop_height + 2*SHIFT);
+        index_mem += img_mem;
+        dither_mem = std::max(dither_mem, img_dither_mem);
+        num_pixels += pixels;
+        if (verbose)
+            LogMsg("Image %u \"%s\": %ux%u type %d depth %d, area %dx%d, %lu KiB, %lu pixels to convert",
+                i,inp.fname.c_str(),(unsigned)head.width,(unsigned)head.height,head.color_type,head.bit_depth,
+                img.crop_width,img.crop_height,(unsigned long)((img_mem + 1023) >> 10),(unsigned long)pixels);
+    }
+    double time_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    LogMsg("Inspected %u images in %u files within %.1f ms; %u errors, %u warnings.",
+        (unsigned)opts.inp.size(),(unsigned)fnames.size(),time_ms,num_errors,num_warnings);
+    LogMsg("Estimated memory %lu MiB (decoded %lu MiB, indexes %lu MiB), %llu pixels to convert.",
+        (unsigned long)((decode_mem + index_mem + dither_mem) >> 20),(unsigned long)(decode_mem >> 20),
+        (unsigned long)(index_mem >> 20),num_pixels);
+    return num_errors;
 }
 
+/**
+ * Values returned by getopt_long() for options which have no short form.
+ */
+enum {
+    LngOpt_DEDUP = 0x100,
+    LngOpt_SHEETQUANT,
+    LngOpt_SHARD,
+    LngOpt_ATLAS,
+    LngOpt_BLITBENCH,
+    LngOpt_UPDATE,
+    LngOpt_CACHEDIR,
+    LngOpt_CACHEMAX,
+    LngOpt_IFCHANGED,
+    LngOpt_DEPFILE,
+    LngOpt_INSPECT,
+    LngOpt_DRYRUN,
+    LngOpt_MIPS,
+    LngOpt_VERIFY,
+    LngOpt_EMBED,
+    LngOpt_ALIGN,
+    LngOpt_DELTA,
+    LngOpt_APPLYDELTA,
+};
+
 int load_command_line_options(ProgramOptions &opts, int argc, char *argv[])
 {
+    // Output names given before any format
+    OutputFile first_out(OutFmt_RAW);
     opts.clear();
     while (1)
     {
@@ -861,6 +1286,24 @@ int load_command_line_options(ProgramOptions &opts, int argc, char *argv[])
             {"outtab",  required_argument, 0, 't'},
             {"palette", required_argument, 0, 'p'},
             {"range",   required_argument, 0, 'r'},
+            {"dedup",   no_argument,       0, LngOpt_DEDUP},
+            {"sheetquant",no_argument,     0, LngOpt_SHEETQUANT},
+            {"shard",   optional_argument, 0, LngOpt_SHARD},
+            {"atlas",   optional_argument, 0, LngOpt_ATLAS},
+            {"blitbench",no_argument,      0, LngOpt_BLITBENCH},
+            {"update",  optional_argument, 0, LngOpt_UPDATE},
+            {"cache-dir",required_argument,0, LngOpt_CACHEDIR},
+            {"cache-max",required_argument,0, LngOpt_CACHEMAX},
+            {"if-changed",no_argument,     0, LngOpt_IFCHANGED},
+            {"depfile", optional_argument, 0, LngOpt_DEPFILE},
+            {"inspect", no_argument,       0, LngOpt_INSPECT},
+            {"dry-run", no_argument,       0, LngOpt_DRYRUN},
+            {"mips",    required_argument, 0, LngOpt_MIPS},
+            {"verify",  no_argument,       0, LngOpt_VERIFY},
+            {"embed",   required_argument, 0, LngOpt_EMBED},
+            {"align",   required_argument, 0, LngOpt_ALIGN},
+            {"delta",   required_argument, 0, LngOpt_DELTA},
+            {"apply-delta",required_argument,0,LngOpt_APPLYDELTA},
             {NULL,      0,                 0,'\0'}
         };
         /* getopt_long stores the option index here. */
@@ -893,21 +1336,25 @@ int load_command_line_options(ProgramOptions &opts, int argc, char *argv[])
             break;
         case 'f':
             if (ci_string(optarg).compare("HSPR") == 0)
-                opts.fmt = OutFmt_HSPR;
+                opts.outs.push_back(OutputFile(OutFmt_HSPR));
             else if (ci_string(optarg).compare("SSPR") == 0)
-                opts.fmt = OutFmt_SSPR;
+                opts.outs.push_back(OutputFile(OutFmt_SSPR));
             else if (ci_string(optarg).compare("JSPR") == 0)
-                opts.fmt = OutFmt_JSPR;
+                opts.outs.push_back(OutputFile(OutFmt_JSPR));
             else if (ci_string(optarg).compare("SSPR2") == 0)
-                opts.fmt = OutFmt_SSPR2;
+                opts.outs.push_back(OutputFile(OutFmt_SSPR2));
             else if (ci_string(optarg).compare("JSPR2") == 0)
-                opts.fmt = OutFmt_JSPR2;
+                opts.outs.push_back(OutputFile(OutFmt_JSPR2));
+            else if (ci_string(optarg).compare("SSPR3") == 0)
+                opts.outs.push_back(OutputFile(OutFmt_SSPR3));
+            else if (ci_string(optarg).compare("JSPR3") == 0)
+                opts.outs.push_back(OutputFile(OutFmt_JSPR3));
             else if (ci_string(optarg).compare("FLIC") == 0)
-                opts.fmt = OutFmt_FLIC;
+                opts.outs.push_back(OutputFile(OutFmt_FLIC));
             else if (ci_string(optarg).compare("RAW") == 0)
-                opts.fmt = OutFmt_RAW;
+                opts.outs.push_back(OutputFile(OutFmt_RAW));
             else if (ci_string(optarg).compare("BMP") == 0)
-                opts.fmt = OutFmt_BMP;
+                opts.outs.push_back(OutputFile(OutFmt_BMP));
             else
                 return false;
             break;
@@ -941,10 +1388,17 @@ int load_command_line_options(ProgramOptions &opts, int argc, char *argv[])
             opts.lvl = atol(optarg);
             break;
         case 'o':
-            opts.fname_out = optarg;
+            // Output names apply to the format given before them
+            if (opts.outs.empty())
+                first_out.fname_out = optarg;
+            else
+                opts.outs.back().fname_out = optarg;
             break;
         case 't':
-            opts.fname_tab = optarg;
+            if (opts.outs.empty())
+                first_out.fname_tab = optarg;
+            else
+                opts.outs.back().fname_tab = optarg;
             break;
         case 'p':
             opts.fname_pal = optarg;
@@ -952,6 +1406,123 @@ int load_command_line_options(ProgramOptions &opts, int argc, char *argv[])
         case 'r':
             opts.pal_range = atol(optarg);
             break;
+        case LngOpt_DEDUP:
+            opts.dedup = true;
+            break;
+        case LngOpt_SHEETQUANT:
+            opts.sheet_quant = true;
+            break;
+        case LngOpt_SHARD:
+            opts.shard = true;
+            if (optarg != NULL)
+                opts.shard_max = atol(optarg);
+            break;
+        case LngOpt_UPDATE:
+            opts.update = true;
+            if (optarg != NULL)
+            {
+                // Sprite indexes given as comma-separated list, with ranges like 4-7
+                std::istringstream iss(optarg);
+                std::string item;
+                while (std::getline(iss, item, ','))
+                {
+                    char *endptr;
+                    long first = strtol(item.c_str(), &endptr, 10);
+                    long last = first;
+                    if (*endptr == '-')
+                        last = strtol(endptr+1, &endptr, 10);
+                    if ((*endptr != '\0') || (first < 0) || (last < first)) {
+                        LogErr("Incorrect sprite index \"%s\" to update.",item.c_str());
+                        return false;
+                    }
+                    for (long i = first; i <= last; i++)
+                        opts.update_idx.push_back(i);
+                }
+            }
+            break;
+        case LngOpt_BLITBENCH:
+            opts.blit_bench = true;
+            break;
+        case LngOpt_CACHEDIR:
+            opts.cache_dir = optarg;
+            break;
+        case LngOpt_CACHEMAX:
+            {
+                char *endptr;
+                long cache_max = strtol(optarg, &endptr, 10);
+                // The size in bytes needs to fit in size_t
+                if ((*endptr != '\0') || (cache_max < 0) || ((unsigned long)cache_max > (SIZE_MAX >> 20)) ||
+                  ((unsigned long)cache_max > UINT_MAX)) {
+                    LogErr("Incorrect max size of the cache \"%s\".",optarg);
+                    return false;
+                }
+                opts.cache_max = cache_max;
+            }
+            break;
+        case LngOpt_IFCHANGED:
+            opts.if_changed = true;
+            break;
+        case LngOpt_MIPS:
+            opts.mips = atol(optarg);
+            if (opts.mips > 8) {
+                LogErr("Incorrect amount of mip levels \"%s\".",optarg);
+                return false;
+            }
+            break;
+        case LngOpt_DRYRUN:
+            opts.dry_run = true;
+            break;
+        case LngOpt_ALIGN:
+            opts.align = atol(optarg);
+            if ((opts.align < 1) || (opts.align > 4096) || ((opts.align & (opts.align - 1)) != 0)) {
+                LogErr("Incorrect alignment \"%s\"; needs to be a power of 2, up to 4096.",optarg);
+                return false;
+            }
+            break;
+        case LngOpt_VERIFY:
+            opts.verify = true;
+            break;
+        case LngOpt_DELTA:
+            opts.fname_delta_base = optarg;
+            break;
+        case LngOpt_APPLYDELTA:
+            opts.fname_delta_apply = optarg;
+            break;
+        case LngOpt_EMBED:
+            if (ci_string(optarg).compare("C") == 0)
+                opts.embed = Embed_CSRC;
+            else if (ci_string(optarg).compare("ELF") == 0)
+                opts.embed = Embed_ELF;
+            else {
+                LogErr("Unrecognized embedding form \"%s\".",optarg);
+                return false;
+            }
+            break;
+        case LngOpt_INSPECT:
+            opts.inspect = true;
+            break;
+        case LngOpt_DEPFILE:
+            opts.depfile = true;
+            if (optarg != NULL)
+                opts.fname_dep = optarg;
+            break;
+        case LngOpt_ATLAS:
+            opts.atlas = true;
+            if (optarg != NULL)
+            {
+                // Page size given as <w>x<h>, or a single number for square pages
+                char *endptr;
+                opts.atlas_width = strtol(optarg, &endptr, 10);
+                opts.atlas_height = opts.atlas_width;
+                if ((*endptr == 'x') || (*endptr == 'X'))
+                    opts.atlas_height = strtol(endptr+1, &endptr, 10);
+                if ((*endptr != '\0') || (opts.atlas_width <= 0) || (opts.atlas_height <= 0) ||
+                    (opts.atlas_width > USHRT_MAX) || (opts.atlas_height > USHRT_MAX)) {
+                    LogErr("Incorrect atlas page size \"%s\".",optarg);
+                    return false;
+                }
+            }
+            break;
         case '?':
                // unrecognized option
                // getopt_long already printed an error message
@@ -983,51 +1554,170 @@ int load_command_line_options(ProgramOptions &opts, int argc, char *argv[])
             return false;
         }
     }
+    if (opts.atlas && (opts.batch == Batch_NONE))
+    {
+        LogErr("Atlas packing requires a list of input images.");
+        return false;
+    }
     if ((optind < argc) || (opts.inp.empty() && opts.fname_lst.empty()))
     {
         LogErr("Incorrectly specified input file name.");
         return false;
     }
-    if ((opts.fmt != OutFmt_SSPR) && (opts.fmt != OutFmt_JSPR) &&
-        (opts.fmt != OutFmt_SSPR2) && (opts.fmt != OutFmt_JSPR2) && (opts.fmt != OutFmt_FLIC) &&
-        (opts.fmt != OutFmt_RAW)  && (opts.fmt != OutFmt_BMP) && (opts.inp.size() != 1))
+    if (!opts.fname_delta_apply.empty())
     {
-        LogErr("This format supports only one input file name.");
-        return false;
+        // The input is existing DAT file, patched in place unless other output name is given
+        if ((opts.batch != Batch_NONE) || (opts.inp.size() != 1)) {
+            LogErr("Applying delta requires a single DAT file to be patched.");
+            return false;
+        }
+        OutputFile out = first_out;
+        if (out.fname_out.empty())
+            out.fname_out = opts.inp[0].fname;
+        if (out.fname_tab.empty())
+            out.fname_tab = file_name_change_extension(out.fname_out,"tab");
+        opts.outs.assign(1, out);
+        return true;
     }
-    // fill names that were not set by arguments
-    if (opts.fname_out.length() < 1)
+    if (opts.outs.empty())
     {
-        switch (opts.fmt)
-        {
-        case OutFmt_HSPR:
-        case OutFmt_SSPR:
-        case OutFmt_SSPR2:
-            opts.fname_out = file_name_change_extension(file_name_strip_path(opts.inp[0].fname),"dat");
-            break;
-        case OutFmt_JSPR:
-        case OutFmt_JSPR2:
-            opts.fname_out = file_name_change_extension(file_name_strip_path(opts.inp[0].fname),"jty");
-            break;
-        case OutFmt_FLIC:
-            opts.fname_out = file_name_change_extension(file_name_strip_path(opts.inp[0].fname),"fli");
-            break;
-        case OutFmt_BMP:
-            opts.fname_out = file_name_change_extension(file_name_strip_path(opts.inp[0].fname),"bmp");
-            break;
-        case OutFmt_RAW:
-        default:
-            opts.fname_out = file_name_change_extension(file_name_strip_path(opts.inp[0].fname),"raw");
-            break;
+        opts.outs.push_back(first_out);
+    }
+    else
+    {
+        if (opts.outs[0].fname_out.empty())
+            opts.outs[0].fname_out = first_out.fname_out;
+        if (opts.outs[0].fname_tab.empty())
+            opts.outs[0].fname_tab = first_out.fname_tab;
+    }
+    for (auto out = opts.outs.begin(); out != opts.outs.end(); out++)
+    {
+        if ((out->fmt != OutFmt_SSPR) && (out->fmt != OutFmt_JSPR) &&
+            (out->fmt != OutFmt_SSPR2) && (out->fmt != OutFmt_JSPR2) && (out->fmt != OutFmt_FLIC) &&
+            (out->fmt != OutFmt_SSPR3) && (out->fmt != OutFmt_JSPR3) &&
+            (out->fmt != OutFmt_RAW)  && (out->fmt != OutFmt_BMP) && (opts.inp.size() != 1))
+        {
+            LogErr("This format supports only one input file name.");
+            return false;
+        }
+        // fill names that were not set by arguments
+        if (out->fname_out.length() < 1)
+        {
+            switch (out->fmt)
+            {
+            case OutFmt_HSPR:
+            case OutFmt_SSPR:
+            case OutFmt_SSPR2:
+            case OutFmt_SSPR3:
+                out->fname_out = file_name_change_extension(file_name_strip_path(opts.inp[0].fname),"dat");
+                break;
+            case OutFmt_JSPR:
+            case OutFmt_JSPR2:
+            case OutFmt_JSPR3:
+                out->fname_out = file_name_change_extension(file_name_strip_path(opts.inp[0].fname),"jty");
+                break;
+            case OutFmt_FLIC:
+                out->fname_out = file_name_change_extension(file_name_strip_path(opts.inp[0].fname),"fli");
+                break;
+            case OutFmt_BMP:
+                out->fname_out = file_name_change_extension(file_name_strip_path(opts.inp[0].fname),"bmp");
+                break;
+            case OutFmt_RAW:
+            default:
+                out->fname_out = file_name_change_extension(file_name_strip_path(opts.inp[0].fname),"raw");
+                break;
+            }
+        }
+        if (out->fname_tab.length() < 1)
+        {
+            out->fname_tab = file_name_change_extension(out->fname_out,"tab");
+        }
+    }
+    if (opts.update)
+    {
+        int fmt = opts.outs[0].fmt;
+        if ((opts.batch == Batch_NONE) || (opts.outs.size() > 1) || opts.shard || opts.blit_bench || opts.dry_run ||
+            ((fmt != OutFmt_SSPR) && (fmt != OutFmt_SSPR2) && (fmt != OutFmt_SSPR3) &&
+             (fmt != OutFmt_JSPR) && (fmt != OutFmt_JSPR2) && (fmt != OutFmt_JSPR3)))
+        {
+            LogErr("Updating requires a list of input images, and a single sprite catalogue output.");
+            return false;
+        }
+    }
+    if (!opts.fname_delta_base.empty())
+    {
+        int fmt = opts.outs[0].fmt;
+        if ((opts.outs.size() > 1) || opts.shard || opts.dry_run ||
+            ((fmt != OutFmt_SSPR) && (fmt != OutFmt_SSPR2) && (fmt != OutFmt_SSPR3) &&
+             (fmt != OutFmt_JSPR) && (fmt != OutFmt_JSPR2) && (fmt != OutFmt_JSPR3)))
+        {
+            LogErr("Making delta requires a single sprite catalogue output, not split into shards.");
+            return false;
+        }
+    }
+    {
+        // Outputs are written by parallel threads, so no two of them may write the same file
+        std::set<std::string> written;
+        for (auto out = opts.outs.begin(); out != opts.outs.end(); out++)
+        {
+            std::vector<std::string> fnames;
+            fnames.push_back(out->fname_out);
+            if (output_writes_tab(*out, opts))
+                fnames.push_back(out->fname_tab);
+            for (auto fname = fnames.begin(); fname != fnames.end(); fname++)
+            {
+                if (!written.insert(*fname).second) {
+                    LogErr("Output file \"%s\" would be written more than once; give distinct names with -o and -t.",
+                        fname->c_str());
+                    return false;
+                }
+            }
         }
     }
-    if (opts.fname_tab.length() < 1)
+    if ((opts.embed != Embed_NONE) && opts.update)
+    {
+        LogErr("Embedding catalogue data cannot be combined with updating.");
+        return false;
+    }
+    if (opts.embed != Embed_NONE)
+    {
+        // Embedded files are named after the output without extension, so these must differ
+        for (auto out = opts.outs.begin(); out != opts.outs.end(); out++)
+            for (auto other = opts.outs.begin(); other != out; other++)
+                if (file_name_change_extension(out->fname_out,"h") == file_name_change_extension(other->fname_out,"h")) {
+                    LogErr("Outputs \"%s\" and \"%s\" would have the same embedded data names.",
+                        other->fname_out.c_str(),out->fname_out.c_str());
+                    return false;
+                }
+    }
+    if ((opts.mips > 0) && (opts.update || !opts.cache_dir.empty()))
     {
-        opts.fname_tab = file_name_change_extension(opts.fname_out,"tab");
+        LogErr("Mip levels are made from decoded images, so cannot be combined with updating or cache.");
+        return false;
     }
     if (opts.fname_pal.length() < 1)
     {
-        opts.fname_pal = file_name_change_extension(opts.fname_out,"pal");
+        opts.fname_pal = file_name_change_extension(opts.outs[0].fname_out,"pal");
+    }
+    {
+        bool own_palettes = false;
+        for (auto inp = opts.inp.begin(); inp != opts.inp.end(); inp++)
+        {
+            // Main palette given in a list works the same as no palette column
+            if (inp->fname_pal == opts.fname_pal)
+                inp->fname_pal.clear();
+            if (!inp->fname_pal.empty())
+                own_palettes = true;
+        }
+        if (own_palettes && (opts.hasFormat(OutFmt_BMP) || opts.hasFormat(OutFmt_FLIC)))
+        {
+            LogErr("Images with own palettes cannot be written to BMP or FLIC, which store one palette.");
+            return false;
+        }
+    }
+    if (opts.depfile && (opts.fname_dep.length() < 1))
+    {
+        opts.fname_dep = file_name_change_extension(opts.outs[0].fname_out,"d");
     }
     return true;
 }
@@ -1050,13 +1740,45 @@ short show_usage(const std::string &fname)
     printf("    -v,--verbose             Verbose console output mode\n");
     printf("    -d<alg>,--diffuse<alg>   Diffusion algorithm used for bpp conversion\n");
     printf("    -l<num>,--dflevel<num>   Diffusion level, 1..100\n");
-    printf("    -f<fmt>,--format<fmt>    Output file format; RAW, HSPR, SSPR, JSPR, SSPR2, JSPR2, FLIC\n");
+    printf("    -f<fmt>,--format<fmt>    Output file format; RAW, BMP, HSPR, SSPR, JSPR, SSPR2, JSPR2, SSPR3, JSPR3, FLIC\n");
+    printf("                             can be repeated; -o and -t following it apply to that output\n");
     printf("    -p<file>,--palette<file> Input PAL file name\n");
     printf("    -r<num>,--range<num>     Color values range in input PAL file, 1..255\n");
     printf("    -o<file>,--output<file>  Output image file name\n");
     printf("    -t<file>,--outtab<file>  Output tabulation file name\n");
     printf("    -b,--batchlist           Batch, input file is not an image but contains a list of PNGs\n");
     printf("    -m,--framelist           Batch, input file is a list of animations which consist of PNGs\n");
+    printf("    --dedup                  Sprite catalogues; store identical sprites once, sharing their DAT offset\n");
+    printf("    --sheetquant             Batch; convert colors of whole sprite sheet at once, then slice it\n");
+    printf("    --shard[=<num>]          Sprite catalogues; split into several DAT/TAB files at animation boundaries\n");
+    printf("                             if format limits, or <num> sprites per file, are exceeded\n");
+    printf("    --atlas[=<w>x<h>]        Batch RAW/BMP; pack trimmed sprites into atlas pages of given size,\n");
+    printf("                             and write their coordinates into TAB file\n");
+    printf("    --blitbench              Measure clipped drawing of the sprites from SSPR2 and SSPR3 data\n");
+    printf("    --update[=<idx>,...]     Sprite catalogues; update existing DAT/TAB, encoding only sprites of given\n");
+    printf("                             indexes or ranges (like 4-7), and images beyond the catalogue end\n");
+    printf("    --cache-dir=<dir>        Keep images converted to palette indexes in given directory, and reuse\n");
+    printf("                             them in later runs if input file and conversion parameters are the same\n");
+    printf("    --cache-max=<num>        Max size of the cache directory in MiB; least recently used are removed\n");
+    printf("    --if-changed             Leave output files untouched if their content would not change\n");
+    printf("    --depfile[=<file>]       Write make-style dependency file, listing input images, lists and palette\n");
+    printf("    --inspect                Only check input files and list parameters, reading just PNG headers,\n");
+    printf("                             and estimate memory and work required for conversion\n");
+    printf("    --dry-run                Convert and encode the images, but only print sizes of the output files\n");
+    printf("                             and encoded sprites, without writing anything\n");
+    printf("    --mips=<num>             Also write every output for given amount of levels downscaled by 2, 4, ...\n");
+    printf("                             with names suffixed by _mip1, _mip2, ...\n");
+    printf("    --verify                 Sprite catalogues; read back the written DAT/TAB files, compare sprites\n");
+    printf("                             with converted images, and measure decoding speed\n");
+    printf("    --align=<num>            Sprite catalogues; start data of every sprite at DAT offset being multiple\n");
+    printf("                             of <num>, padding with zeros between sprites\n");
+    printf("    --embed=<c|elf>          Sprite catalogues; also write DAT, TAB and palette data as C source or ELF\n");
+    printf("                             object, with a header declaring the arrays, for linking into a program\n");
+    printf("    --delta=<file>           Sprite catalogues; also write DLT file with sprites and TAB entries which\n");
+    printf("                             differ from previous build of the catalogue, given as its DAT file;\n");
+    printf("                             if that file does not exist, the delta contains the whole catalogue\n");
+    printf("    --apply-delta=<file>     Patch input DAT file and its TAB with given DLT file, instead of conversion;\n");
+    printf("                             -o and -t allow writing the result elsewhere\n");
     return ERR_OK;
 }
 
@@ -1099,551 +1821,1945 @@ short load_inp_palette_file(WorkingSet& ws, const std::string& fname_pal, Progra
     return ERR_OK;
 }
 
-short save_raw_file(WorkingSet& ws, std::vector<ImageData>& imgs, const std::string& fname_out, ProgramOptions& opts)
+/**
+ * Working sets for all palettes used by the images; each is prepared on first use.
+ */
+class PaletteCache
 {
-    // Open and write the RAW file
-    FILE* rawfile;
+public:
+    /**
+     * Gives working set for converting images to given palette; the palette file is read only once.
+     */
+    short get(WorkingSet *&ws, const std::string& fname_pal, ProgramOptions& opts)
     {
-        rawfile = fopen(fname_out.c_str(),"wb");
-        if (rawfile == NULL) {
-            perror(fname_out.c_str());
-            return ERR_CANT_OPEN;
+        auto it = sets.find(fname_pal);
+        if (it != sets.end()) {
+            ws = &it->second;
+            return ERR_OK;
         }
+        WorkingSet& nws = sets[fname_pal];
+        nws.alg = opts.alg;
+        nws.ditherLevel(opts.lvl);
+        nws.requestedColors(256);
+        if (verbose)
+            LogMsg("Loading palette file \"%s\".",fname_pal.c_str());
+        short ret = load_inp_palette_file(nws, fname_pal, opts);
+        if (ret != ERR_OK) {
+            sets.erase(fname_pal);
+            return ret;
+        }
+        ws = &nws;
+        return ERR_OK;
     }
+private:
+    std::map<std::string, WorkingSet> sets;
+};
+
+/**
+ * Layout of the pixel data within RAW or BMP file.
+ */
+struct RawLayout {
+    int width; ///< Width of the output image, in pixels
+    int height; ///< Height of the output image, in pixels
+    int line_len; ///< Length of one output line, in bytes
+    int tile_num_x; ///< Amount of tiles in each line of tiles, or 0 if not tiled
+    int tile_width;
+    int tile_height;
+};
+
+/**
+ * Computes dimensions of the output RAW or BMP image, before any data is written.
+ * @param pad_lines Whether tiled output lines should be padded to 4 bytes.
+ */
+short raw_layout_compute(RawLayout& lay, std::vector<ImageData>& imgs, ProgramOptions& opts, bool pad_lines)
+{
     if (opts.batch == Batch_FILELIST)
     {
-        int tile_num_x, tile_width, tile_height;
-        {
-            tile_num_x = opts.inp[0].fd[0];
-            tile_width = opts.inp[0].fd[2];
-            tile_height = opts.inp[0].fd[3];
+        lay.tile_num_x = opts.inp[0].fd[0];
+        lay.tile_width = opts.inp[0].fd[2];
+        lay.tile_height = opts.inp[0].fd[3];
+        if (lay.tile_num_x <= 0) {
+            LogErr("Amount of tiles in line of RAW file is %d, must be positive",lay.tile_num_x);
+            return ERR_BAD_FILE;
         }
-        for (int i = 0; i < (int)imgs.size(); i += tile_num_x)
-        {
-            if (i + tile_num_x - 1 >= (int)imgs.size()) {
-                LogErr("Amount of images does not allow to completely fill whole line of RAW file");
-                break;
-            }
-            std::vector<png_bytep *> row_pointers;
-            row_pointers.resize(tile_num_x);
-            // For every row of tile images, get all row pointers
-            for (int k = 0; k < tile_num_x; k++)
-            {
-                ImageData &img = imgs[i+k];
-                row_pointers[k] = png_get_rows(img.png_ptr, img.info_ptr);
-            }
-            // Now, write output lines which merge the tiles
-            std::vector<png_byte> out_row;
-            out_row.resize(tile_num_x*tile_width);
-            for (int y=0; y<tile_height; y++)
-            {
-                for (int k = 0; k < tile_num_x; k++)
-                {
-                    ImageData &img = imgs[i+k];
-                    png_bytep inp_row = row_pointers[k][img.crop_y+y];
-                    ColorTranparency::Column& inp_trans = img.transMap[img.crop_y+y];
-                    int newLength = raw_pack(inp_row, inp_trans, img.crop_width, img.colorBPP());
-                    memcpy(&out_row.front()+k*tile_width,inp_row,newLength);
-                }
-                if (fwrite(&out_row.front(),out_row.size(),1,rawfile) != 1)
-                { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-            }
+        if ((imgs.size() % lay.tile_num_x) != 0) {
+            LogErr("Amount of images does not allow to completely fill whole line of RAW file");
+            return ERR_BAD_FILE;
         }
+        lay.width = lay.tile_num_x * lay.tile_width;
+        lay.height = (imgs.size() / lay.tile_num_x) * lay.tile_height;
+        lay.line_len = lay.width;
+        if (pad_lines)
+            lay.line_len = (lay.line_len + 3) & ~3;
     } else
     {
         ImageData & img = imgs[0];
-        png_bytep * row_pointers = png_get_rows(img.png_ptr, img.info_ptr);
-        for (unsigned y = 0; y < img.height; y++)
-        {
-            png_bytep row = row_pointers[y];
-            ColorTranparency::Column& inp_trans = img.transMap[y];
-            int newLength = raw_pack(row, inp_trans, img.width, img.colorBPP());
-            if (fwrite(row, newLength, 1, rawfile) != 1)
-            { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-            for (int i = 0; i < xorMaskLineLen(img) - newLength; i++)
-                writeByte(rawfile,0);
-        }
+        lay.tile_num_x = 0;
+        lay.tile_width = img.width;
+        lay.tile_height = img.height;
+        lay.width = img.width;
+        lay.height = img.height;
+        lay.line_len = xorMaskLineLen(img);
     }
-    fclose(rawfile);
     return ERR_OK;
 }
 
-short save_bmp_file(WorkingSet& ws, std::vector<ImageData>& imgs, const std::string& fname_out, ProgramOptions& opts)
+/**
+ * Fills one line of the output RAW or BMP image.
+ * The line buffer is expected to be zero-filled.
+ */
+void raw_layout_fill_line(png_bytep out_line, const RawLayout& lay, std::vector<ImageData>& imgs, int y_out)
 {
-    // Open and write the BMP file
-    FILE* bmpfile;
+    if (lay.tile_num_x > 0)
     {
-        bmpfile = fopen(fname_out.c_str(),"wb");
-        if (bmpfile == NULL) {
-            perror(fname_out.c_str());
-            return ERR_CANT_OPEN;
+        int i = (y_out / lay.tile_height) * lay.tile_num_x;
+        int y = y_out % lay.tile_height;
+        for (int k = 0; k < lay.tile_num_x; k++)
+        {
+            ImageData &img = imgs[i+k];
+            if (y >= img.crop_height)
+                continue;
+            int width = std::min(img.crop_width, lay.tile_width);
+            png_bytep inp_row = img.rowPointers()[img.crop_y+y] + img.crop_x;
+            ColorTranparency::Column& inp_trans = img.transMap[img.crop_y+y];
+            raw_pack(out_line+k*lay.tile_width, inp_row, inp_trans, width, img.colorBPP());
         }
+    } else
+    {
+        ImageData & img = imgs[0];
+        png_bytep inp_row = img.rowPointers()[y_out];
+        ColorTranparency::Column& inp_trans = img.transMap[y_out];
+        raw_pack(out_line, inp_row, inp_trans, img.width, img.colorBPP());
+    }
+}
+
+/**
+ * Fills all lines of the output RAW or BMP image, spreading the work over threads.
+ * Every line has its final place within the output buffer, so the bands of lines
+ * can be assembled in any order.
+ */
+void raw_layout_fill(png_bytep out_data, const RawLayout& lay, std::vector<ImageData>& imgs)
+{
+    const int band_height = 64;
+    int num_bands = (lay.height + band_height - 1) / band_height;
+    parallel_for(num_bands, [&](int band) {
+        int y_end = std::min((band + 1) * band_height, lay.height);
+        for (int y_out = band * band_height; y_out < y_end; y_out++)
+            raw_layout_fill_line(out_data + (size_t)y_out * lay.line_len, lay, imgs, y_out);
+    });
+}
+
+/**
+ * Gives name under which output file is written. When only changed outputs are to be replaced,
+ * this is a temporary name, and output_file_finish() moves the file to its target name.
+ */
+std::string output_file_name(const std::string& fname, const ProgramOptions& opts)
+{
+    if (opts.if_changed)
+        return fname + ".tmp";
+    return fname;
+}
+
+/**
+ * Names of all output files written, to be listed as targets of dependency file.
+ * Outputs may be written by parallel threads, so access is guarded by mutex.
+ */
+static std::vector<std::string> output_fnames;
+static std::mutex output_fnames_mtx;
+
+/**
+ * Adds the file to list of written output files, if it is not there already.
+ */
+void output_file_written(const std::string& fname)
+{
+    std::lock_guard<std::mutex> lock(output_fnames_mtx);
+    if (std::find(output_fnames.begin(), output_fnames.end(), fname) == output_fnames.end())
+        output_fnames.push_back(fname);
+}
+
+/**
+ * Finishes writing output file. If it was written under temporary name, replaces the target
+ * file with it, unless the content is identical - then the target is left untouched.
+ */
+short output_file_finish(const std::string& fname, const ProgramOptions& opts)
+{
+    output_file_written(fname);
+    if (!opts.if_changed)
+        return ERR_OK;
+    bool changed;
+    short ret = file_replace_if_changed(output_file_name(fname, opts), fname, changed);
+    if ((ret == ERR_OK) && !changed)
+        LogDbg("File \"%s\" is unchanged, leaving it untouched.",fname.c_str());
+    return ret;
+}
+
+short save_raw_file(WorkingSet& ws, std::vector<ImageData>& imgs, const std::string& fname_out, ProgramOptions& opts)
+{
+    RawLayout lay;
+    short ret = raw_layout_compute(lay, imgs, opts, false);
+    if (ret != ERR_OK)
+        return ret;
+    if (opts.dry_run) {
+        LogMsg("File \"%s\" would take %lu bytes.",fname_out.c_str(),(unsigned long)lay.line_len * lay.height);
+        return ERR_OK;
     }
-    // Write zero-filled header
+    // Create the RAW file with its final size, and fill it in memory
+    MappedFile rawfile;
+    ret = rawfile.create(output_file_name(fname_out, opts), (size_t)lay.line_len * lay.height);
+    if (ret != ERR_OK)
+        return ret;
+    raw_layout_fill(rawfile.data(), lay, imgs);
+    ret = rawfile.close();
+    if (ret != ERR_OK)
+        return ret;
+    return output_file_finish(fname_out, opts);
+}
+
+/**
+ * Fills BMP file header and palette, for 8bpp image with given size of pixel data.
+ * @return Size of the header and palette, which is also offset of the pixel data.
+ */
+long bmp_fill_header(unsigned char *head, WorkingSet& ws, int width, int height, long data_len)
+{
+    long pal_len = 256*4;
+    // Write header
     {
-        std::vector<unsigned char> head;
-        head.resize(0x36);
-        if (fwrite(&head.front(),head.size(),1,bmpfile) != 1)
-        { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
+        head[0] = 'B';
+        head[1] = 'M';
+        write_int32_le_buf(head+2, data_len+pal_len+0x36);
+        write_int32_le_buf(head+6, 0);
+        write_int32_le_buf(head+10, pal_len+0x36);
+        write_int32_le_buf(head+14, 40);
+        write_int32_le_buf(head+18, width);
+        write_int32_le_buf(head+22, -height);
+        write_int16_le_buf(head+26, 1);
+        write_int16_le_buf(head+28, 8);
     }
-    // Write palette
+    // Write palette; the remaining entries are expected to be zero-filled
     {
-        unsigned i;
-        for (i = 0; i < ws.palette.size(); i++)
+        unsigned char *pal = head + 0x36;
+        for (unsigned i = 0; (i < ws.palette.size()) && (i < 256); i++)
         {
             unsigned int cval;
             cval=(unsigned int)ws.palette[i].blue;
             if (cval>255) cval=255;
-            fputc(cval, bmpfile);
+            pal[4*i+0] = cval;
             cval=(unsigned int)ws.palette[i].green;
             if (cval>255) cval=255;
-            fputc(cval, bmpfile);
+            pal[4*i+1] = cval;
             cval=(unsigned int)ws.palette[i].red;
             if (cval>255) cval=255;
-            fputc(cval, bmpfile);
-            fputc(0, bmpfile);
-        }
-        for (; i < 256; i++)
-        {
-            fputc(0, bmpfile);
-            fputc(0, bmpfile);
-            fputc(0, bmpfile);
-            fputc(0, bmpfile);
+            pal[4*i+2] = cval;
+            pal[4*i+3] = 0;
         }
+    }
+    return pal_len+0x36;
+}
 
+short save_bmp_file(WorkingSet& ws, std::vector<ImageData>& imgs, const std::string& fname_out, ProgramOptions& opts)
+{
+    RawLayout lay;
+    short ret = raw_layout_compute(lay, imgs, opts, true);
+    if (ret != ERR_OK)
+        return ret;
+    long data_len = (long)lay.line_len * lay.height;
+    if (opts.dry_run) {
+        LogMsg("File \"%s\" would take %lu bytes.",fname_out.c_str(),(unsigned long)data_len+256*4+0x36);
+        return ERR_OK;
     }
-    int full_width, full_height;
-    if (opts.batch == Batch_FILELIST)
-    {
-        int tile_num_x, tile_width, tile_height;
-        {
-            tile_num_x = opts.inp[0].fd[0];
-            tile_width = opts.inp[0].fd[2];
-            tile_height = opts.inp[0].fd[3];
-        }
-        full_width = tile_num_x * tile_width;
-        full_height = (imgs.size() / tile_num_x) * tile_height;
-        for (int i = 0; i < (int)imgs.size(); i += tile_num_x)
-        {
-            if (i + tile_num_x - 1 >= (int)imgs.size()) {
-                LogErr("Amount of images does not allow to completely fill whole line of RAW file");
-                break;
-            }
-            std::vector<png_bytep *> row_pointers;
-            row_pointers.resize(tile_num_x);
-            // For every row of tile images, get all row pointers
-            for (int k = 0; k < tile_num_x; k++)
-            {
-                ImageData &img = imgs[i + k];
-                row_pointers[k] = png_get_rows(img.png_ptr, img.info_ptr);
-            }
-            // Now, write output lines which merge the tiles
-            std::vector<png_byte> out_row;
-            out_row.resize(tile_num_x * tile_width);
-            for (int y = 0; y < tile_height; y++)
-            {
-                for (int k = 0; k < tile_num_x; k++)
-                {
-                    ImageData &img = imgs[i+k];
-                    png_bytep inp_row = row_pointers[k][img.crop_y+y];
-                    ColorTranparency::Column& inp_trans = img.transMap[img.crop_y+y];
-                    int newLength = raw_pack(inp_row, inp_trans, img.crop_width, img.colorBPP());
-                    memcpy(&out_row.front()+k*tile_width,inp_row,newLength);
-                }
-                if (fwrite(&out_row.front(),out_row.size(),1,bmpfile) != 1)
-                { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-            }
-        }
-    } else
-    {
-        ImageData & img = imgs[0];
-        png_bytep * row_pointers = png_get_rows(img.png_ptr, img.info_ptr);
-        full_width = img.width;
-        full_height = img.height;
-        for (unsigned y = 0; y < img.height; y++)
-        {
-            png_bytep row = row_pointers[y];
-            ColorTranparency::Column& inp_trans = img.transMap[y];
-            int newLength = raw_pack(row, inp_trans, img.width, img.colorBPP());
-            if (fwrite(row,newLength,1,bmpfile) != 1)
-            { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-            for(int i=0; i<xorMaskLineLen(img)-newLength; ++i) writeByte(bmpfile,0);
-        }
-    }
-    {
-        long data_len,pal_len;
-        // Length of data
-        int padding_size = 4-(full_width&3);
-        data_len = (full_width+padding_size)*full_height;
-        // Length of palette
-        pal_len = 256*4;
-        fseek(bmpfile, 0, SEEK_SET);
-        fputs("BM",bmpfile);
-        write_int32_le_file(bmpfile, data_len+pal_len+0x36);
-        write_int32_le_file(bmpfile, 0);
-        write_int32_le_file(bmpfile, pal_len+0x36);
-        write_int32_le_file(bmpfile, 40);
-        write_int32_le_file(bmpfile, full_width);
-        write_int32_le_file(bmpfile, -full_height);
-        write_int16_le_file(bmpfile, 1);
-        write_int16_le_file(bmpfile, 8);
-    }
-    fclose(bmpfile);
-    return ERR_OK;
+    // Create the BMP file with its final size, and fill it in memory
+    MappedFile bmpfile;
+    ret = bmpfile.create(output_file_name(fname_out, opts), data_len+256*4+0x36);
+    if (ret != ERR_OK)
+        return ret;
+    long data_pos = bmp_fill_header(bmpfile.data(), ws, lay.width, lay.height, data_len);
+    raw_layout_fill(bmpfile.data()+data_pos, lay, imgs);
+    ret = bmpfile.close();
+    if (ret != ERR_OK)
+        return ret;
+    return output_file_finish(fname_out, opts);
 }
 
-short save_hugspr_file(WorkingSet& ws, ImageData& img, const std::string& fname_out, ProgramOptions& opts)
+/**
+ * Rows of HugeSprite image encoded by one worker thread.
+ */
+struct HugeSpriteBand {
+    std::vector<png_byte> data;
+    std::vector<long> row_len;
+};
+
+/**
+ * Encodes given range of HugeSprite rows into a separate buffer.
+ */
+void hspr_pack_band(HugeSpriteBand& band, WorkingSet& ws, ImageData& img, int y_beg, int y_end)
 {
-    // Open and write the HugeSprite file
+    // Every loop in hspr_pack() consumes at least one pixel, and stores two lengths
+    size_t max_row_len = (size_t)img.width * (2*sizeof(long) + 1);
+    png_bytep * row_pointers = img.rowPointers();
+    for (int y = y_beg; y < y_end; y++)
     {
-        FILE* rawfile = fopen(fname_out.c_str(),"wb");
-        if (rawfile == NULL) {
-            perror(fname_out.c_str());
-            return ERR_CANT_OPEN;
-        }
-        long * row_shifts = new long[img.height];
-        if (fwrite(row_shifts,img.height*sizeof(long),1,rawfile)!=1) {perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-        long base_pos = ftell(rawfile);
-        png_bytep out_row = new png_byte[img.width*3];
-        png_bytep * row_pointers = png_get_rows(img.png_ptr, img.info_ptr);
-        for (unsigned y = 0; y < img.height; y++)
-        {
-            row_shifts[y] = ftell(rawfile) - base_pos;
-            png_bytep inp_row = row_pointers[y];
-            ColorTranparency::Column& inp_trans = img.transMap[y];
-            int newLength = hspr_pack(out_row,inp_row,inp_trans,img.width,ws.palette);
-            if (fwrite(out_row,newLength,1,rawfile)!=1) {perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-            //writeByte(rawfile,0);
-        }
-        delete[] out_row;
-        fseek(rawfile,0,SEEK_SET);
-        if (fwrite(row_shifts,img.height*sizeof(long),1,rawfile)!=1) {perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-        delete[] row_shifts;
-        fclose(rawfile);
+        size_t pos = band.data.size();
+        band.data.resize(pos + max_row_len);
+        png_bytep inp_row = row_pointers[y];
+        ColorTranparency::Column& inp_trans = img.transMap[y];
+        int newLength = hspr_pack(&band.data.front()+pos,inp_row,inp_trans,img.width,ws.palette);
+        band.data.resize(pos + newLength);
+        band.row_len.push_back(newLength);
     }
-    return ERR_OK;
 }
 
-short save_smallspr_v1_file(WorkingSet& ws, std::vector<ImageData>& imgs, const std::string& fname_out, const std::string& fname_tab, ProgramOptions& opts)
+short save_hugspr_file(WorkingSet& ws, ImageData& img, const std::string& fname_out, ProgramOptions& opts)
 {
-    std::vector<SmallSpriteV1> spr_shifts;
-    // Open and write the SmallSprite file
+    // Encode bands of rows in parallel
+    const int band_height = 64;
+    int num_bands = (img.height + band_height - 1) / band_height;
+    std::vector<HugeSpriteBand> bands;
+    bands.resize(num_bands);
+    parallel_for(num_bands, [&](int i) {
+        hspr_pack_band(bands[i], ws, img, i * band_height, std::min((i + 1) * band_height, (int)img.height));
+    });
+    // Compute row offsets as prefix sum of row lengths
+    std::vector<long> row_shifts;
+    row_shifts.reserve(img.height);
     {
-        FILE* rawfile = fopen(fname_out.c_str(),"wb");
-        if (rawfile == NULL) {
-            perror(fname_out.c_str());
-            return ERR_CANT_OPEN;
-        }
-        // Shifts start with index 1; the 0 is empty and unused
-        {
-            spr_shifts.resize(imgs.size()+1);
-            spr_shifts[0].Data = 0;
-            spr_shifts[0].SWidth = 0;
-            spr_shifts[0].SHeight = 0;
-        }
-        long base_pos = ftell(rawfile);
-        {
-            unsigned short spr_count;
-            spr_count = imgs.size()+1;
-            if (fwrite(&spr_count,sizeof(spr_count),1,rawfile) != 1)
-            { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-        }
-        for (unsigned i = 0; i < imgs.size(); i++)
+        long pos = 0;
+        for (auto band = bands.begin(); band != bands.end(); band++)
         {
-            ImageData &img = imgs[i];
-            spr_shifts[i+1].Data = ftell(rawfile) - base_pos;
-            spr_shifts[i+1].SWidth = img.crop_width;
-            spr_shifts[i+1].SHeight = img.crop_height;
-            std::vector<png_byte> out_row;
-            out_row.resize(img.crop_width*3);
-            png_bytep * row_pointers = png_get_rows(img.png_ptr, img.info_ptr);
-            for (int y=0; y<img.crop_height; y++)
+            for (auto len = band->row_len.begin(); len != band->row_len.end(); len++)
             {
-                png_bytep inp_row = row_pointers[img.crop_y+y];
-                ColorTranparency::Column& inp_trans = img.transMap[img.crop_y+y];
-                int newLength = sspr_pack(&out_row.front(),inp_row,inp_trans,img.crop_width,img.crop_x,ws.palette);
-                if (fwrite(&out_row.front(),newLength,1,rawfile) != 1)
-                { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-            }
-            {
-                // End an image with (-128) - it's available in u2 encoding, and only values -127..127
-                //are used for defining size of data and transparency, so this special value wasn't used before
-                char endofimg = -128;
-                if (fwrite(&endofimg,sizeof(char),1,rawfile) != 1)
-                { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
+                row_shifts.push_back(pos);
+                pos += *len;
             }
         }
-        fclose(rawfile);
     }
-    // Open and write the TAB file
+    if (opts.dry_run) {
+        size_t data_len = row_shifts.size()*sizeof(long);
+        for (auto band = bands.begin(); band != bands.end(); band++)
+            data_len += band->data.size();
+        LogMsg("File \"%s\" would take %lu bytes.",fname_out.c_str(),(unsigned long)data_len);
+        return ERR_OK;
+    }
+    // Open and write the HugeSprite file
+    FILE* rawfile = fopen(output_file_name(fname_out, opts).c_str(),"wb");
+    if (rawfile == NULL) {
+        perror(fname_out.c_str());
+        return ERR_CANT_OPEN;
+    }
+    if (!row_shifts.empty() && (fwrite(&row_shifts.front(),row_shifts.size()*sizeof(long),1,rawfile) != 1))
+    { perror(fname_out.c_str()); fclose(rawfile); return ERR_FILE_WRITE; }
+    for (auto band = bands.begin(); band != bands.end(); band++)
     {
-        FILE* tabfile = fopen(fname_tab.c_str(),"wb");
-        if (tabfile == NULL) {
-            perror(fname_tab.c_str());
-            return ERR_CANT_OPEN;
-        }
-        if (fwrite(&spr_shifts.front(),sizeof(SmallSpriteV1),spr_shifts.size(),tabfile) != spr_shifts.size())
-        { perror(fname_tab.c_str()); return ERR_FILE_WRITE; }
-        fclose(tabfile);
+        if (!band->data.empty() && (fwrite(&band->data.front(),band->data.size(),1,rawfile) != 1))
+        { perror(fname_out.c_str()); fclose(rawfile); return ERR_FILE_WRITE; }
     }
-    return ERR_OK;
+    fclose(rawfile);
+    return output_file_finish(fname_out, opts);
 }
 
-short save_smallspr_v2_file(WorkingSet& ws, std::vector<ImageData>& imgs, const std::string& fname_out, const std::string& fname_tab, ProgramOptions& opts)
+/**
+ * Writes encoded sprites data into DAT file.
+ */
+short save_sprite_data_file(const std::vector<png_byte>& data, const std::string& fname_out, ProgramOptions& opts)
 {
-    std::vector<SmallSpriteV2> spr_shifts;
-    // Open and write the SmallSprite file
+    FILE* rawfile = fopen(output_file_name(fname_out, opts).c_str(),"wb");
+    if (rawfile == NULL) {
+        perror(fname_out.c_str());
+        return ERR_CANT_OPEN;
+    }
+    if (!data.empty() && (fwrite(&data.front(),data.size(),1,rawfile) != 1))
+    { perror(fname_out.c_str()); fclose(rawfile); return ERR_FILE_WRITE; }
+    fclose(rawfile);
+    return output_file_finish(fname_out, opts);
+}
+
+/**
+ * Writes sprite entries into TAB file.
+ */
+template <typename SprEntry>
+short save_sprite_tab_file(const std::vector<SprEntry>& spr_shifts, const std::string& fname_tab, ProgramOptions& opts)
+{
+    FILE* tabfile = fopen(output_file_name(fname_tab, opts).c_str(),"wb");
+    if (tabfile == NULL) {
+        perror(fname_tab.c_str());
+        return ERR_CANT_OPEN;
+    }
+    if (fwrite(&spr_shifts.front(),sizeof(SprEntry),spr_shifts.size(),tabfile) != spr_shifts.size())
+    { perror(fname_tab.c_str()); fclose(tabfile); return ERR_FILE_WRITE; }
+    fclose(tabfile);
+    return output_file_finish(fname_tab, opts);
+}
+
+/**
+ * Properties of sprite catalogue format, required to split it into shards.
+ */
+struct SpriteCatalogueFormat {
+    /** Amount of bytes at start of DAT file, before sprites data */
+    size_t head_len;
+    /** Whether TAB file starts with unused entry, before the sprites */
+    bool lead_entry;
+    /** Whether TAB file ends with entry pointing at end of the DAT file */
+    bool end_entry;
+    /** Max amount of sprites which the format can store */
+    size_t max_sprites;
+    /** Whether sprites are trimmed to their non-transparent area, rather than covering the crop area */
+    bool trimmed;
+};
+
+/**
+ * Fills properties of Small Sprite catalogue format.
+ */
+void sprite_catalogue_format_small(SpriteCatalogueFormat& cfmt)
+{
+    cfmt.head_len = sizeof(unsigned short);
+    cfmt.lead_entry = true;
+    cfmt.end_entry = false;
+    cfmt.max_sprites = USHRT_MAX - 1;
+    cfmt.trimmed = false;
+}
+
+/**
+ * Fills properties of Jonty Sprite catalogue format.
+ */
+void sprite_catalogue_format_jonty(SpriteCatalogueFormat& cfmt)
+{
+    cfmt.head_len = 0;
+    cfmt.lead_entry = false;
+    cfmt.end_entry = true;
+    cfmt.max_sprites = UINT32_MAX;
+    cfmt.trimmed = true;
+}
+
+/**
+ * Range of sprites stored within one shard of sprite catalogue.
+ */
+struct SpriteShard {
+    unsigned first;
+    unsigned count;
+};
+
+/**
+ * Splits sprites into ranges which fit within given limits; only animation boundaries are used as split points.
+ * The data size of each shard includes only unique blobs, as identical sprites will share data within shard.
+ */
+short sprite_shards_plan(std::vector<SpriteShard>& shards, const SpriteDataBuffer& spr_data,
+    size_t max_sprites, size_t max_data, ProgramOptions& opts)
+{
+    unsigned num_sprites = spr_data.sprites.size();
+    std::unordered_map<size_t,size_t> shard_blobs;
+    size_t shard_len = 0;
+    SpriteShard shard = {0, 0};
+    unsigned i = 0;
+    while (i < num_sprites)
     {
-        FILE* rawfile = fopen(fname_out.c_str(),"wb");
-        if (rawfile == NULL) {
-            perror(fname_out.c_str());
-            return ERR_CANT_OPEN;
+        // Find the whole animation starting at this sprite
+        unsigned anim_end = i + 1;
+        if (opts.inp[i].anum >= 0) {
+            while ((anim_end < num_sprites) && (opts.inp[anim_end].anum == opts.inp[i].anum))
+                anim_end++;
         }
-        // Shifts start with index 1; the 0 is empty and unused
+        // Compute how much data it would add to the current shard
+        size_t anim_len = 0;
+        std::unordered_map<size_t,size_t> anim_blobs;
+        for (unsigned k = i; k < anim_end; k++)
         {
-            spr_shifts.resize(imgs.size()+1);
-            spr_shifts[0].Data = 0;
-            spr_shifts[0].SWidth = 0;
-            spr_shifts[0].SHeight = 0;
+            const SpriteDataBuffer::SpriteBlob& blob = spr_data.sprites[k];
+            if ((shard_blobs.count(blob.offset) == 0) && anim_blobs.insert(std::make_pair(blob.offset, blob.len)).second)
+                anim_len += blob.len;
         }
-        long base_pos = ftell(rawfile);
+        if ((shard.count > 0) && ((shard.count + anim_end - i > max_sprites) || (shard_len + anim_len > max_data)))
         {
-            unsigned short spr_count;
-            spr_count = imgs.size()+1;
-            if (fwrite(&spr_count,sizeof(spr_count),1,rawfile) != 1)
-            { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
+            // Close the current shard, and re-check the animation against empty one
+            shards.push_back(shard);
+            shard.first = i;
+            shard.count = 0;
+            shard_blobs.clear();
+            shard_len = 0;
+            continue;
         }
-        for (unsigned i = 0; i < imgs.size(); i++)
-        {
-            ImageData &img = imgs[i];
-            spr_shifts[i+1].Data = ftell(rawfile) - base_pos;
-            spr_shifts[i+1].SWidth = img.crop_width;
-            spr_shifts[i+1].SHeight = img.crop_height;
-            std::vector<png_byte> out_row;
-            out_row.resize(img.crop_width*3);
-            png_bytep * row_pointers = png_get_rows(img.png_ptr, img.info_ptr);
-            for (int y=0; y<img.crop_height; y++)
-            {
-                png_bytep inp_row = row_pointers[img.crop_y+y];
-                ColorTranparency::Column& inp_trans = img.transMap[img.crop_y+y];
-                int newLength = sspr_pack(&out_row.front(),inp_row,inp_trans,img.crop_width,img.crop_x,ws.palette);
-                if (fwrite(&out_row.front(),newLength,1,rawfile) != 1)
-                { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-            }
-            {
-                // End an image with (-128) - it's available in u2 encoding, and only values -127..127
-                //are used for defining size of data and transparency, so this special value wasn't used before
-                char endofimg = -128;
-                if (fwrite(&endofimg,sizeof(char),1,rawfile) != 1)
-                { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-            }
+        if ((anim_end - i > max_sprites) && (opts.shard_max > 0) && (anim_end - i > opts.shard_max)) {
+            LogErr("Animation at sprite %u has %u sprites, which exceeds shard size of %u sprites set by option.",
+                i,anim_end - i,opts.shard_max);
+            return ERR_LIMIT_EXCEED;
         }
-        fclose(rawfile);
-    }
-    // Open and write the TAB file
-    {
-        FILE* tabfile = fopen(fname_tab.c_str(),"wb");
-        if (tabfile == NULL) {
-            perror(fname_tab.c_str());
-            return ERR_CANT_OPEN;
+        if ((anim_end - i > max_sprites) || (anim_len > max_data)) {
+            LogErr("Animation at sprite %u alone exceeds the sprite catalogue format limits.",i);
+            return ERR_LIMIT_EXCEED;
         }
-        if (fwrite(&spr_shifts.front(),sizeof(SmallSpriteV2),spr_shifts.size(),tabfile) != spr_shifts.size())
-        { perror(fname_tab.c_str()); return ERR_FILE_WRITE; }
-        fclose(tabfile);
+        shard_blobs.insert(anim_blobs.begin(), anim_blobs.end());
+        shard_len += anim_len;
+        shard.count += anim_end - i;
+        i = anim_end;
     }
+    if (shard.count > 0)
+        shards.push_back(shard);
     return ERR_OK;
 }
 
-short save_jontyspr_v1_file(WorkingSet& ws, std::vector<ImageData>& imgs, const std::string& fname_out, const std::string& fname_tab, ProgramOptions& opts)
+/**
+ * Writes shards list file, which maps global sprite index into shard and local index within it.
+ * First line contains amount of shards and total sprites count; next, every shard has a line with
+ * its DAT and TAB file names, index of its first sprite, amount of sprites, and TAB index of the first sprite.
+ */
+short save_sprite_shards_manifest(const std::vector<SpriteShard>& shards, const std::vector<OutputFile>& shard_outs,
+    unsigned num_sprites, unsigned first_local, const std::string& fname_man, ProgramOptions& opts)
 {
-    std::vector<JontySpriteV1> spr_shifts;
-    // Open and write the JontySprite file
+    FILE* manfile = fopen(output_file_name(fname_man, opts).c_str(),"w");
+    if (manfile == NULL) {
+        perror(fname_man.c_str());
+        return ERR_CANT_OPEN;
+    }
+    fprintf(manfile, "shards %u %u\n", (unsigned)shards.size(), num_sprites);
+    for (unsigned n = 0; n < shards.size(); n++)
     {
-        FILE* rawfile = fopen(fname_out.c_str(),"wb");
-        if (rawfile == NULL) {
-            perror(fname_out.c_str());
-            return ERR_CANT_OPEN;
-        }
-        // Shifts start with index 0, and there's additional entry at end
-        spr_shifts.resize(imgs.size()+1);
-        long base_pos = ftell(rawfile);
+        fprintf(manfile, "%s %s %u %u %u\n", file_name_strip_path(shard_outs[n].fname_out).c_str(),
+            file_name_strip_path(shard_outs[n].fname_tab).c_str(), shards[n].first, shards[n].count, first_local);
+    }
+    if (fclose(manfile) != 0)
+    { perror(fname_man.c_str()); return ERR_FILE_WRITE; }
+    return output_file_finish(fname_man, opts);
+}
+
+/**
+ * Writes sprite catalogue data in a form which can be linked into a program, next to its DAT file.
+ * Palette file is embedded as well, so that the catalogue can be drawn without reading any files.
+ */
+template <typename SprEntry>
+short save_sprite_catalogue_embed(const std::vector<png_byte>& data, const std::vector<SprEntry>& spr_shifts,
+    const OutputFile& out, ProgramOptions& opts)
+{
+    MappedFile palfile;
+    if (palfile.open(opts.fname_pal) != ERR_OK) {
+        perror(opts.fname_pal.c_str());
+        return ERR_CANT_OPEN;
+    }
+    std::string sym = embed_symbol_name(out.fname_out);
+    std::vector<EmbedBlob> blobs;
+    blobs.push_back(EmbedBlob{sym + "_dat", data.data(), data.size()});
+    blobs.push_back(EmbedBlob{sym + "_tab", (const unsigned char *)spr_shifts.data(), spr_shifts.size()*sizeof(SprEntry)});
+    blobs.push_back(EmbedBlob{sym + "_pal", palfile.data(), palfile.size()});
+    std::string fname_inp = file_name_strip_path(out.fname_out);
+    std::string fname_hdr = file_name_change_extension(out.fname_out,"h");
+    short ret = embed_write_header(output_file_name(fname_hdr, opts), fname_inp, blobs);
+    if (ret == ERR_OK)
+        ret = output_file_finish(fname_hdr, opts);
+    if (ret != ERR_OK)
+        return ret;
+    std::string fname_emb;
+    if (opts.embed == Embed_ELF) {
+        fname_emb = file_name_change_extension(out.fname_out,"o");
+        ret = embed_write_elf_object(output_file_name(fname_emb, opts), blobs);
+    } else {
+        fname_emb = file_name_change_extension(out.fname_out,"c");
+        ret = embed_write_c_source(output_file_name(fname_emb, opts), fname_inp, blobs);
+    }
+    if (ret != ERR_OK)
+        return ret;
+    return output_file_finish(fname_emb, opts);
+}
+
+/**
+ * Writes encoded sprite catalogue into DAT and TAB files.
+ * If the catalogue exceeds format limits and sharding is enabled, splits it into several DAT/TAB pairs.
+ * The TAB entries are expected to have data offsets filled, and sprites data to include the head.
+ */
+template <typename SprEntry>
+short save_sprite_catalogue(SpriteDataBuffer& spr_data, const std::vector<SprEntry>& spr_shifts,
+    const SpriteCatalogueFormat& cfmt, const OutputFile& out, ProgramOptions& opts)
+{
+    if (spr_data.dedup)
+        LogMsg("Deduplicated %u sprites, saved %lu bytes.",spr_data.dup_count,(unsigned long)spr_data.dup_bytes);
+    unsigned num_sprites = spr_data.sprites.size();
+    size_t max_sprites = cfmt.max_sprites;
+    if ((opts.shard_max > 0) && (opts.shard_max < max_sprites))
+        max_sprites = opts.shard_max;
+    const size_t max_data = UINT32_MAX - cfmt.head_len;
+    bool fits = (num_sprites <= max_sprites) && (spr_data.data.size() - cfmt.head_len <= max_data);
+    if (opts.dry_run)
+    {
+        for (unsigned i = 0; i < num_sprites; i++)
+            LogMsg("Sprite %u data takes %lu bytes.",i,(unsigned long)spr_data.sprites[i].len);
+        LogMsg("File \"%s\" would take %lu bytes, and \"%s\" %lu bytes%s.",out.fname_out.c_str(),
+            (unsigned long)spr_data.data.size(),out.fname_tab.c_str(),(unsigned long)spr_shifts.size()*sizeof(SprEntry),
+            fits ? "" : "; this exceeds the format limits");
+        return ERR_OK;
+    }
+    if (fits)
+    {
+        short ret = save_sprite_data_file(spr_data.data, out.fname_out, opts);
+        if (ret != ERR_OK)
+            return ret;
+        ret = save_sprite_tab_file(spr_shifts, out.fname_tab, opts);
+        if ((ret == ERR_OK) && (opts.embed != Embed_NONE))
+            ret = save_sprite_catalogue_embed(spr_data.data, spr_shifts, out, opts);
+        return ret;
+    }
+    if (!opts.shard) {
+        LogErr("Sprite catalogue of %u sprites and %lu bytes exceeds the format limits; use sharding to split it.",
+            num_sprites,(unsigned long)spr_data.data.size());
+        return ERR_LIMIT_EXCEED;
+    }
+    std::vector<SpriteShard> shards;
+    {
+        short ret = sprite_shards_plan(shards, spr_data, max_sprites, max_data, opts);
+        if (ret != ERR_OK)
+            return ret;
+    }
+    std::vector<OutputFile> shard_outs;
+    unsigned lead = cfmt.lead_entry ? 1 : 0;
+    for (unsigned n = 0; n < shards.size(); n++)
+    {
+        const SpriteShard& shard = shards[n];
+        OutputFile shard_out(out.fmt);
+        {
+            std::ostringstream suffix;
+            suffix << "_" << n;
+            shard_out.fname_out = file_name_add_suffix(out.fname_out, suffix.str());
+            shard_out.fname_tab = file_name_add_suffix(out.fname_tab, suffix.str());
+        }
+        // Copy the data of sprites within this shard, with its own offsets
+        std::vector<png_byte> data(spr_data.data.begin(), spr_data.data.begin()+cfmt.head_len);
+        std::vector<SprEntry> shifts;
+        std::unordered_map<size_t,uint32_t> blob_offsets;
+        if (cfmt.lead_entry)
+            shifts.push_back(spr_shifts[0]);
+        for (unsigned i = shard.first; i < shard.first+shard.count; i++)
+        {
+            const SpriteDataBuffer::SpriteBlob& blob = spr_data.sprites[i];
+            SprEntry spr = spr_shifts[lead+i];
+            auto it = blob_offsets.find(blob.offset);
+            if (it == blob_offsets.end()) {
+                data.resize((data.size() + spr_data.align - 1) / spr_data.align * spr_data.align);
+                it = blob_offsets.insert(std::make_pair(blob.offset, (uint32_t)data.size())).first;
+                data.insert(data.end(), spr_data.data.begin()+blob.offset, spr_data.data.begin()+blob.offset+blob.len);
+            }
+            spr.Data = it->second;
+            shifts.push_back(spr);
+        }
+        if (cfmt.end_entry) {
+            SprEntry spr = spr_shifts.back();
+            spr.Data = data.size();
+            shifts.push_back(spr);
+        }
+        if (cfmt.head_len == sizeof(unsigned short)) {
+            // Small Sprite files start with entries count
+            write_int16_le_buf(&data[0], shifts.size());
+        }
+        short ret = save_sprite_data_file(data, shard_out.fname_out, opts);
+        if (ret == ERR_OK)
+            ret = save_sprite_tab_file(shifts, shard_out.fname_tab, opts);
+        if ((ret == ERR_OK) && (opts.embed != Embed_NONE))
+            ret = save_sprite_catalogue_embed(data, shifts, shard_out, opts);
+        if (ret != ERR_OK)
+            return ret;
+        shard_outs.push_back(shard_out);
+    }
+    LogMsg("Split %u sprites into %u shards.",num_sprites,(unsigned)shards.size());
+    return save_sprite_shards_manifest(shards, shard_outs, num_sprites, lead,
+        file_name_change_extension(out.fname_out,"shards"), opts);
+}
+
+short save_smallspr_v1_file(WorkingSet& ws, std::vector<ImageData>& imgs, const OutputFile& out, ProgramOptions& opts)
+{
+    std::vector<SmallSpriteV1> spr_shifts;
+    // Prepare the SmallSprite data
+    SpriteDataBuffer spr_data(opts.dedup, opts.align);
+    // Shifts start with index 1; the 0 is empty and unused
+    {
+        spr_shifts.resize(imgs.size()+1);
+        memset(&spr_shifts[0], 0, sizeof(SmallSpriteV1));
+    }
+    {
+        unsigned short spr_count;
+        spr_count = imgs.size()+1;
+        spr_data.data.resize(sizeof(spr_count));
+        memcpy(&spr_data.data.front(),&spr_count,sizeof(spr_count));
+    }
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        ImageData &img = imgs[i];
+        if (img.dup_of >= 0) {
+            spr_shifts[i+1].Data = spr_data.repeatSprite(img.dup_of);
+        } else {
+            size_t start = spr_data.startSprite();
+            sspr_pack_sprite(spr_data.data,img,img.crop_x,img.crop_y,img.crop_width,img.crop_height,ws.palette);
+            spr_shifts[i+1].Data = spr_data.commitSprite(start);
+        }
+        spr_shifts[i+1].SWidth = img.crop_width;
+        spr_shifts[i+1].SHeight = img.crop_height;
+    }
+    // Open and write the SmallSprite and TAB files
+    SpriteCatalogueFormat cfmt;
+    sprite_catalogue_format_small(cfmt);
+    return save_sprite_catalogue(spr_data, spr_shifts, cfmt, out, opts);
+}
+
+/**
+ * Writes SmallSprite Ver2 catalogue; Ver3 has the same TAB entries, and only uses different sprite encoding.
+ */
+short save_smallspr_v2_file(WorkingSet& ws, std::vector<ImageData>& imgs, const OutputFile& out, ProgramOptions& opts, sprite_pack_t pack_sprite = sspr_pack_sprite)
+{
+    std::vector<SmallSpriteV2> spr_shifts;
+    // Prepare the SmallSprite data
+    SpriteDataBuffer spr_data(opts.dedup, opts.align);
+    // Shifts start with index 1; the 0 is empty and unused
+    {
+        spr_shifts.resize(imgs.size()+1);
+        memset(&spr_shifts[0], 0, sizeof(SmallSpriteV2));
+    }
+    {
+        unsigned short spr_count;
+        spr_count = imgs.size()+1;
+        spr_data.data.resize(sizeof(spr_count));
+        memcpy(&spr_data.data.front(),&spr_count,sizeof(spr_count));
+    }
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        ImageData &img = imgs[i];
+        if (img.dup_of >= 0) {
+            spr_shifts[i+1].Data = spr_data.repeatSprite(img.dup_of);
+        } else {
+            size_t start = spr_data.startSprite();
+            pack_sprite(spr_data.data,img,img.crop_x,img.crop_y,img.crop_width,img.crop_height,ws.palette);
+            spr_shifts[i+1].Data = spr_data.commitSprite(start);
+        }
+        spr_shifts[i+1].SWidth = img.crop_width;
+        spr_shifts[i+1].SHeight = img.crop_height;
+    }
+    // Open and write the SmallSprite and TAB files
+    SpriteCatalogueFormat cfmt;
+    sprite_catalogue_format_small(cfmt);
+    return save_sprite_catalogue(spr_data, spr_shifts, cfmt, out, opts);
+}
+
+/**
+ * Fills Jonty Sprite Ver1 TAB entry with values from Ver2 entry, narrowing them.
+ */
+void jontyspr_v2_to_v1(JontySpriteV1& spr1, const JontySpriteV2& spr2)
+{
+    spr1.Data = spr2.Data;
+    spr1.SWidth = spr2.SWidth;
+    spr1.SHeight = spr2.SHeight;
+    spr1.FrameWidth = spr2.FrameWidth;
+    spr1.FrameHeight = spr2.FrameHeight;
+    spr1.Rotable = spr2.Rotable;
+    spr1.FramesCount = spr2.FramesCount;
+    spr1.FrameOffsW = spr2.FrameOffsW;
+    spr1.FrameOffsH = spr2.FrameOffsH;
+    spr1.unkn6 = spr2.unkn6;
+    spr1.unkn8 = spr2.unkn8;
+}
+
+short save_jontyspr_v1_file(WorkingSet& ws, std::vector<ImageData>& imgs, const OutputFile& out, ProgramOptions& opts)
+{
+    std::vector<JontySpriteV1> spr_shifts;
+    // Prepare the JontySprite data
+    SpriteDataBuffer spr_data(opts.dedup, opts.align);
+    // Shifts start with index 0, and there's additional entry at end
+    spr_shifts.resize(imgs.size()+1);
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        ImageData &img = imgs[i];
+        JontySpriteV1 &spr = spr_shifts[i];
+        jontyspr_v2_to_v1(spr, *(const JontySpriteV2 *)img.additional_data);
+        if (img.dup_of >= 0) {
+            spr.Data = spr_data.repeatSprite(img.dup_of);
+        } else {
+            size_t start = spr_data.startSprite();
+            sspr_pack_sprite(spr_data.data,img,spr.FrameOffsW,spr.FrameOffsH,spr.SWidth,spr.SHeight,ws.palette);
+            spr.Data = spr_data.commitSprite(start);
+        }
+    }
+    // Add the entry at end
+    {
+        int i = imgs.size();
+        memset(&spr_shifts[i], 0, sizeof(JontySpriteV1));
+        spr_shifts[i].Data = spr_data.data.size();
+        spr_shifts[i].SWidth = 0;
+        spr_shifts[i].SHeight = 0;
+    }
+    // Open and write the JontySprite and TAB files
+    SpriteCatalogueFormat cfmt;
+    sprite_catalogue_format_jonty(cfmt);
+    return save_sprite_catalogue(spr_data, spr_shifts, cfmt, out, opts);
+}
+
+/**
+ * Writes JontySprite Ver2 catalogue; Ver3 has the same TAB entries, and only uses different sprite encoding.
+ */
+short save_jontyspr_v2_file(WorkingSet& ws, std::vector<ImageData>& imgs, const OutputFile& out, ProgramOptions& opts, sprite_pack_t pack_sprite = sspr_pack_sprite)
+{
+    std::vector<JontySpriteV2> spr_shifts;
+    // Prepare the JontySprite data
+    SpriteDataBuffer spr_data(opts.dedup, opts.align);
+    // Shifts start with index 0, and there's additional entry at end
+    spr_shifts.resize(imgs.size()+1);
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        ImageData &img = imgs[i];
+        JontySpriteV2 &spr = spr_shifts[i];
+        memcpy(&spr, &img.additional_data, sizeof(JontySpriteV2));
+        if (img.dup_of >= 0) {
+            spr.Data = spr_data.repeatSprite(img.dup_of);
+        } else {
+            size_t start = spr_data.startSprite();
+            pack_sprite(spr_data.data,img,spr.FrameOffsW,spr.FrameOffsH,spr.SWidth,spr.SHeight,ws.palette);
+            spr.Data = spr_data.commitSprite(start);
+        }
+    }
+    // Add the entry at end
+    {
+        int i = imgs.size();
+        memset(&spr_shifts[i], 0, sizeof(JontySpriteV2));
+        spr_shifts[i].Data = spr_data.data.size();
+        spr_shifts[i].SWidth = 0;
+        spr_shifts[i].SHeight = 0;
+    }
+    // Open and write the JontySprite and TAB files
+    SpriteCatalogueFormat cfmt;
+    sprite_catalogue_format_jonty(cfmt);
+    return save_sprite_catalogue(spr_data, spr_shifts, cfmt, out, opts);
+}
+
+/**
+ * Runs jobs of FLIC frame encoder on worker threads.
+ * Every frame is split into jobs, so the threads are kept between frames.
+ */
+static void flic_parallel_jobs(AnimJobFunc job, void *ctx, int count)
+{
+    static WorkerPool pool;
+    pool.run(count, [job, ctx](int i) {
+        job(ctx, i);
+    });
+}
+
+short save_flic_file(WorkingSet& ws, std::vector<ImageData>& imgs, const std::string& fname_out, ProgramOptions& opts)
+{
+    struct Animation anim;
+    struct AnimationContext anim_ctx;
+    ubyte *frmbuf;
+    ubyte *scratch_buf;
+    uint w, h;
+    bool has_trans;
+    size_t flic_len = sizeof(struct FLCFileHeader);
+
+    w = h = 0;
+    has_trans = false;
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        ImageData &img = imgs[i];
+        if (w < img.width)
+            w = img.width;
+        if (h < img.height)
+            h = img.height;
+        if (i == 0)
+        {
+            for (unsigned y = 0; y < img.height; y++)
+            {
+                ColorTranparency::Column& transPtr = img.transMap[y];
+                has_trans |= ((unsigned)std::count(transPtr.begin(), transPtr.end(), false) < transPtr.size());
+                if (has_trans) break;
+            }
+        }
+    }
+    // FLIC header, and the damaged region of a frame, store dimensions as 16-bit values
+    if ((w > USHRT_MAX) || (h > USHRT_MAX)) {
+        LogErr("Frame size %ux%u exceeds the FLIC format limits.",w,h);
+        return ERR_LIMIT_EXCEED;
+    }
+
+    scratch_buf = new ubyte[anim_scratch_size(w, h, 8)];
+    // First delta frame is compared to previous frame at scratch start
+    memset(scratch_buf, 0, anim_frame_size(w, h, 8));
+    frmbuf = new ubyte[anim_frame_size(w, h+1, 8)];
+    memset(frmbuf, 0, anim_frame_size(w, h+1, 8));
+    // Own state of the animation allows recording several files at once
+    memset(&anim_ctx, 0, sizeof(anim_ctx));
+    anim_ctx.Scratch = scratch_buf;
+    // Encoding blocks of a frame in parallel only pays off if there are threads to run them,
+    // and several outputs are already written by parallel threads
+    anim_ctx.Parallel = ((worker_threads_count() > 1) && (opts.outs.size() == 1)) ? flic_parallel_jobs : NULL;
+
+    // Dry run encodes all frames, only counting their sizes
+    anim_flic_init(&anim, 0, opts.dry_run ? AniFlg_NO_WRITE : 0);
+    anim_flic_set_context(&anim, &anim_ctx);
+    anim_flic_set_fname(&anim, "%s", output_file_name(fname_out, opts).c_str());
+    TbResult anim_ret = anim_flic_make_open(&anim, w, h, 8, AniFlg_RECORD | (has_trans ? AniFlg_ALL_DELTA : 0));
+    if (anim_ret != Lb_SUCCESS) {
+        // Dry run opens no file, but still needs the encoder buffers
+        if (anim_ret == Lb_NO_MEMORY)
+            LogErr("Cannot allocate buffers for encoding %ux%u FLIC frames.",w,h);
+        else
+            perror(fname_out.c_str());
+        delete[] frmbuf;
+        delete[] scratch_buf;
+        return (anim_ret == Lb_NO_MEMORY) ? ERR_NO_MEMORY : ERR_CANT_OPEN;
+    }
+    anim_flic_set_frame_buffer(&anim, frmbuf, 0, 0, w, 0);
+    // Columns of every line where the frame differs from previous one
+    std::vector<ushort> spans(2 * h);
+
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        ImageData &img = imgs[i];
+        struct AnimFrameDamage damage;
+        damage.FirstLine = 0;
+        damage.Lines = 0;
+
+        png_bytep * row_pointers = img.rowPointers();
+        for (unsigned y = 0; y < h; y++)
+        {
+            unsigned beg = w, end = 0;
+            if (y < img.height)
+            {
+                png_bytep row = row_pointers[y];
+                ColorTranparency::Column& transPtr = img.transMap[y];
+
+                for (unsigned x = 0; x < img.width; x++)
+                {
+                    if (!transPtr[x] && (frmbuf[y * w + x] != row[x])) {
+                        frmbuf[y * w + x] = row[x];
+                        if (beg > x) beg = x;
+                        end = x + 1;
+                    }
+                }
+            }
+            spans[2 * y + 0] = beg;
+            spans[2 * y + 1] = end;
+            if (beg < end) {
+                if (damage.Lines == 0)
+                    damage.FirstLine = y;
+                damage.Lines = y - damage.FirstLine + 1;
+            }
+        }
+        damage.Spans = &spans[2 * damage.FirstLine];
+
+        anim_make_prep_next_frame(&anim, frmbuf);
+        anim_make_next_frame_damage(&anim, NULL, &damage);
+        if (opts.dry_run)
+            LogMsg("Frame %u takes %lu bytes.",i,(unsigned long)anim.FLCFrameChunk.Size);
+        flic_len += anim.FLCFrameChunk.Size;
+    }
+    anim_flic_close(&anim);
+    delete[] frmbuf;
+    delete[] scratch_buf;
+    if (opts.dry_run) {
+        LogMsg("File \"%s\" would take %lu bytes.",fname_out.c_str(),(unsigned long)flic_len);
+        return ERR_OK;
+    }
+    return output_file_finish(fname_out, opts);
+}
+
+/**
+ * Escapes file name for use in make rule.
+ */
+std::string file_name_make_escape(const std::string& fname)
+{
+    std::string ret;
+    for (auto c = fname.begin(); c != fname.end(); c++)
+    {
+        if ((*c == ' ') || (*c == '#'))
+            ret += '\\';
+        else if (*c == '$')
+            ret += '$';
+        ret += *c;
+    }
+    return ret;
+}
+
+/**
+ * Writes make-style dependency file, with all output files written depending on every input file read.
+ * Each input also gets an empty rule, so that removing it doesn't break the build.
+ */
+short save_dependency_file(const ProgramOptions& opts)
+{
+    std::vector<std::string> deps;
+    deps.insert(deps.end(), opts.fname_lists.begin(), opts.fname_lists.end());
+    deps.push_back(opts.fname_pal);
+    for (auto inp = opts.inp.begin(); inp != opts.inp.end(); inp++)
+    {
+        if (!inp->fname_pal.empty())
+            deps.push_back(inp->fname_pal);
+        deps.push_back(inp->fname);
+    }
+    // Remove repeated names, keeping order of first use
+    {
+        std::unordered_map<std::string,bool> seen;
+        auto last = std::remove_if(deps.begin(), deps.end(), [&seen](const std::string& fname) {
+            return !seen.insert(std::make_pair(fname, true)).second;
+        });
+        deps.erase(last, deps.end());
+    }
+    FILE* depfile = fopen(output_file_name(opts.fname_dep, opts).c_str(),"w");
+    if (depfile == NULL) {
+        perror(opts.fname_dep.c_str());
+        return ERR_CANT_OPEN;
+    }
+    // Parallel outputs finish in random order; sorting keeps the file stable between runs
+    std::vector<std::string> targets;
+    {
+        std::lock_guard<std::mutex> lock(output_fnames_mtx);
+        targets = output_fnames;
+    }
+    std::sort(targets.begin(), targets.end());
+    for (auto target = targets.begin(); target != targets.end(); target++)
+    {
+        fprintf(depfile, "%s%s", (target == targets.begin()) ? "" : " ", file_name_make_escape(*target).c_str());
+    }
+    fprintf(depfile, ":");
+    for (auto dep = deps.begin(); dep != deps.end(); dep++)
+        fprintf(depfile, " \\\n %s", file_name_make_escape(*dep).c_str());
+    fprintf(depfile, "\n");
+    for (auto dep = deps.begin(); dep != deps.end(); dep++)
+        fprintf(depfile, "\n%s:\n", file_name_make_escape(*dep).c_str());
+    if (fclose(depfile) != 0)
+    { perror(opts.fname_dep.c_str()); return ERR_FILE_WRITE; }
+    return output_file_finish(opts.fname_dep, opts);
+}
+
+/**
+ * Copies trimmed sprite into unpacked atlas page, with 1 byte per pixel.
+ */
+void atlas_copy_sprite(std::vector<png_byte>& page, int page_width, ImageData& img, const AtlasRect& rect)
+{
+    const JontySpriteV2& spr = *(const JontySpriteV2 *)img.additional_data;
+    png_bytep * row_pointers = img.rowPointers();
+    for (int y = 0; y < rect.height; y++)
+    {
+        png_bytep inp_row = row_pointers[spr.FrameOffsH+y] + spr.FrameOffsW;
+        ColorTranparency::Column& inp_trans = img.transMap[spr.FrameOffsH+y];
+        png_bytep out_row = &page[(size_t)(rect.y+y) * page_width + rect.x];
+        for (int x = 0; x < rect.width; x++)
+        {
+            if (!inp_trans[spr.FrameOffsW+x])
+                out_row[x] = inp_row[x];
+        }
+    }
+}
+
+/**
+ * Writes sprites packed into atlas pages; every page is a separate RAW or BMP file,
+ * and the TAB file contains AtlasSpriteEntry for every input sprite.
+ */
+short save_atlas_file(WorkingSet& ws, std::vector<ImageData>& imgs, const OutputFile& out, ProgramOptions& opts)
+{
+    // Pack the trimmed sprites; duplicates share area with their first instance
+    std::vector<AtlasRect> rects;
+    rects.resize(imgs.size());
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        const JontySpriteV2& spr = *(const JontySpriteV2 *)imgs[i].additional_data;
+        rects[i].width = (imgs[i].dup_of >= 0) ? 0 : spr.SWidth;
+        rects[i].height = (imgs[i].dup_of >= 0) ? 0 : spr.SHeight;
+    }
+    int num_pages;
+    {
+        short ret = atlas_pack(rects, opts.atlas_width, opts.atlas_height, num_pages);
+        if (ret != ERR_OK)
+            return ret;
+    }
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        if (imgs[i].dup_of >= 0)
+            rects[i] = rects[imgs[i].dup_of];
+    }
+    LogMsg("Packed %u sprites into %d atlas pages.",(unsigned)imgs.size(),num_pages);
+    // Create the pages
+    int nbits = imgs[0].colorBPP();
+    int pixelsPerByte = (8 / nbits);
+    int line_len = (opts.atlas_width + pixelsPerByte - 1) / pixelsPerByte;
+    if (out.fmt == OutFmt_BMP)
+        line_len = (line_len + 3) & ~3;
+    if (opts.dry_run) {
+        long page_len = (long)line_len * opts.atlas_height + ((out.fmt == OutFmt_BMP) ? 256*4+0x36 : 0);
+        LogMsg("Files \"%s\" would take %d pages of %lu bytes, and \"%s\" %lu bytes.",out.fname_out.c_str(),
+            num_pages,(unsigned long)page_len,out.fname_tab.c_str(),(unsigned long)imgs.size()*sizeof(AtlasSpriteEntry));
+        return ERR_OK;
+    }
+    ColorTranparency::Column opaque(opts.atlas_width, false);
+    for (int n = 0; n < num_pages; n++)
+    {
+        std::vector<png_byte> page((size_t)opts.atlas_width * opts.atlas_height, 0);
+        std::vector<unsigned> page_sprites;
         for (unsigned i = 0; i < imgs.size(); i++)
         {
-            ImageData &img = imgs[i];
-            JontySpriteV1 &spr = spr_shifts[i];
-            memcpy(&spr, &img.additional_data, sizeof(JontySpriteV1));
-            spr.Data = ftell(rawfile) - base_pos;
-            std::vector<png_byte> out_row;
-            out_row.resize(spr.SWidth*3);
-            png_bytep * row_pointers = png_get_rows(img.png_ptr, img.info_ptr);
-            for (int y=0; y<spr.SHeight; y++)
-            {
-                png_bytep inp_row = row_pointers[spr.FrameOffsH+y];
-                ColorTranparency::Column& inp_trans = img.transMap[spr.FrameOffsH+y];
-                int newLength = sspr_pack(&out_row.front(),inp_row,inp_trans,spr.SWidth,spr.FrameOffsW,ws.palette);
-                if (fwrite(&out_row.front(),newLength,1,rawfile) != 1)
-                { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-            }
-            {
-                // End an image with (-128) - it's available in u2 encoding, and only values -127..127
-                //are used for defining size of data and transparency, so this special value wasn't used before
-                char endofimg = -128;
-                if (fwrite(&endofimg,sizeof(char),1,rawfile) != 1)
-                { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
+            if ((rects[i].page == n) && (imgs[i].dup_of < 0) && (rects[i].width > 0) && (rects[i].height > 0))
+                page_sprites.push_back(i);
+        }
+        // Sprites do not overlap, so can be copied in parallel
+        parallel_for(page_sprites.size(), [&](int k) {
+            unsigned i = page_sprites[k];
+            atlas_copy_sprite(page, opts.atlas_width, imgs[i], rects[i]);
+        });
+        std::ostringstream suffix;
+        suffix << "_" << n;
+        std::string fname_page = file_name_add_suffix(out.fname_out, suffix.str());
+        long data_len = (long)line_len * opts.atlas_height;
+        long data_pos = (out.fmt == OutFmt_BMP) ? 256*4+0x36 : 0;
+        MappedFile pagefile;
+        short ret = pagefile.create(output_file_name(fname_page, opts), data_pos+data_len);
+        if (ret != ERR_OK)
+            return ret;
+        if (out.fmt == OutFmt_BMP)
+            bmp_fill_header(pagefile.data(), ws, opts.atlas_width, opts.atlas_height, data_len);
+        for (int y = 0; y < opts.atlas_height; y++)
+        {
+            raw_pack(pagefile.data()+data_pos+(size_t)y*line_len, &page[(size_t)y*opts.atlas_width],
+                opaque, opts.atlas_width, nbits);
+        }
+        ret = pagefile.close();
+        if (ret == ERR_OK)
+            ret = output_file_finish(fname_page, opts);
+        if (ret != ERR_OK)
+            return ret;
+    }
+    // Write the coordinates table
+    std::vector<AtlasSpriteEntry> spr_coords;
+    spr_coords.resize(imgs.size());
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        const JontySpriteV2& spr = *(const JontySpriteV2 *)imgs[i].additional_data;
+        AtlasSpriteEntry& ent = spr_coords[i];
+        ent.Page = rects[i].page;
+        ent.X = rects[i].x;
+        ent.Y = rects[i].y;
+        ent.SWidth = spr.SWidth;
+        ent.SHeight = spr.SHeight;
+        ent.FrameWidth = spr.FrameWidth;
+        ent.FrameHeight = spr.FrameHeight;
+        ent.FrameOffsW = spr.FrameOffsW;
+        ent.FrameOffsH = spr.FrameOffsH;
+    }
+    return save_sprite_tab_file(spr_coords, out.fname_tab, opts);
+}
+
+/**
+ * Fills TAB entry of sprite catalogue with properties of given image; data offset is not set.
+ */
+void sprite_entry_fill(SmallSpriteV1& spr, ImageData& img)
+{
+    spr.SWidth = img.crop_width;
+    spr.SHeight = img.crop_height;
+}
+
+void sprite_entry_fill(SmallSpriteV2& spr, ImageData& img)
+{
+    spr.SWidth = img.crop_width;
+    spr.SHeight = img.crop_height;
+}
+
+void sprite_entry_fill(JontySpriteV1& spr, ImageData& img)
+{
+    jontyspr_v2_to_v1(spr, *(const JontySpriteV2 *)img.additional_data);
+}
+
+void sprite_entry_fill(JontySpriteV2& spr, ImageData& img)
+{
+    memcpy(&spr, &img.additional_data, sizeof(JontySpriteV2));
+}
+
+/**
+ * Gives size of TAB entry for given sprite catalogue format, or 0 if the format is not a catalogue.
+ */
+size_t sprite_tab_entry_size(int fmt)
+{
+    switch (fmt)
+    {
+    case OutFmt_SSPR:
+        return sizeof(SmallSpriteV1);
+    case OutFmt_SSPR2:
+    case OutFmt_SSPR3:
+        return sizeof(SmallSpriteV2);
+    case OutFmt_JSPR:
+        return sizeof(JontySpriteV1);
+    case OutFmt_JSPR2:
+    case OutFmt_JSPR3:
+        return sizeof(JontySpriteV2);
+    }
+    return 0;
+}
+
+/**
+ * Reads amount of sprites stored in existing sprite catalogue, based on size of its TAB file.
+ */
+short load_sprite_tab_count(const OutputFile& out, unsigned& count)
+{
+    FILE* tabfile = fopen(out.fname_tab.c_str(),"rb");
+    if (tabfile == NULL) {
+        perror(out.fname_tab.c_str());
+        return ERR_CANT_OPEN;
+    }
+    fseek(tabfile, 0, SEEK_END);
+    long len = ftell(tabfile);
+    fclose(tabfile);
+    size_t entry_size = sprite_tab_entry_size(out.fmt);
+    // Both catalogue kinds have one entry which is not a sprite
+    if ((len < (long)entry_size) || (len % entry_size) != 0) {
+        LogErr("%s: Incorrect size of existing TAB file.",out.fname_tab.c_str());
+        return ERR_BAD_FILE;
+    }
+    count = len / entry_size - 1;
+    return ERR_OK;
+}
+
+/**
+ * Part of updated DAT file; either a range of the existing file, or newly encoded data.
+ */
+struct SpriteDataSegment {
+    bool reused;
+    size_t offset;
+    size_t len;
+    /** Amount of zero bytes before the segment, aligning its start */
+    size_t pad;
+};
+
+/**
+ * Updates existing sprite catalogue; only the images which were loaded are encoded,
+ * data of the remaining sprites is copied from existing DAT file.
+ * The new DAT is written into temporary file, which then replaces the existing one.
+ */
+template <typename SprEntry>
+short update_sprite_catalogue(WorkingSet& ws, std::vector<ImageData>& imgs, const SpriteCatalogueFormat& cfmt,
+    sprite_pack_t pack_sprite, const OutputFile& out, ProgramOptions& opts)
+{
+    std::vector<SprEntry> old_shifts;
+    {
+        FILE* tabfile = fopen(out.fname_tab.c_str(),"rb");
+        if (tabfile == NULL) {
+            perror(out.fname_tab.c_str());
+            return ERR_CANT_OPEN;
+        }
+        fseek(tabfile, 0, SEEK_END);
+        old_shifts.resize(ftell(tabfile) / sizeof(SprEntry));
+        fseek(tabfile, 0, SEEK_SET);
+        if (old_shifts.empty() || (fread(&old_shifts.front(),sizeof(SprEntry),old_shifts.size(),tabfile) != old_shifts.size()))
+        { perror(out.fname_tab.c_str()); fclose(tabfile); return ERR_FILE_READ; }
+        fclose(tabfile);
+    }
+    FILE* oldfile = fopen(out.fname_out.c_str(),"rb");
+    if (oldfile == NULL) {
+        perror(out.fname_out.c_str());
+        return ERR_CANT_OPEN;
+    }
+    fseek(oldfile, 0, SEEK_END);
+    size_t old_len = ftell(oldfile);
+    unsigned lead = cfmt.lead_entry ? 1 : 0;
+    unsigned old_count = old_shifts.size() - 1;
+    // Sprites are stored one after another, so each ends where the next one starts
+    std::map<size_t,size_t> old_blobs;
+    for (unsigned i = 0; i < old_count; i++)
+        old_blobs[old_shifts[lead+i].Data] = 0;
+    for (auto it = old_blobs.begin(); it != old_blobs.end(); it++)
+    {
+        auto next = it;
+        next++;
+        size_t end = (next != old_blobs.end()) ? next->first : old_len;
+        if (end < it->first) end = it->first;
+        it->second = end - it->first;
+    }
+    // Prepare layout of the new DAT file
+    std::vector<SprEntry> spr_shifts;
+    std::vector<SpriteDataSegment> segments;
+    std::vector<png_byte> enc_data;
+    std::unordered_map<size_t,size_t> reused_offsets;
+    size_t pos = cfmt.head_len;
+    unsigned num_encoded = 0;
+    if (cfmt.lead_entry)
+        spr_shifts.push_back(old_shifts[0]);
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        ImageData &img = imgs[i];
+        SprEntry spr;
+        memset(&spr, 0, sizeof(SprEntry));
+        if (img.reuse_data)
+        {
+            spr = old_shifts[lead+i];
+            auto it = reused_offsets.find(spr.Data);
+            if (it == reused_offsets.end() || !opts.dedup) {
+                size_t len = old_blobs[spr.Data];
+                size_t pad = (pos + opts.align - 1) / opts.align * opts.align - pos;
+                pos += pad;
+                it = reused_offsets.insert(std::make_pair((size_t)spr.Data, pos)).first;
+                it->second = pos;
+                segments.push_back(SpriteDataSegment{true, spr.Data, len, pad});
+                pos += len;
+            }
+            spr.Data = it->second;
+        } else
+        if ((img.dup_of >= 0) && opts.dedup)
+        {
+            sprite_entry_fill(spr, img);
+            spr.Data = spr_shifts[lead+img.dup_of].Data;
+        } else
+        {
+            sprite_entry_fill(spr, img);
+            size_t start = enc_data.size();
+            if (cfmt.trimmed) {
+                const JontySpriteV2& jspr = *(const JontySpriteV2 *)img.additional_data;
+                pack_sprite(enc_data,img,jspr.FrameOffsW,jspr.FrameOffsH,jspr.SWidth,jspr.SHeight,ws.palette);
+            } else {
+                pack_sprite(enc_data,img,img.crop_x,img.crop_y,img.crop_width,img.crop_height,ws.palette);
+            }
+            size_t pad = (pos + opts.align - 1) / opts.align * opts.align - pos;
+            pos += pad;
+            segments.push_back(SpriteDataSegment{false, start, enc_data.size() - start, pad});
+            spr.Data = pos;
+            pos += enc_data.size() - start;
+            num_encoded++;
+        }
+        spr_shifts.push_back(spr);
+    }
+    if (cfmt.end_entry) {
+        SprEntry spr;
+        memset(&spr, 0, sizeof(SprEntry));
+        spr.Data = pos;
+        spr_shifts.push_back(spr);
+    }
+    if ((imgs.size() > cfmt.max_sprites) || (pos > UINT32_MAX)) {
+        LogErr("Updated sprite catalogue of %u sprites and %lu bytes exceeds the format limits.",
+            (unsigned)imgs.size(),(unsigned long)pos);
+        fclose(oldfile);
+        return ERR_LIMIT_EXCEED;
+    }
+    LogMsg("Encoded %u sprites, reused data of %u sprites.",num_encoded,(unsigned)imgs.size()-num_encoded);
+    // Write the new DAT file, copying consecutive reused ranges at once
+    std::string fname_tmp = out.fname_out + ".tmp";
+    FILE* rawfile = fopen(fname_tmp.c_str(),"wb");
+    if (rawfile == NULL) {
+        perror(fname_tmp.c_str());
+        fclose(oldfile);
+        return ERR_CANT_OPEN;
+    }
+    short ret = ERR_OK;
+    if (cfmt.head_len == sizeof(unsigned short)) {
+        // Small Sprite files start with entries count
+        unsigned char head[2];
+        write_int16_le_buf(head, spr_shifts.size());
+        if (fwrite(head,sizeof(head),1,rawfile) != 1)
+            ret = ERR_FILE_WRITE;
+    }
+    std::vector<png_byte> zeros(opts.align, 0);
+    for (unsigned i = 0; (i < segments.size()) && (ret == ERR_OK); i++)
+    {
+        SpriteDataSegment seg = segments[i];
+        if ((seg.pad > 0) && (fwrite(&zeros.front(),seg.pad,1,rawfile) != 1)) {
+            ret = ERR_FILE_WRITE;
+            break;
+        }
+        if (seg.reused) {
+            while ((i+1 < segments.size()) && segments[i+1].reused && (segments[i+1].pad == 0) &&
+                (segments[i+1].offset == seg.offset+seg.len)) {
+                seg.len += segments[i+1].len;
+                i++;
+            }
+            ret = file_copy_range(rawfile, oldfile, seg.offset, seg.len);
+        } else
+        if ((seg.len > 0) && (fwrite(&enc_data[seg.offset],seg.len,1,rawfile) != 1)) {
+            ret = ERR_FILE_WRITE;
+        }
+    }
+    fclose(oldfile);
+    if (fclose(rawfile) != 0)
+        ret = ERR_FILE_WRITE;
+    if (ret != ERR_OK) {
+        perror(fname_tmp.c_str());
+        remove(fname_tmp.c_str());
+        return ret;
+    }
+    if (opts.if_changed)
+    {
+        ret = output_file_finish(out.fname_out, opts);
+        if (ret != ERR_OK)
+            return ret;
+    } else
+    {
+#if defined(_WIN32)
+        remove(out.fname_out.c_str());
+#endif
+        if (rename(fname_tmp.c_str(), out.fname_out.c_str()) != 0) {
+            perror(out.fname_out.c_str());
+            return ERR_FILE_WRITE;
+        }
+        output_file_written(out.fname_out);
+    }
+    return save_sprite_tab_file(spr_shifts, out.fname_tab, opts);
+}
+
+/**
+ * Updates existing sprite catalogue output file.
+ */
+short update_output_file(WorkingSet& ws, std::vector<ImageData>& imgs, const OutputFile& out, ProgramOptions& opts)
+{
+    SpriteCatalogueFormat cfmt;
+    LogMsg("Updating sprite catalogue \"%s\".",out.fname_out.c_str());
+    switch (out.fmt)
+    {
+    case OutFmt_SSPR:
+        sprite_catalogue_format_small(cfmt);
+        return update_sprite_catalogue<SmallSpriteV1>(ws, imgs, cfmt, sspr_pack_sprite, out, opts);
+    case OutFmt_SSPR2:
+        sprite_catalogue_format_small(cfmt);
+        return update_sprite_catalogue<SmallSpriteV2>(ws, imgs, cfmt, sspr_pack_sprite, out, opts);
+    case OutFmt_SSPR3:
+        sprite_catalogue_format_small(cfmt);
+        return update_sprite_catalogue<SmallSpriteV2>(ws, imgs, cfmt, sspr3_pack_sprite, out, opts);
+    case OutFmt_JSPR:
+        sprite_catalogue_format_jonty(cfmt);
+        return update_sprite_catalogue<JontySpriteV1>(ws, imgs, cfmt, sspr_pack_sprite, out, opts);
+    case OutFmt_JSPR2:
+        sprite_catalogue_format_jonty(cfmt);
+        return update_sprite_catalogue<JontySpriteV2>(ws, imgs, cfmt, sspr_pack_sprite, out, opts);
+    case OutFmt_JSPR3:
+        sprite_catalogue_format_jonty(cfmt);
+        return update_sprite_catalogue<JontySpriteV2>(ws, imgs, cfmt, sspr3_pack_sprite, out, opts);
+    }
+    return ERR_OK;
+}
+
+/**
+ * Encodes sprites one after another, each starting at offset being multiple of given alignment.
+ * The data is copied into memory at address aligned to mem_align, so that the offsets translate to aligned addresses.
+ * @return Pointer to the sprites data within the memory buffer.
+ */
+const png_byte *bench_sprites_pack(std::vector<png_byte>& mem, std::vector<size_t>& offs, std::vector<ImageData>& imgs,
+    sprite_pack_t pack_sprite, size_t align, size_t mem_align, const ColorPalette& palette)
+{
+    SpriteDataBuffer spr_data(false, align);
+    offs.clear();
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        ImageData &img = imgs[i];
+        size_t start = spr_data.startSprite();
+        pack_sprite(spr_data.data,img,img.crop_x,img.crop_y,img.crop_width,img.crop_height,palette);
+        offs.push_back(spr_data.commitSprite(start));
+    }
+    mem.resize(spr_data.data.size() + mem_align);
+    size_t shift = (mem_align - (uintptr_t)mem.data() % mem_align) % mem_align;
+    if (!spr_data.data.empty())
+        memcpy(&mem[shift], &spr_data.data.front(), spr_data.data.size());
+    return &mem[shift];
+}
+
+/**
+ * Measures drawing of sprites stored in SmallSprite Ver2 and Ver3 encodings, with most rows clipped.
+ * Every sprite is drawn partially above the clipping window, so only its bottom quarter is visible.
+ * Both encodings are also checked to draw identical pixels. Unclipped drawing is then measured
+ * with sprites packed one after another, and with each sprite at aligned address.
+ */
+short bench_sprite_blit(WorkingSet& ws, std::vector<ImageData>& imgs, ProgramOptions& opts)
+{
+    std::vector<png_byte> data2, data3;
+    std::vector<size_t> offs2, offs3;
+    int max_width = 1, max_height = 1;
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        ImageData &img = imgs[i];
+        offs2.push_back(data2.size());
+        sspr_pack_sprite(data2,img,img.crop_x,img.crop_y,img.crop_width,img.crop_height,ws.palette);
+        offs3.push_back(data3.size());
+        sspr3_pack_sprite(data3,img,img.crop_x,img.crop_y,img.crop_width,img.crop_height,ws.palette);
+        max_width = std::max(max_width, img.crop_width);
+        max_height = std::max(max_height, img.crop_height);
+    }
+    std::vector<png_byte> buf2(max_width*max_height, 0), buf3(max_width*max_height, 0);
+    BlitTarget dst2 = {&buf2.front(), max_width, 0, 0, max_width, max_height};
+    BlitTarget dst3 = {&buf3.front(), max_width, 0, 0, max_width, max_height};
+    // Verify that both encodings give the same result, with and without clipping
+    for (unsigned i = 0; i < imgs.size(); i++)
+    {
+        ImageData &img = imgs[i];
+        for (int y = 0; y > -img.crop_height; y -= std::max(img.crop_height/4, 1))
+        {
+            std::fill(buf2.begin(), buf2.end(), 0);
+            std::fill(buf3.begin(), buf3.end(), 0);
+            sspr2_blit(dst2, &data2[offs2[i]], img.crop_width, img.crop_height, 0, y);
+            sspr3_blit(dst3, &data3[offs3[i]], img.crop_width, img.crop_height, 0, y);
+            if (buf2 != buf3) {
+                LogErr("Sprite %u drawn differently from SSPR2 and SSPR3 data.",i);
+                return ERR_BAD_FILE;
             }
         }
-        // Add the entry at end
-        {
-            int i = imgs.size();
-            memset(&spr_shifts[i], 0, sizeof(JontySpriteV1));
-            spr_shifts[i].Data = ftell(rawfile) - base_pos;
-            spr_shifts[i].SWidth = 0;
-            spr_shifts[i].SHeight = 0;
-        }
-        fclose(rawfile);
     }
-    // Open and write the TAB file
+    const int rounds = 1000;
+    double time2, time3;
     {
-        FILE* tabfile = fopen(fname_tab.c_str(),"wb");
-        if (tabfile == NULL) {
-            perror(fname_tab.c_str());
-            return ERR_CANT_OPEN;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++)
+            for (unsigned i = 0; i < imgs.size(); i++)
+                sspr2_blit(dst2, &data2[offs2[i]], imgs[i].crop_width, imgs[i].crop_height, 0, -(imgs[i].crop_height*3/4));
+        time2 = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++)
+            for (unsigned i = 0; i < imgs.size(); i++)
+                sspr3_blit(dst3, &data3[offs3[i]], imgs[i].crop_width, imgs[i].crop_height, 0, -(imgs[i].crop_height*3/4));
+        time3 = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    LogMsg("Clipped drawing of %u sprites, %d rounds: SSPR2 %.2f ms, SSPR3 %.2f ms.",
+        (unsigned)imgs.size(),rounds,time2,time3);
+    LogMsg("Sprites data size: SSPR2 %lu bytes, SSPR3 %lu bytes.",(unsigned long)data2.size(),(unsigned long)data3.size());
+    // Compare unclipped drawing of sprites starting at any address, and at aligned addresses
+    size_t align = (opts.align > 1) ? opts.align : 64;
+    const sprite_pack_t packs[] = {sspr_pack_sprite, sspr3_pack_sprite};
+    void (* const blits[])(const BlitTarget&, const unsigned char *, int, int, int, int) = {sspr2_blit, sspr3_blit};
+    for (int enc = 0; enc < 2; enc++)
+    {
+        double times[2];
+        size_t sizes[2];
+        for (int aligned = 0; aligned < 2; aligned++)
+        {
+            std::vector<png_byte> mem;
+            std::vector<size_t> offs;
+            const png_byte *data = bench_sprites_pack(mem, offs, imgs, packs[enc], aligned ? align : 1, align, ws.palette);
+            sizes[aligned] = mem.size() - align;
+            auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < rounds; r++)
+                for (unsigned i = 0; i < imgs.size(); i++)
+                    blits[enc](dst2, data + offs[i], imgs[i].crop_width, imgs[i].crop_height, 0, 0);
+            times[aligned] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
         }
-        if (fwrite(&spr_shifts.front(),sizeof(JontySpriteV1),spr_shifts.size(),tabfile) != spr_shifts.size())
-        { perror(fname_tab.c_str()); return ERR_FILE_WRITE; }
-        fclose(tabfile);
+        LogMsg("Unclipped drawing of SSPR%d, %d rounds: packed %.2f ms, aligned to %lu bytes %.2f ms; data size %lu and %lu bytes.",
+            enc+2,rounds,times[0],(unsigned long)align,times[1],(unsigned long)sizes[0],(unsigned long)sizes[1]);
     }
     return ERR_OK;
 }
 
-short save_jontyspr_v2_file(WorkingSet& ws, std::vector<ImageData>& imgs, const std::string& fname_out, const std::string& fname_tab, ProgramOptions& opts)
+/**
+ * Results of reading back sprite catalogue files.
+ */
+struct SpriteVerifyStats {
+    unsigned checked;
+    unsigned skipped;
+    unsigned failed;
+    /** Amount of sprites decoded while measuring speed, and time it took */
+    unsigned long decoded;
+    double decode_ms;
+};
+
+/**
+ * Compares sprites of one catalogue DAT/TAB pair with the images they were encoded from, then measures decoding.
+ * Every sprite is decoded twice, over buffers filled with different values, so that transparent
+ * pixels can be told apart from filled pixels of any color.
+ */
+short verify_sprite_catalogue_part(SpriteCatalogueReader& rdr, std::vector<ImageData>& imgs, unsigned first,
+    bool trimmed, SpriteVerifyStats& stats)
 {
-    std::vector<JontySpriteV2> spr_shifts;
-    // Open and write the JontySprite file
+    unsigned num_sprites = rdr.count();
+    int max_width = 1, max_height = 1;
+    std::vector<png_byte> buf_lo, buf_hi;
+    for (unsigned i = 0; i < num_sprites; i++)
     {
-        FILE* rawfile = fopen(fname_out.c_str(),"wb");
-        if (rawfile == NULL) {
-            perror(fname_out.c_str());
-            return ERR_CANT_OPEN;
+        ImageData &img = imgs[first+i];
+        // Updated catalogues have sprites copied from old file, without the images loaded
+        if (img.reuse_data) {
+            stats.skipped++;
+            continue;
         }
-        // Shifts start with index 0, and there's additional entry at end
-        spr_shifts.resize(imgs.size()+1);
-        long base_pos = ftell(rawfile);
-        for (unsigned i = 0; i < imgs.size(); i++)
+        int sx = img.crop_x, sy = img.crop_y;
+        int width = img.crop_width, height = img.crop_height;
+        if (trimmed) {
+            const JontySpriteV2& jspr = *(const JontySpriteV2 *)img.additional_data;
+            sx = jspr.FrameOffsW;
+            sy = jspr.FrameOffsH;
+            width = jspr.SWidth;
+            height = jspr.SHeight;
+        }
+        stats.checked++;
+        SpriteCatalogueEntry spr;
+        rdr.entry(i, spr);
+        if ((spr.width != width) || (spr.height != height) ||
+            (trimmed && ((spr.frame_x != sx) || (spr.frame_y != sy)))) {
+            LogErr("Sprite %u has dimensions %dx%d at %d,%d, while its image %dx%d at %d,%d.",first+i,
+                spr.width,spr.height,spr.frame_x,spr.frame_y,width,height,sx,sy);
+            stats.failed++;
+            continue;
+        }
+        max_width = std::max(max_width, width);
+        max_height = std::max(max_height, height);
+        buf_lo.assign(width*height, 0x00);
+        buf_hi.assign(width*height, 0xff);
+        BlitTarget dst_lo = {buf_lo.data(), width, 0, 0, width, height};
+        BlitTarget dst_hi = {buf_hi.data(), width, 0, 0, width, height};
+        if ((rdr.blit(i, dst_lo, 0, 0) != ERR_OK) || (rdr.blit(i, dst_hi, 0, 0) != ERR_OK)) {
+            LogErr("Sprite %u data is outside of the DAT file.",first+i);
+            stats.failed++;
+            continue;
+        }
+        png_bytep * row_pointers = img.rowPointers();
+        bool same = true;
+        for (int y = 0; (y < height) && same; y++)
         {
-            ImageData &img = imgs[i];
-            JontySpriteV2 &spr = spr_shifts[i];
-            memcpy(&spr, &img.additional_data, sizeof(JontySpriteV2));
-            spr.Data = ftell(rawfile) - base_pos;
-            std::vector<png_byte> out_row;
-            out_row.resize(spr.SWidth*3);
-            png_bytep * row_pointers = png_get_rows(img.png_ptr, img.info_ptr);
-            for (int y=0; y<spr.SHeight; y++)
-            {
-                png_bytep inp_row = row_pointers[spr.FrameOffsH+y];
-                ColorTranparency::Column& inp_trans = img.transMap[spr.FrameOffsH+y];
-                int newLength = sspr_pack(&out_row.front(),inp_row,inp_trans,spr.SWidth,spr.FrameOffsW,ws.palette);
-                if (fwrite(&out_row.front(),newLength,1,rawfile) != 1)
-                { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
-            }
+            png_bytep inp_row = row_pointers[sy+y] + sx;
+            ColorTranparency::Column& inp_trans = img.transMap[sy+y];
+            for (int x = 0; x < width; x++)
             {
-                // End an image with (-128) - it's available in u2 encoding, and only values -127..127
-                //are used for defining size of data and transparency, so this special value wasn't used before
-                char endofimg = -128;
-                if (fwrite(&endofimg,sizeof(char),1,rawfile) != 1)
-                { perror(fname_out.c_str()); return ERR_FILE_WRITE; }
+                png_byte lo = buf_lo[y*width+x], hi = buf_hi[y*width+x];
+                if (inp_trans[sx+x])
+                    same = (lo == 0x00) && (hi == 0xff);
+                else
+                    same = (lo == inp_row[x]) && (hi == inp_row[x]);
+                if (!same) {
+                    LogErr("Sprite %u differs from its image at %d,%d.",first+i,sx+x,sy+y);
+                    break;
+                }
             }
         }
-        // Add the entry at end
+        if (!same)
+            stats.failed++;
+    }
+    if (num_sprites == 0)
+        return ERR_OK;
+    // Decode the whole catalogue once more, timing a single pass to report decoding speed
+    std::vector<png_byte> buf(max_width*max_height, 0);
+    BlitTarget dst = {buf.data(), max_width, 0, 0, max_width, max_height};
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < num_sprites; i++)
+        rdr.blit(i, dst, 0, 0);
+    stats.decoded += num_sprites;
+    stats.decode_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return ERR_OK;
+}
+
+/**
+ * Reads back sprite catalogue written from given images, and compares every sprite with its image.
+ * Sharded catalogue is read from the files listed in its shards list.
+ */
+short verify_sprite_catalogue(std::vector<ImageData>& imgs, const OutputFile& out, ProgramOptions& opts)
+{
+    bool trimmed = (out.fmt == OutFmt_JSPR) || (out.fmt == OutFmt_JSPR2) || (out.fmt == OutFmt_JSPR3);
+    SpriteVerifyStats stats = {0, 0, 0, 0, 0.0};
+    std::vector<OutputFile> parts;
+    std::vector<unsigned> parts_first;
+    std::ifstream manfile;
+    if (opts.shard)
+        manfile.open(file_name_change_extension(out.fname_out,"shards"));
+    if (manfile.is_open())
+    {
+        std::string path = file_name_get_path(out.fname_out);
+        if (!path.empty())
+            path += "/";
+        std::string word;
+        unsigned num_shards = 0, num_sprites = 0;
+        if (!(manfile >> word >> num_shards >> num_sprites) || (word != "shards")) {
+            LogErr("Cannot read shards list of \"%s\".",out.fname_out.c_str());
+            return ERR_BAD_FILE;
+        }
+        for (unsigned n = 0; n < num_shards; n++)
         {
-            int i = imgs.size();
-            memset(&spr_shifts[i], 0, sizeof(JontySpriteV2));
-            spr_shifts[i].Data = ftell(rawfile) - base_pos;
-            spr_shifts[i].SWidth = 0;
-            spr_shifts[i].SHeight = 0;
+            OutputFile part(out.fmt);
+            unsigned first, count, first_local;
+            if (!(manfile >> part.fname_out >> part.fname_tab >> first >> count >> first_local)) {
+                LogErr("Cannot read shards list of \"%s\".",out.fname_out.c_str());
+                return ERR_BAD_FILE;
+            }
+            part.fname_out = path + part.fname_out;
+            part.fname_tab = path + part.fname_tab;
+            parts.push_back(part);
+            parts_first.push_back(first);
         }
-        fclose(rawfile);
+    } else
+    {
+        parts.push_back(out);
+        parts_first.push_back(0);
     }
-    // Open and write the TAB file
+    unsigned num_sprites = 0;
+    for (unsigned n = 0; n < parts.size(); n++)
     {
-        FILE* tabfile = fopen(fname_tab.c_str(),"wb");
-        if (tabfile == NULL) {
-            perror(fname_tab.c_str());
-            return ERR_CANT_OPEN;
+        SpriteCatalogueReader rdr;
+        short ret = rdr.open(parts[n].fname_out, parts[n].fname_tab, out.fmt);
+        if (ret != ERR_OK)
+            return ret;
+        if (parts_first[n] + rdr.count() > imgs.size()) {
+            LogErr("File \"%s\" has more sprites than there are images.",parts[n].fname_out.c_str());
+            return ERR_BAD_FILE;
         }
-        if (fwrite(&spr_shifts.front(),sizeof(JontySpriteV2),spr_shifts.size(),tabfile) != spr_shifts.size())
-        { perror(fname_tab.c_str()); return ERR_FILE_WRITE; }
-        fclose(tabfile);
+        ret = verify_sprite_catalogue_part(rdr, imgs, parts_first[n], trimmed, stats);
+        if (ret != ERR_OK)
+            return ret;
+        num_sprites += rdr.count();
+    }
+    if (num_sprites != imgs.size()) {
+        LogErr("Catalogue \"%s\" has %u sprites, while there are %u images.",out.fname_out.c_str(),
+            num_sprites,(unsigned)imgs.size());
+        return ERR_BAD_FILE;
     }
+    if (stats.failed > 0) {
+        LogErr("Verification of \"%s\" failed for %u of %u sprites.",out.fname_out.c_str(),stats.failed,stats.checked);
+        return ERR_BAD_FILE;
+    }
+    LogMsg("Verified %u sprites of \"%s\"; %u reused ones skipped.",stats.checked,out.fname_out.c_str(),stats.skipped);
+    if (stats.decode_ms > 0.0)
+        LogMsg("Decoded %lu sprites in %.3f ms; %.0f sprites/s.",stats.decoded,stats.decode_ms,
+            stats.decoded * 1000.0 / stats.decode_ms);
     return ERR_OK;
 }
 
-short save_flic_file(WorkingSet& ws, std::vector<ImageData>& imgs, const std::string& fname_out, ProgramOptions& opts)
+/**
+ * Reads back all sprite catalogues among given outputs, comparing them with the converted images.
+ * Other formats are not verified.
+ */
+short verify_output_files(std::vector<ImageData>& imgs, const std::vector<OutputFile>& outs, ProgramOptions& opts)
 {
-    struct Animation anim;
-    ubyte *frmbuf;
-    ubyte *scratch_buf;
-    uint w, h;
-    bool has_trans;
-
-    w = h = 0;
-    has_trans = false;
-    for (unsigned i = 0; i < imgs.size(); i++)
+    short ret = ERR_OK;
+    for (auto out = outs.begin(); out != outs.end(); out++)
     {
-        ImageData &img = imgs[i];
-        if (w < img.width)
-            w = img.width;
-        if (h < img.height)
-            h = img.height;
-        if (i == 0)
+        switch (out->fmt)
         {
-            for (unsigned y = 0; y < img.height; y++)
-            {
-                ColorTranparency::Column& transPtr = img.transMap[y];
-                has_trans |= ((unsigned)std::count(transPtr.begin(), transPtr.end(), false) < transPtr.size());
-                if (has_trans) break;
-            }
+        case OutFmt_SSPR:
+        case OutFmt_SSPR2:
+        case OutFmt_SSPR3:
+        case OutFmt_JSPR:
+        case OutFmt_JSPR2:
+        case OutFmt_JSPR3:
+            LogMsg("Verifying sprite catalogue \"%s\".",out->fname_out.c_str());
+            if (verify_sprite_catalogue(imgs, *out, opts) != ERR_OK)
+                ret = ERR_BAD_FILE;
+            break;
+        default:
+            LogDbg("Format of \"%s\" cannot be read back, not verified.",out->fname_out.c_str());
+            break;
         }
     }
+    return ret;
+}
 
-    anim_flic_init(&anim, 0, 0);
-    anim_flic_set_fname(&anim, "%s", fname_out.c_str());
-    anim_flic_make_open(&anim, w, h, 8, AniFlg_RECORD | (has_trans ? AniFlg_ALL_DELTA : 0));
-    if (!anim_is_opened(&anim)) {
-        perror(fname_out.c_str());
+/**
+ * Writes whole data buffer into given file.
+ */
+short save_data_file(const std::string& fname, const std::vector<unsigned char>& data)
+{
+    FILE* outfile = fopen(fname.c_str(),"wb");
+    if (outfile == NULL) {
+        perror(fname.c_str());
         return ERR_CANT_OPEN;
     }
+    if (!data.empty() && (fwrite(&data.front(), data.size(), 1, outfile) != 1)) {
+        perror(fname.c_str());
+        fclose(outfile);
+        return ERR_FILE_WRITE;
+    }
+    if (fclose(outfile) != 0) {
+        perror(fname.c_str());
+        return ERR_FILE_WRITE;
+    }
+    return ERR_OK;
+}
 
-    scratch_buf = new ubyte[anim_frame_size(w, h, 8) + anim_buffer_size(w, h, 8)];
-    anim_scratch = scratch_buf;
-    frmbuf = new ubyte[anim_frame_size(w, h+1, 8)];
-    memset(frmbuf, 0, anim_frame_size(w, h+1, 8));
-    anim_flic_set_frame_buffer(&anim, frmbuf, 0, 0, w, 0);
+/**
+ * Reads previous build of the sprite catalogue, before the new one replaces it.
+ * On first build there is no previous catalogue; then the delta is made from empty one,
+ * and contains the whole new catalogue.
+ */
+short load_delta_base(std::vector<unsigned char>& old_dat, std::vector<unsigned char>& old_tab, const ProgramOptions& opts)
+{
+    bool exists;
+    short ret = file_read_data_if_exists(opts.fname_delta_base, old_dat, exists);
+    if (ret != ERR_OK)
+        return ret;
+    if (!exists) {
+        LogMsg("No previous catalogue \"%s\"; delta will contain the whole catalogue.",opts.fname_delta_base.c_str());
+        old_tab.clear();
+        return ERR_OK;
+    }
+    return file_read_data(file_name_change_extension(opts.fname_delta_base,"tab"), old_tab);
+}
 
-    for (unsigned i = 0; i < imgs.size(); i++)
+/**
+ * Writes delta between previous build of the sprite catalogue and the one just written.
+ * The delta is named after the output DAT file, with DLT extension.
+ */
+short save_catalogue_delta(const std::vector<unsigned char>& old_dat, const std::vector<unsigned char>& old_tab,
+    const OutputFile& out, ProgramOptions& opts)
+{
+    std::vector<unsigned char> new_dat, new_tab, delta;
+    short ret = file_read_data(out.fname_out, new_dat);
+    if (ret == ERR_OK)
+        ret = file_read_data(out.fname_tab, new_tab);
+    if (ret != ERR_OK)
+        return ret;
+    CatalogueDeltaStats stats;
+    ret = catalogue_delta_create(old_dat, old_tab, new_dat, new_tab, sprite_tab_entry_size(out.fmt), delta, stats);
+    if (ret != ERR_OK) {
+        LogErr("Cannot make delta of \"%s\"; file too large.",out.fname_out.c_str());
+        return ret;
+    }
+    std::string fname_dlt = file_name_change_extension(out.fname_out,"dlt");
+    LogMsg("Saving delta file \"%s\".",fname_dlt.c_str());
+    ret = save_data_file(output_file_name(fname_dlt, opts), delta);
+    if (ret == ERR_OK)
+        ret = output_file_finish(fname_dlt, opts);
+    if (ret != ERR_OK)
+        return ret;
+    LogMsg("Delta has %u of %u data ranges changed, %lu bytes stored and %lu reused; %u TAB entries changed.",
+        stats.changed,stats.ranges,(unsigned long)stats.literal_bytes,(unsigned long)stats.copied_bytes,stats.tab_changes);
+    return ERR_OK;
+}
+
+/**
+ * Patches existing sprite catalogue with delta file.
+ * New files are written under temporary names, and replace the targets only after both are complete;
+ * unchanged files are left untouched.
+ */
+short apply_catalogue_delta(ProgramOptions& opts)
+{
+    const std::string& fname_dat = opts.inp[0].fname;
+    const OutputFile& out = opts.outs[0];
+    std::vector<unsigned char> old_dat, old_tab, delta, new_dat, new_tab;
+    // Delta made on first build applies to no catalogue, so missing input is not an error
+    bool exists = true;
+    short ret = file_read_data(opts.fname_delta_apply, delta);
+    if (ret == ERR_OK)
+        ret = file_read_data_if_exists(fname_dat, old_dat, exists);
+    if ((ret == ERR_OK) && exists)
+        ret = file_read_data(file_name_change_extension(fname_dat,"tab"), old_tab);
+    if (ret != ERR_OK)
+        return ret;
+    LogMsg("Applying delta \"%s\" to \"%s\".",opts.fname_delta_apply.c_str(),fname_dat.c_str());
+    ret = catalogue_delta_apply(old_dat, old_tab, delta, new_dat, new_tab);
+    if (ret != ERR_OK)
+        return ret;
+    ret = save_data_file(out.fname_out + ".tmp", new_dat);
+    if (ret == ERR_OK)
+        ret = save_data_file(out.fname_tab + ".tmp", new_tab);
+    if (ret != ERR_OK)
+        return ret;
+    bool changed;
+    ret = file_replace_if_changed(out.fname_out + ".tmp", out.fname_out, changed);
+    if (ret == ERR_OK)
+        ret = file_replace_if_changed(out.fname_tab + ".tmp", out.fname_tab, changed);
+    if (ret != ERR_OK)
+        return ret;
+    LogMsg("Written \"%s\" and \"%s\".",out.fname_out.c_str(),out.fname_tab.c_str());
+    return ERR_OK;
+}
+
+/**
+ * Writes the converted images into output file of given format.
+ */
+short save_output_file(WorkingSet& ws, std::vector<ImageData>& imgs, const OutputFile& out, ProgramOptions& opts)
+{
+    if (opts.update)
+        return update_output_file(ws, imgs, out, opts);
+    switch (out.fmt)
     {
-        ImageData &img = imgs[i];
+    case OutFmt_RAW:
+        LogMsg("Saving RAW file \"%s\".",out.fname_out.c_str());
+        if (opts.atlas)
+            return save_atlas_file(ws, imgs, out, opts);
+        return save_raw_file(ws, imgs, out.fname_out, opts);
+    case OutFmt_BMP:
+        LogMsg("Saving BMP file \"%s\".",out.fname_out.c_str());
+        if (opts.atlas)
+            return save_atlas_file(ws, imgs, out, opts);
+        return save_bmp_file(ws, imgs, out.fname_out, opts);
+    case OutFmt_HSPR:
+        LogMsg("Saving HSPR file \"%s\".",out.fname_out.c_str());
+        return save_hugspr_file(ws, imgs[0], out.fname_out, opts);
+    case OutFmt_SSPR:
+        LogMsg("Saving SSPR1 file \"%s\".",out.fname_out.c_str());
+        return save_smallspr_v1_file(ws, imgs, out, opts);
+    case OutFmt_SSPR2:
+        LogMsg("Saving SSPR2 file \"%s\".",out.fname_out.c_str());
+        return save_smallspr_v2_file(ws, imgs, out, opts);
+    case OutFmt_JSPR:
+        LogMsg("Saving JSPR1 file \"%s\".",out.fname_out.c_str());
+        return save_jontyspr_v1_file(ws, imgs, out, opts);
+    case OutFmt_JSPR2:
+        LogMsg("Saving JSPR2 file \"%s\".",out.fname_out.c_str());
+        return save_jontyspr_v2_file(ws, imgs, out, opts);
+    case OutFmt_SSPR3:
+        LogMsg("Saving SSPR3 file \"%s\".",out.fname_out.c_str());
+        return save_smallspr_v2_file(ws, imgs, out, opts, sspr3_pack_sprite);
+    case OutFmt_JSPR3:
+        LogMsg("Saving JSPR3 file \"%s\".",out.fname_out.c_str());
+        return save_jontyspr_v2_file(ws, imgs, out, opts, sspr3_pack_sprite);
+    case OutFmt_FLIC:
+        LogMsg("Saving FLIC file \"%s\".",out.fname_out.c_str());
+        return save_flic_file(ws, imgs, out.fname_out, opts);
+    }
+    return ERR_OK;
+}
 
-        png_bytep * row_pointers = png_get_rows(img.png_ptr, img.info_ptr);
-        for (unsigned y = 0; y < img.height; y++)
+/**
+ * Writes the converted images into all given output files.
+ */
+short save_output_files(WorkingSet& ws, std::vector<ImageData>& imgs, const std::vector<OutputFile>& outs, ProgramOptions& opts)
+{
+    std::vector<short> results;
+    results.resize(outs.size());
+    if (outs.size() == 1)
+    {
+        results[0] = save_output_file(ws, imgs, outs[0], opts);
+    } else
+    {
+        // All outputs use the same converted images, so independent writers can run in parallel
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < outs.size(); i++)
         {
-            png_bytep row = row_pointers[y];
-            ColorTranparency::Column& transPtr = img.transMap[y];
+            workers.push_back(std::thread([&, i]() {
+                results[i] = save_output_file(ws, imgs, outs[i], opts);
+            }));
+        }
+        for (auto worker = workers.begin(); worker != workers.end(); worker++)
+            worker->join();
+    }
+    for (unsigned i = 0; i < results.size(); i++)
+    {
+        if (results[i] != ERR_OK)
+            return results[i];
+    }
+    return ERR_OK;
+}
 
-            for (unsigned x = 0; x < img.width; x++)
-            {
-                if (!transPtr[x]) {
-                    frmbuf[y * w + x] = row[x];
-                }
+/**
+ * Creates downscaled copies of the loaded images for every requested mip level, before their colors are converted.
+ * Level n has images downscaled by factor 2^n; pixel data of the copies is stored in given buffers.
+ */
+short make_mip_levels(std::vector<std::vector<ImageData> >& mips, std::vector<std::vector<png_byte> >& mip_pixels,
+    std::vector<ImageData>& imgs, ProgramOptions& opts)
+{
+    unsigned num_imgs = imgs.size();
+    mips.resize(opts.mips);
+    mip_pixels.resize(opts.mips * num_imgs);
+    for (unsigned lvl = 0; lvl < opts.mips; lvl++)
+    {
+        std::vector<ImageData>& lvl_imgs = mips[lvl];
+        lvl_imgs.resize(num_imgs);
+        int factor = 2 << lvl;
+        parallel_for(num_imgs, [&](int i) {
+            ImageData& src = imgs[i];
+            if (src.dup_of >= 0)
+                return;
+            ImageData& img = lvl_imgs[i];
+            int bytes_per_pixel = (src.colorBPP()+7) >> 3;
+            img.width = (src.crop_width + factor - 1) / factor;
+            img.height = (src.crop_height + factor - 1) / factor;
+            img.crop_width = img.width;
+            img.crop_height = img.height;
+            img.color_type = src.color_type;
+            img.col_bits = src.col_bits;
+            img.transparency_threshold = src.transparency_threshold;
+            std::vector<png_byte>& pixels = mip_pixels[lvl * num_imgs + i];
+            pixels.resize((size_t)img.width * img.height * bytes_per_pixel);
+            img.view_rows.resize(img.height);
+            for (unsigned y = 0; y < img.height; y++)
+                img.view_rows[y] = &pixels[(size_t)y * img.width * bytes_per_pixel];
+            image_downscale_box(&img.view_rows.front(), img.width, img.height, src.rowPointers(),
+                src.crop_x, src.crop_y, src.crop_width, src.crop_height, bytes_per_pixel, factor);
+        });
+        for (unsigned i = 0; i < num_imgs; i++)
+        {
+            ImageData& img = lvl_imgs[i];
+            if (imgs[i].dup_of >= 0) {
+                ImageData& fimg = lvl_imgs[imgs[i].dup_of];
+                img.setView(fimg, 0, 0, fimg.width, fimg.height);
+                img.dup_of = imgs[i].dup_of;
             }
+            short ret = load_inp_additional_data(img, opts.inp[i], opts);
+            if (ret != ERR_OK)
+                return ret;
         }
-
-        anim_make_prep_next_frame(&anim, frmbuf);
-        anim_make_next_frame(&anim, NULL);
     }
-    anim_flic_close(&anim);
-    delete[] frmbuf;
-    delete[] scratch_buf;
     return ERR_OK;
 }
 
@@ -1660,99 +3776,337 @@ int main(int argc, char* argv[])
     if (verbose)
         show_head();
 
-    static WorkingSet ws;
+    if (opts.inspect)
+    {
+        return (inspect_input_files(opts) > 0) ? 2 : 0;
+    }
+    if (!opts.fname_delta_apply.empty())
+    {
+        return (apply_catalogue_delta(opts) != ERR_OK) ? 2 : 0;
+    }
+    // Previous catalogue is usually overwritten by the new one, so it's read before conversion
+    static std::vector<unsigned char> delta_old_dat, delta_old_tab;
+    if (!opts.fname_delta_base.empty())
+    {
+        if (load_delta_base(delta_old_dat, delta_old_tab, opts) != ERR_OK)
+            return 2;
+    }
 
     std::vector<ImageData> imgs;
     imgs.resize(opts.inp.size());
+    static ImageCache img_cache;
+    static QuantCache quant_cache;
+    std::vector<uint64_t> cache_keys;
+    if (!opts.cache_dir.empty())
+    {
+        quant_cache.setup(opts.cache_dir, (size_t)opts.cache_max << 20);
+        cache_keys.resize(opts.inp.size());
+    }
+    if (opts.update)
+    {
+        // Only the requested sprites, and the ones beyond catalogue end, need to be loaded
+        unsigned old_count;
+        if (load_sprite_tab_count(opts.outs[0], old_count) != ERR_OK) {
+            return 2;
+        }
+        for (unsigned i = 0; (i < imgs.size()) && (i < old_count); i++)
+            imgs[i].reuse_data = true;
+        for (auto idx = opts.update_idx.begin(); idx != opts.update_idx.end(); idx++)
+        {
+            if (*idx < imgs.size())
+                imgs[*idx].reuse_data = false;
+        }
+    }
     {
+        // Files used by more than one image area are decoded once, and shared
+        std::unordered_map<std::string,int> fname_uses;
+        for (unsigned i = 0; i < opts.inp.size(); i++)
+            fname_uses[opts.inp[i].fname]++;
+        // Image areas with identical file content and conversion parameters are processed once
+        std::unordered_map<std::string,uint64_t> fname_hashes;
+        std::unordered_map<uint64_t,int> content_first;
+        unsigned dup_count = 0;
+        std::unordered_map<std::string,uint64_t> pal_hashes;
         for (unsigned i = 0; i < opts.inp.size(); i++)
         {
-            if (verbose)
-                LogMsg("Loading image \"%s\".",opts.inp[i].fname.c_str());
+            const ImageArea& inp = opts.inp[i];
             ImageData& img = imgs[i];
-            if (load_inp_png_file(img, opts.inp[i].fname, opts) != ERR_OK) {
-                return 2;
+            if (img.reuse_data)
+                continue;
+            if ((opts.inp.size() > 1) || quant_cache.enabled())
+            {
+                auto hash_it = fname_hashes.find(inp.fname);
+                if (hash_it == fname_hashes.end()) {
+                    uint64_t hash;
+                    if (load_inp_file_hash(inp.fname, hash) != ERR_OK) {
+                        return 2;
+                    }
+                    hash_it = fname_hashes.insert(std::make_pair(inp.fname, hash)).first;
+                }
+                int64_t key_vals[] = {(int64_t)hash_it->second, inp.x, inp.y, inp.w, inp.h, opts.alg, opts.lvl};
+                uint64_t key = data_hash64(key_vals, sizeof(key_vals));
+                if (!inp.fname_pal.empty()) {
+                    // Images converted to different palettes never share indexes
+                    uint64_t pal_vals[] = {key, data_hash64(inp.fname_pal.data(), inp.fname_pal.length())};
+                    key = data_hash64(pal_vals, sizeof(pal_vals));
+                }
+                auto first_it = content_first.find(key);
+                if (first_it != content_first.end()) {
+                    // Hash match is confirmed by comparing the parameters and file content
+                    const ImageArea& finp = opts.inp[first_it->second];
+                    bool same = (finp.x == inp.x) && (finp.y == inp.y) && (finp.w == inp.w) && (finp.h == inp.h) &&
+                        (finp.fname_pal == inp.fname_pal);
+                    if (same && (finp.fname != inp.fname)) {
+                        if (file_content_equal(finp.fname, inp.fname, same) != ERR_OK) {
+                            return 2;
+                        }
+                    }
+                    if (!same)
+                        first_it = content_first.end();
+                }
+                if (first_it != content_first.end()) {
+                    ImageData& fimg = imgs[first_it->second];
+                    if (verbose)
+                        LogMsg("Image \"%s\" repeats content of \"%s\".",inp.fname.c_str(),opts.inp[first_it->second].fname.c_str());
+                    img.setView(fimg, fimg.crop_x, fimg.crop_y, fimg.crop_width, fimg.crop_height);
+                    img.dup_of = first_it->second;
+                    dup_count++;
+                    if (fimg.cached) {
+                        memcpy(img.additional_data, fimg.additional_data, ADDITIONAL_DATA_LEN);
+                        img.cached = true;
+                    }
+                    if (load_inp_additional_data(img, inp, opts) != ERR_OK) {
+                        return 2;
+                    }
+                    continue;
+                }
+                content_first.insert(std::make_pair(key, (int)i));
+                if (quant_cache.enabled())
+                {
+                    const std::string& fname_pal = inp.fname_pal.empty() ? opts.fname_pal : inp.fname_pal;
+                    auto pal_it = pal_hashes.find(fname_pal);
+                    if (pal_it == pal_hashes.end()) {
+                        uint64_t hash;
+                        if (load_inp_file_hash(fname_pal, hash) != ERR_OK) {
+                            LogErr("Loading palette failed.");
+                            return 4;
+                        }
+                        pal_it = pal_hashes.insert(std::make_pair(fname_pal, hash)).first;
+                    }
+                    // Palette and all parameters which affect conversion make the cache key
+                    int64_t cache_vals[] = {(int64_t)key, (int64_t)pal_it->second, opts.pal_range, opts.sheet_quant,
+                        opts.hasFormat(OutFmt_JSPR) || opts.hasFormat(OutFmt_JSPR2) || opts.hasFormat(OutFmt_JSPR3) || opts.atlas,
+                        img.transparency_threshold, QUANT_CACHE_VERSION};
+                    cache_keys[i] = data_hash64(cache_vals, sizeof(cache_vals));
+                    if (quant_cache.load(img, cache_keys[i])) {
+                        if (verbose)
+                            LogMsg("Using cached image \"%s\".",inp.fname.c_str());
+                        if (load_inp_additional_data(img, inp, opts) != ERR_OK) {
+                            return 2;
+                        }
+                        continue;
+                    }
+                }
+            }
+            // Image areas are always views, so that sizes of sprites and frames follow the area
+            bool has_area = (inp.x > 0) || (inp.y > 0) || (inp.w > 0) || (inp.h > 0);
+            if ((fname_uses[inp.fname] > 1) || opts.sheet_quant || has_area) {
+                ImageData *sheet;
+                if (verbose)
+                    LogMsg((fname_uses[inp.fname] > 1) ? "Using shared image \"%s\"." : "Loading image \"%s\".",inp.fname.c_str());
+                if (img_cache.load(sheet, inp.fname, opts) != ERR_OK) {
+                    return 2;
+                }
+                img.width = sheet->width;
+                img.height = sheet->height;
+                set_image_crop(img, inp);
+                img.setView(*sheet, img.crop_x, img.crop_y, img.crop_width, img.crop_height);
+            } else {
+                if (verbose)
+                    LogMsg("Loading image \"%s\".",inp.fname.c_str());
+                if (load_inp_png_file(img, inp.fname, opts) != ERR_OK) {
+                    return 2;
+                }
             }
-            if (load_inp_additional_data(img, opts.inp[i], opts) != ERR_OK) {
+            if (load_inp_additional_data(img, inp, opts) != ERR_OK) {
                 return 2;
             }
         }
+        if (verbose && (dup_count > 0))
+            LogMsg("Found %u images repeating content of other images.",dup_count);
     }
 
-    ws.alg = opts.alg;
-    ws.ditherLevel(opts.lvl);
-    ws.requestedColors(256);
-    if (verbose)
-        LogMsg("Loading palette file \"%s\".",opts.fname_pal.c_str());
-    if (load_inp_palette_file(ws, opts.fname_pal, opts) != ERR_OK) {
+    // Images with their own palettes in lists use separate working sets
+    static PaletteCache pal_cache;
+    WorkingSet *main_ws;
+    if (pal_cache.get(main_ws, opts.fname_pal, opts) != ERR_OK) {
         LogErr("Loading palette failed.");
         return 4;
     }
+    WorkingSet& ws = *main_ws;
 
+    // Downscaled levels are made from the RGB(A) data, before it's replaced by indexes
+    std::vector<std::vector<ImageData> > mips;
+    std::vector<std::vector<png_byte> > mip_pixels;
+    if (opts.mips > 0)
     {
-        std::vector<ImageData>::iterator iter;
-        for (iter = imgs.begin(); iter != imgs.end(); iter++)
+        if (verbose)
+            LogMsg("Downscaling images to %u mip levels...",opts.mips);
+        if (make_mip_levels(mips, mip_pixels, imgs, opts) != ERR_OK) {
+            return 2;
+        }
+    }
+
+    {
+        // Images are converted grouped by palette, so that one working set is used at a time;
+        // the order within group is kept, so repeated content always follows its first image
+        std::vector<unsigned> order(imgs.size());
+        for (unsigned i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [](unsigned a, unsigned b) {
+            return opts.inp[a].fname_pal < opts.inp[b].fname_pal;
+        });
+        std::vector<WorkingSet *> img_ws(imgs.size(), &ws);
+        for (unsigned n = 0; n < order.size(); n++)
         {
+            unsigned i = order[n];
+            const ImageArea& inp = opts.inp[i];
             if (verbose)
-                LogMsg("Converting image %d colors to indexes...",(int)(iter-imgs.begin()));
-            ImageData& img = *iter;
-            if (convert_rgb_to_indexed(ws, img, (img.color_type & PNG_COLOR_MASK_ALPHA) != 0) != ERR_OK) {
+                LogMsg("Converting image %d colors to indexes...",(int)i);
+            ImageData& img = imgs[i];
+            if (img.reuse_data)
+                continue;
+            if (!inp.fname_pal.empty() && (pal_cache.get(img_ws[i], inp.fname_pal, opts) != ERR_OK)) {
+                LogErr("Loading palette failed.");
+                return 4;
+            }
+            if (img.dup_of >= 0)
+            {
+                // Repeated content - reuse indexes of the first image
+                ImageData& fimg = imgs[img.dup_of];
+                img.setView(fimg, 0, 0, fimg.crop_width, fimg.crop_height);
+                continue;
+            }
+            if (img.cached)
+                continue;
+            if (opts.sheet_quant && img.isView())
+            {
+                // Convert whole sheet on first use, then slice the palette indexes
+                const std::string& fname = inp.fname;
+                std::string sheet_key = inp.fname_pal.empty() ? fname : fname + "\n" + inp.fname_pal;
+                auto sheet_it = img_cache.indexed.find(sheet_key);
+                if (sheet_it == img_cache.indexed.end())
+                {
+                    ImageData& sheet = img_cache.decoded[fname];
+                    ImageData& idxsheet = img_cache.indexed[sheet_key];
+                    idxsheet.setView(sheet, 0, 0, sheet.width, sheet.height);
+                    if (convert_rgb_to_indexed(*img_ws[i], idxsheet, (idxsheet.color_type & PNG_COLOR_MASK_ALPHA) != 0) != ERR_OK) {
+                        LogErr("Converting colors failed.");
+                        return 6;
+                    }
+                    sheet_it = img_cache.indexed.find(sheet_key);
+                }
+                img.setView(sheet_it->second, img.view_x, img.view_y, img.width, img.height);
+                continue;
+            }
+            if (convert_rgb_to_indexed(*img_ws[i], img, (img.color_type & PNG_COLOR_MASK_ALPHA) != 0) != ERR_OK) {
                 LogErr("Converting colors failed.");
                 return 6;
             }
         }
+        // All levels share the palette lookups of the working sets
+        for (auto lvl_imgs = mips.begin(); lvl_imgs != mips.end(); lvl_imgs++)
+        {
+            for (unsigned n = 0; n < order.size(); n++)
+            {
+                unsigned i = order[n];
+                ImageData& img = (*lvl_imgs)[i];
+                if (img.dup_of >= 0) {
+                    ImageData& fimg = (*lvl_imgs)[img.dup_of];
+                    img.setView(fimg, 0, 0, fimg.crop_width, fimg.crop_height);
+                    continue;
+                }
+                if (convert_rgb_to_indexed(*img_ws[i], img, (img.color_type & PNG_COLOR_MASK_ALPHA) != 0) != ERR_OK) {
+                    LogErr("Converting colors failed.");
+                    return 6;
+                }
+            }
+        }
+        if (quant_cache.enabled() && !opts.dry_run)
+        {
+            for (unsigned i = 0; i < imgs.size(); i++)
+            {
+                ImageData& img = imgs[i];
+                if (img.reuse_data || img.cached || (img.dup_of >= 0))
+                    continue;
+                // Failing to store an entry only makes the next run slower
+                quant_cache.store(img, cache_keys[i]);
+            }
+        }
     }
 
-    switch (opts.fmt)
+    if (save_output_files(ws, imgs, opts.outs, opts) != ERR_OK)
+        return 8;
+    if (opts.verify && !opts.dry_run)
     {
-    case OutFmt_RAW:
-        LogMsg("Saving RAW file \"%s\".",opts.fname_out.c_str());
-        if (save_raw_file(ws, imgs, opts.fname_out, opts) != ERR_OK) {
-            return 8;
-        }
-        break;
-    case OutFmt_BMP:
-        LogMsg("Saving BMP file \"%s\".",opts.fname_out.c_str());
-        if (save_bmp_file(ws, imgs, opts.fname_out, opts) != ERR_OK) {
-            return 8;
-        }
-        break;
-    case OutFmt_HSPR:
-        LogMsg("Saving HSPR file \"%s\".",opts.fname_out.c_str());
-        if (save_hugspr_file(ws, imgs[0], opts.fname_out, opts) != ERR_OK) {
-            return 8;
-        }
-        break;
-    case OutFmt_SSPR:
-        LogMsg("Saving SSPR1 file \"%s\".",opts.fname_out.c_str());
-        if (save_smallspr_v1_file(ws, imgs, opts.fname_out, opts.fname_tab, opts) != ERR_OK) {
+        if (verify_output_files(imgs, opts.outs, opts) != ERR_OK)
+            return 9;
+    }
+    if (!opts.fname_delta_base.empty())
+    {
+        if (save_catalogue_delta(delta_old_dat, delta_old_tab, opts.outs[0], opts) != ERR_OK)
             return 8;
+    }
+
+    for (unsigned lvl = 0; lvl < mips.size(); lvl++)
+    {
+        // Every level has its own outputs, named after the main ones
+        std::vector<OutputFile> outs = opts.outs;
+        std::ostringstream suffix;
+        suffix << "_mip" << (lvl + 1);
+        for (auto out = outs.begin(); out != outs.end(); out++)
+        {
+            out->fname_out = file_name_add_suffix(out->fname_out, suffix.str());
+            out->fname_tab = file_name_add_suffix(out->fname_tab, suffix.str());
         }
-        break;
-    case OutFmt_SSPR2:
-        LogMsg("Saving SSPR2 file \"%s\".",opts.fname_out.c_str());
-        if (save_smallspr_v2_file(ws, imgs, opts.fname_out, opts.fname_tab, opts) != ERR_OK) {
-            return 8;
+        // Tiles of batch RAW/BMP layout shrink together with the images
+        ProgramOptions lvl_opts = opts;
+        int factor = 2 << lvl;
+        for (auto inp = lvl_opts.inp.begin(); inp != lvl_opts.inp.end(); inp++)
+        {
+            inp->fd[2] = (inp->fd[2] + factor - 1) / factor;
+            inp->fd[3] = (inp->fd[3] + factor - 1) / factor;
         }
-        break;
-    case OutFmt_JSPR:
-        LogMsg("Saving JSPR1 file \"%s\".",opts.fname_out.c_str());
-        if (save_jontyspr_v1_file(ws, imgs, opts.fname_out, opts.fname_tab, opts) != ERR_OK) {
+        if (save_output_files(ws, mips[lvl], outs, lvl_opts) != ERR_OK)
             return 8;
+        if (opts.verify && !opts.dry_run)
+        {
+            if (verify_output_files(mips[lvl], outs, lvl_opts) != ERR_OK)
+                return 9;
         }
-        break;
-    case OutFmt_JSPR2:
-        LogMsg("Saving JSPR2 file \"%s\".",opts.fname_out.c_str());
-        if (save_jontyspr_v2_file(ws, imgs, opts.fname_out, opts.fname_tab, opts) != ERR_OK) {
+    }
+
+    if (opts.depfile && !opts.dry_run)
+    {
+        if (verbose)
+            LogMsg("Saving dependency file \"%s\".",opts.fname_dep.c_str());
+        if (save_dependency_file(opts) != ERR_OK)
             return 8;
-        }
-        break;
-    case OutFmt_FLIC:
-        LogMsg("Saving FLIC file \"%s\".",opts.fname_out.c_str());
-        if (save_flic_file(ws, imgs, opts.fname_out, opts) != ERR_OK) {
+    }
+
+    if (opts.blit_bench)
+    {
+        if (bench_sprite_blit(ws, imgs, opts) != ERR_OK)
             return 8;
-        }
-        break;
+    }
+
+    if (quant_cache.enabled())
+    {
+        if (!opts.dry_run)
+            quant_cache.evict();
+        unsigned total = quant_cache.hits + quant_cache.misses;
+        LogMsg("Quantized images cache hits %u of %u (%.1f%%), %u entries evicted.",quant_cache.hits,total,
+            (total > 0) ? (100.0 * quant_cache.hits / total) : 0.0,quant_cache.evicted);
     }
 
     return 0;
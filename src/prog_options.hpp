@@ -32,6 +32,8 @@ enum {
     OutFmt_SSPR2,  //!< KeeperFX variation (version 2) of Small Sprite format, with 16-bit sprite dimensions
     OutFmt_JSPR2,  //!< KeeperFX variation (version 2) of Jonty Sprite format, with 16-bit sprite dimensions
     OutFmt_FLIC,   //!< Bullfrog FLIC format, animation originally from Autodesk, with modifications to headers and chunk types
+    OutFmt_SSPR3,  //!< KeeperFX variation (version 3) of Small Sprite format, with row offsets table and 16-bit runs
+    OutFmt_JSPR3,  //!< KeeperFX variation (version 3) of Jonty Sprite format, with row offsets table and 16-bit runs
 };
 
 enum {
@@ -40,6 +42,15 @@ enum {
     Batch_ANIMLIST,
 };
 
+/**
+ * Stores possible forms of embedding sprite catalogues into programs.
+ */
+enum {
+    Embed_NONE = 0,
+    Embed_CSRC,    //!< C source file with constant arrays
+    Embed_ELF,     //!< Relocatable ELF object, for linking directly
+};
+
 enum {
     DfsAlg_FldStnbrg = 0,
     DfsAlg_JrvJdcNnk,
@@ -81,6 +92,20 @@ public:
     int w,h;
     /** Destination format specific data */
     int fd[4];
+    /** Palette file to convert this image with, or empty if the main palette is used */
+    std::string fname_pal;
+};
+
+/** Output file to be created, with its format */
+class OutputFile {
+public:
+    OutputFile(int nfmt): fmt(nfmt) {};
+    /** Format of the output file */
+    int fmt;
+    /** Name of the main output file */
+    std::string fname_out;
+    /** Name of the tabulation file, for formats which have it */
+    std::string fname_tab;
 };
 
 /** A class closing non-global command line parameters */
@@ -94,24 +119,99 @@ public:
     {
         inp.clear();
         fname_lst.clear();
+        fname_lists.clear();
         fname_pal.clear();
-        fname_out.clear();
-        fname_tab.clear();
+        outs.clear();
         alg = DfsAlg_FldStnbrg;
-        fmt = OutFmt_RAW;
         lvl = 100;
         pal_range = 63;
         batch = Batch_NONE;
+        dedup = false;
+        sheet_quant = false;
+        shard = false;
+        shard_max = 0;
+        atlas = false;
+        atlas_width = 1024;
+        atlas_height = 1024;
+        blit_bench = false;
+        update = false;
+        update_idx.clear();
+        cache_dir.clear();
+        cache_max = 1024;
+        if_changed = false;
+        depfile = false;
+        fname_dep.clear();
+        inspect = false;
+        dry_run = false;
+        mips = 0;
+        verify = false;
+        embed = Embed_NONE;
+        align = 1;
+        fname_delta_base.clear();
+        fname_delta_apply.clear();
+    }
+    /** Informs whether any of the outputs is in given format */
+    bool hasFormat(int fmt) const
+    {
+        for (auto out = outs.begin(); out != outs.end(); out++)
+            if (out->fmt == fmt)
+                return true;
+        return false;
     }
     std::vector<ImageArea> inp;
     std::string fname_lst;
+    /** Names of all list files read, including the ones referenced by other lists */
+    std::vector<std::string> fname_lists;
     std::string fname_pal;
-    std::string fname_out;
-    std::string fname_tab;
-    int fmt;
+    /** Output files to be created from the input images */
+    std::vector<OutputFile> outs;
     int alg;
     int lvl;
     int pal_range;
     int batch;
+    /** Whether identical sprites in a catalogue should share one copy of data */
+    bool dedup;
+    /** Whether sprite sheets should have colors converted as a whole, before slicing */
+    bool sheet_quant;
+    /** Whether sprite catalogues exceeding limits should be split into several files */
+    bool shard;
+    /** Max amount of sprites in one shard, or 0 to only respect format limits */
+    unsigned shard_max;
+    /** Whether RAW/BMP output should have sprites packed into atlas pages, instead of fixed grid */
+    bool atlas;
+    /** Size of each atlas page */
+    int atlas_width;
+    int atlas_height;
+    /** Whether drawing of the sprites should be measured after conversion */
+    bool blit_bench;
+    /** Whether existing sprite catalogue should be updated, rather than created from scratch */
+    bool update;
+    /** Indexes of sprites to be encoded again when updating; images beyond the catalogue end are always encoded */
+    std::vector<unsigned> update_idx;
+    /** Directory of persistent quantized images cache, or empty if the cache is not used */
+    std::string cache_dir;
+    /** Max size of the cache directory, in MiB */
+    unsigned cache_max;
+    /** Whether output files with content identical to the new one should be left untouched */
+    bool if_changed;
+    /** Whether make-style dependency file should be written, listing all input files */
+    bool depfile;
+    std::string fname_dep;
+    /** Whether input files should only be checked, without conversion */
+    bool inspect;
+    /** Whether outputs should be encoded only to compute their sizes, without writing any files */
+    bool dry_run;
+    /** Amount of additional outputs levels, each with images downscaled twice more than previous */
+    unsigned mips;
+    /** Whether written sprite catalogues should be read back and compared with the converted images */
+    bool verify;
+    /** Whether sprite catalogues should also be written in a form which can be linked into a program */
+    int embed;
+    /** Alignment of sprite data offsets within sprite catalogues */
+    unsigned align;
+    /** Previous build of the sprite catalogue DAT file, to write delta against; empty if no delta is made */
+    std::string fname_delta_base;
+    /** Delta file to be applied to the input DAT/TAB files, instead of converting images */
+    std::string fname_delta_apply;
 };
 
@@ -0,0 +1,296 @@
+/******************************************************************************/
+// PNG and PAL to RAW/DAT/SPR files converter for KeeperFX
+/******************************************************************************/
+/** @file quantcache.cpp
+ *     Persistent cache of quantized images.
+ * @par Purpose:
+ *     Stores images converted to palette indexes, with their transparency,
+ *     so that unchanged inputs do not have to be decoded and dithered again.
+ * @par Comment:
+ *     None.
+ * @author   Tomasz Lis <listom@gmail.com>
+ * @par  Copying and copyrights:
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ */
+/******************************************************************************/
+
+#include "quantcache.hpp"
+#include "imagedata.hpp"
+#include "prog_options.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#pragma pack(1)
+
+/**
+ * Header of cache entry file. It is followed by palette indexes of every row,
+ * then amount of transparent spans in every row, and finally the spans as (x, length) pairs.
+ */
+struct QuantCacheHead {
+    char magic[4];
+    uint32_t width;
+    uint32_t height;
+    int32_t crop_x;
+    int32_t crop_y;
+    int32_t crop_width;
+    int32_t crop_height;
+    int32_t color_type;
+    int32_t col_bits;
+    unsigned char additional_data[ADDITIONAL_DATA_LEN];
+    uint32_t spans_count;
+};
+
+#pragma pack()
+
+static const char quant_cache_magic[4] = {'P','Q','C','1'};
+static const char quant_cache_ext[] = ".qnt";
+
+void QuantCache::setup(const std::string& ndir, size_t nmax_size)
+{
+    dir = ndir;
+    max_size = nmax_size;
+#if defined(_WIN32)
+    mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0777);
+#endif
+}
+
+std::string QuantCache::entryName(uint64_t key) const
+{
+    char name[24];
+    sprintf(name, "%016llx", (unsigned long long)key);
+    return dir + "/" + name + quant_cache_ext;
+}
+
+/**
+ * Checks whether transparency spans of cache entry are consistent with its head.
+ * Row span counts have to add up to the total count, and every span has to fit within its row.
+ */
+bool QuantCache::spansValid(const unsigned char *row_spans, uint32_t width, uint32_t height, uint32_t spans_count)
+{
+    const unsigned char *spans = row_spans + 4 * (size_t)height;
+    uint64_t total = 0;
+    for (uint32_t y = 0; y < height; y++)
+    {
+        uint32_t num;
+        memcpy(&num, row_spans + 4 * (size_t)y, 4);
+        total += num;
+    }
+    if (total != spans_count)
+        return false;
+    for (uint32_t i = 0; i < spans_count; i++)
+    {
+        uint32_t span[2];
+        memcpy(span, spans + 8 * (size_t)i, 8);
+        if ((uint64_t)span[0] + span[1] > width)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Fills image with palette indexes and transparency from cache entry of given key.
+ * The image becomes a view into mapped entry file.
+ * @return True on cache hit, false if the entry doesn't exist or is invalid.
+ */
+bool QuantCache::load(ImageData& img, uint64_t key)
+{
+    std::string fname = entryName(key);
+    maps.emplace_back();
+    MappedFile& map = maps.back();
+    if ((map.open(fname) != ERR_OK) || (map.size() < sizeof(QuantCacheHead))) {
+        maps.pop_back();
+        misses++;
+        return false;
+    }
+    const QuantCacheHead& head = *(const QuantCacheHead *)map.data();
+    size_t plane_len = (size_t)head.width * head.height;
+    size_t data_len = sizeof(QuantCacheHead) + plane_len + 4 * (size_t)head.height + 8 * (size_t)head.spans_count;
+    if ((memcmp(head.magic, quant_cache_magic, 4) != 0) || (map.size() != data_len) ||
+        !spansValid(map.data() + sizeof(QuantCacheHead) + plane_len, head.width, head.height, head.spans_count)) {
+        LogErr("%s: Invalid cache entry, ignoring",fname.c_str());
+        maps.pop_back();
+        misses++;
+        return false;
+    }
+    img.width = head.width;
+    img.height = head.height;
+    img.crop_x = head.crop_x;
+    img.crop_y = head.crop_y;
+    img.crop_width = head.crop_width;
+    img.crop_height = head.crop_height;
+    img.color_type = head.color_type;
+    img.col_bits = head.col_bits;
+    memcpy(img.additional_data, head.additional_data, ADDITIONAL_DATA_LEN);
+    png_bytep plane = map.data() + sizeof(QuantCacheHead);
+    img.view_rows.resize(img.height);
+    for (unsigned y = 0; y < img.height; y++)
+        img.view_rows[y] = plane + (size_t)y * img.width;
+    const unsigned char *row_spans = plane + plane_len;
+    const unsigned char *spans = row_spans + 4 * img.height;
+    img.transMap.resize2d(img.width,img.height);
+    img.transMap.zeroize2d();
+    for (unsigned y = 0; y < img.height; y++)
+    {
+        uint32_t num;
+        memcpy(&num, row_spans + 4 * y, 4);
+        ColorTranparency::Column& transPtr = img.transMap[y];
+        for (uint32_t i = 0; i < num; i++)
+        {
+            uint32_t span[2];
+            memcpy(span, spans, 8);
+            spans += 8;
+            std::fill(transPtr.begin()+span[0], transPtr.begin()+span[0]+span[1], true);
+        }
+    }
+    img.cached = true;
+    // Mark the entry as recently used
+    utime(fname.c_str(), NULL);
+    hits++;
+    return true;
+}
+
+/**
+ * Stores palette indexes and transparency of given converted image as cache entry of given key.
+ * The entry is written under temporary name first, so other processes never see partial data.
+ */
+short QuantCache::store(ImageData& img, uint64_t key)
+{
+    QuantCacheHead head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, quant_cache_magic, 4);
+    head.width = img.width;
+    head.height = img.height;
+    head.crop_x = img.crop_x;
+    head.crop_y = img.crop_y;
+    head.crop_width = img.crop_width;
+    head.crop_height = img.crop_height;
+    head.color_type = img.color_type;
+    head.col_bits = img.col_bits;
+    memcpy(head.additional_data, img.additional_data, ADDITIONAL_DATA_LEN);
+    // Find transparent spans
+    std::vector<uint32_t> row_spans(img.height, 0);
+    std::vector<uint32_t> spans;
+    for (unsigned y = 0; y < img.height; y++)
+    {
+        const ColorTranparency::Column& transPtr = img.transMap[y];
+        unsigned x = 0;
+        while (x < img.width)
+        {
+            while ((x < img.width) && !transPtr[x])
+                x++;
+            unsigned start = x;
+            while ((x < img.width) && transPtr[x])
+                x++;
+            if (x > start) {
+                spans.push_back(start);
+                spans.push_back(x - start);
+                row_spans[y]++;
+            }
+        }
+    }
+    head.spans_count = spans.size() / 2;
+    std::string fname = entryName(key);
+    // Other processes may share the cache directory, so the temporary file name is unique
+    // to this process; only complete entries are renamed to the name others look for
+    char tmp_suffix[32];
+#if defined(_WIN32)
+    snprintf(tmp_suffix, sizeof(tmp_suffix), ".%d.%u.tmp", (int)_getpid(), stored++);
+#else
+    snprintf(tmp_suffix, sizeof(tmp_suffix), ".%d.%u.tmp", (int)getpid(), stored++);
+#endif
+    std::string fname_tmp = fname + tmp_suffix;
+    FILE* cachefile = fopen(fname_tmp.c_str(),"wb");
+    if (cachefile == NULL) {
+        perror(fname_tmp.c_str());
+        return ERR_CANT_OPEN;
+    }
+    bool ok = (fwrite(&head,sizeof(head),1,cachefile) == 1);
+    png_bytep * row_pointers = img.rowPointers();
+    for (unsigned y = 0; ok && (y < img.height); y++)
+        ok = (fwrite(row_pointers[y],img.width,1,cachefile) == 1);
+    if (ok && (img.height > 0))
+        ok = (fwrite(&row_spans.front(),4,row_spans.size(),cachefile) == row_spans.size());
+    if (ok && !spans.empty())
+        ok = (fwrite(&spans.front(),4,spans.size(),cachefile) == spans.size());
+    if ((fclose(cachefile) != 0) || !ok) {
+        perror(fname_tmp.c_str());
+        remove(fname_tmp.c_str());
+        return ERR_FILE_WRITE;
+    }
+#if defined(_WIN32)
+    remove(fname.c_str());
+#endif
+    if (rename(fname_tmp.c_str(), fname.c_str()) != 0) {
+        perror(fname.c_str());
+        remove(fname_tmp.c_str());
+        return ERR_FILE_WRITE;
+    }
+    return ERR_OK;
+}
+
+/**
+ * Removes least recently used entries, until size of the cache fits within limit.
+ */
+short QuantCache::evict(void)
+{
+    struct CacheEntry {
+        std::string fname;
+        time_t mtime;
+        size_t size;
+    };
+    std::vector<CacheEntry> entries;
+    size_t total_size = 0;
+    DIR *dirp = opendir(dir.c_str());
+    if (dirp == NULL) {
+        perror(dir.c_str());
+        return ERR_CANT_OPEN;
+    }
+    struct dirent *dent;
+    while ((dent = readdir(dirp)) != NULL)
+    {
+        std::string name = dent->d_name;
+        size_t ext_len = strlen(quant_cache_ext);
+        if ((name.length() <= ext_len) || (name.compare(name.length()-ext_len, ext_len, quant_cache_ext) != 0))
+            continue;
+        CacheEntry ent;
+        struct stat st;
+        ent.fname = dir + "/" + name;
+        if (stat(ent.fname.c_str(), &st) != 0)
+            continue;
+        ent.mtime = st.st_mtime;
+        ent.size = st.st_size;
+        total_size += ent.size;
+        entries.push_back(ent);
+    }
+    closedir(dirp);
+    if (total_size <= max_size)
+        return ERR_OK;
+    std::sort(entries.begin(), entries.end(), [](const CacheEntry& a, const CacheEntry& b) {
+        return a.mtime < b.mtime;
+    });
+    for (auto ent = entries.begin(); (ent != entries.end()) && (total_size > max_size); ent++)
+    {
+        if (remove(ent->fname.c_str()) != 0)
+            continue;
+        total_size -= ent->size;
+        evicted++;
+    }
+    return ERR_OK;
+}
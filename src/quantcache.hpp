@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <cstdint>
+#include <cstddef>
+
+#include "filemap.hpp"
+
+class ImageData;
+
+/** Version of conversion results; needs to be increased when conversion changes, to invalidate old entries */
+#define QUANT_CACHE_VERSION 1
+
+/**
+ * Persistent cache of images converted to palette indexes.
+ * Every entry is a separate file in cache directory, named after the key which
+ * identifies input file content and conversion parameters.
+ */
+class QuantCache
+{
+public:
+    QuantCache():hits(0),misses(0),evicted(0),max_size(0),stored(0){}
+    void setup(const std::string& ndir, size_t nmax_size);
+    /** Informs whether the cache is in use */
+    bool enabled(void) const
+    { return !dir.empty(); }
+    bool load(ImageData& img, uint64_t key);
+    short store(ImageData& img, uint64_t key);
+    short evict(void);
+    unsigned hits;
+    unsigned misses;
+    unsigned evicted;
+private:
+    std::string entryName(uint64_t key) const;
+    static bool spansValid(const unsigned char *row_spans, uint32_t width, uint32_t height, uint32_t spans_count);
+    std::string dir;
+    size_t max_size;
+    /** Amount of entries stored, making names of temporary files unique within the process */
+    unsigned stored;
+    /** Mapped entries, kept while images use their data */
+    std::list<MappedFile> maps;
+};
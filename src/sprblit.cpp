@@ -0,0 +1,132 @@
+/******************************************************************************/
+// PNG and PAL to RAW/DAT/SPR files converter for KeeperFX
+/******************************************************************************/
+/** @file sprblit.cpp
+ *     Reference sprite drawing routines.
+ * @par Purpose:
+ *     Draws sprites from SmallSprite catalogue data into 8bpp buffer,
+ *     with clipping; serves as reference for engines reading the formats.
+ * @par Comment:
+ *     None.
+ * @author   Tomasz Lis <listom@gmail.com>
+ * @par  Copying and copyrights:
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ */
+/******************************************************************************/
+
+#include "sprblit.hpp"
+
+#include <cstring>
+#include <cstdint>
+
+/**
+ * Copies run of filled pixels into destination line, skipping pixels outside clipping window.
+ */
+static inline void blit_run(unsigned char *dst_line, const BlitTarget& dst, int x, const unsigned char *src, int len)
+{
+    int clip_end = dst.clip_x + dst.clip_width;
+    if (x < dst.clip_x) {
+        src += dst.clip_x - x;
+        len -= dst.clip_x - x;
+        x = dst.clip_x;
+    }
+    if (x + len > clip_end)
+        len = clip_end - x;
+    if (len > 0)
+        memcpy(dst_line + x, src, len);
+}
+
+/**
+ * Reads 2-byte little-endian signed number from sprite data.
+ */
+static inline int read_int16_le(const unsigned char *buff)
+{
+    return (int16_t)(buff[0] | (buff[1] << 8));
+}
+
+/**
+ * Reads 4-byte little-endian number from sprite data.
+ */
+static inline uint32_t read_int32_le(const unsigned char *buff)
+{
+    return buff[0] | (buff[1] << 8) | (buff[2] << 16) | ((uint32_t)buff[3] << 24);
+}
+
+/**
+ * Draws SmallSprite Ver1/Ver2 sprite at given position.
+ * Rows are RLE-encoded with signed byte runs and end with 0; rows above the clipping
+ * window have to be decoded to find the first visible one.
+ */
+void sspr2_blit(const BlitTarget& dst, const unsigned char *spr, int swidth, int sheight, int x, int y)
+{
+    int y_end = y + sheight;
+    if (y_end > dst.clip_y + dst.clip_height)
+        y_end = dst.clip_y + dst.clip_height;
+    for (int ry = y; ry < y_end; ry++)
+    {
+        if (ry < dst.clip_y) {
+            // Skip the whole row
+            while (1) {
+                int n = (signed char)*spr++;
+                if (n == 0)
+                    break;
+                if (n > 0)
+                    spr += n;
+            }
+            continue;
+        }
+        unsigned char *dst_line = dst.data + ry * dst.pitch;
+        int rx = x;
+        while (1) {
+            int n = (signed char)*spr++;
+            if (n == 0)
+                break;
+            if (n > 0) {
+                blit_run(dst_line, dst, rx, spr, n);
+                spr += n;
+                rx += n;
+            } else {
+                rx -= n;
+            }
+        }
+    }
+}
+
+/**
+ * Draws SmallSprite Ver3 sprite at given position.
+ * The sprite starts with table of 32-bit row offsets, so drawing starts directly
+ * at the first visible row; rows are RLE-encoded with signed 16-bit runs and end with 0.
+ */
+void sspr3_blit(const BlitTarget& dst, const unsigned char *spr, int swidth, int sheight, int x, int y)
+{
+    int y_beg = y;
+    if (y_beg < dst.clip_y)
+        y_beg = dst.clip_y;
+    int y_end = y + sheight;
+    if (y_end > dst.clip_y + dst.clip_height)
+        y_end = dst.clip_y + dst.clip_height;
+    if (y_beg >= y_end)
+        return;
+    const unsigned char *row = spr + read_int32_le(spr + 4 * (y_beg - y));
+    for (int ry = y_beg; ry < y_end; ry++)
+    {
+        unsigned char *dst_line = dst.data + ry * dst.pitch;
+        int rx = x;
+        while (1) {
+            int n = read_int16_le(row);
+            row += 2;
+            if (n == 0)
+                break;
+            if (n > 0) {
+                blit_run(dst_line, dst, rx, row, n);
+                row += n;
+                rx += n;
+            } else {
+                rx -= n;
+            }
+        }
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+/**
+ * Destination 8bpp buffer for drawing sprites, with clipping window.
+ */
+struct BlitTarget {
+    unsigned char *data;
+    /** Distance between lines of the buffer, in bytes */
+    int pitch;
+    /** Clipping window; only pixels within it are drawn */
+    int clip_x;
+    int clip_y;
+    int clip_width;
+    int clip_height;
+};
+
+void sspr2_blit(const BlitTarget& dst, const unsigned char *spr, int swidth, int sheight, int x, int y);
+void sspr3_blit(const BlitTarget& dst, const unsigned char *spr, int swidth, int sheight, int x, int y);
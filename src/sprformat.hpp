@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+
+#pragma pack(1)
+
+/**
+ * Structure defining TAB file entry for Small Sprite format DAT/TAB files.
+ */
+struct SmallSpriteV1 {
+    /** Offset of the sprite data in DAT file. */
+    uint32_t Data;
+    /** Width of the sprite data. */
+    unsigned char SWidth;
+    /** Height of the sprite data. */
+    unsigned char SHeight;
+};
+
+/**
+ * Structure defining TAB file entry for Jonty Sprite format JTY/TAB files.
+ */
+struct JontySpriteV1 {
+    /** Offset of the sprite data in DAT file. */
+    uint32_t Data;
+    /** Width of the sprite data. */
+    unsigned char SWidth;
+    /** Height of the sprite data. */
+    unsigned char SHeight;
+    /** Width of the animation frame (same for whole animation). */
+    unsigned char FrameWidth;
+    /** Height of the animation frame (same for whole animation). */
+    unsigned char FrameHeight;
+    /** Flags informing whether the animation is rotable; 0 - non-rotable, 2 - rotable. */
+    unsigned char Rotable;
+    /** Amount of frames making up the animation (same for whole animation). */
+    unsigned char FramesCount;
+    /** Offset of the sprite within frame; width shift. */
+    char FrameOffsW;
+    /** Offset of the sprite within frame; height shift. */
+    char FrameOffsH;
+    /** Unidentified negative value A. */
+    signed short unkn6;
+    /** Unidentified negative value B. */
+    signed short unkn8;
+};
+
+/**
+ * Structure defining TAB file entry for Small Sprite format Ver2 DAT/TAB files.
+ */
+struct SmallSpriteV2 {
+    /** Offset of the sprite data in DAT file. */
+    uint32_t Data;
+    /** Width of the sprite data. */
+    unsigned short SWidth;
+    /** Height of the sprite data. */
+    unsigned short SHeight;
+};
+
+/**
+ * Structure defining TAB file entry for Jonty Sprite format Ver2 JTY/TAB files.
+ */
+struct JontySpriteV2 {
+    /** Offset of the sprite data in DAT file. */
+    uint32_t Data;
+    /** Width of the sprite data. */
+    unsigned short SWidth;
+    /** Height of the sprite data. */
+    unsigned short SHeight;
+    /** Width of the animation frame (same for whole animation). */
+    unsigned short FrameWidth;
+    /** Height of the animation frame (same for whole animation). */
+    unsigned short FrameHeight;
+    /** Flags informing whether the animation is rotable; 0 - non-rotable, 2 - rotable. */
+    unsigned char Rotable;
+    /** Amount of frames making up the animation (same for whole animation). */
+    unsigned char FramesCount;
+    /** Offset of the sprite within frame; width shift. */
+    short FrameOffsW;
+    /** Offset of the sprite within frame; height shift. */
+    short FrameOffsH;
+    /** Unidentified negative value A. */
+    signed short unkn6;
+    /** Unidentified negative value B. */
+    signed short unkn8;
+};
+
+/**
+ * Structure defining TAB file entry for sprites packed into atlas pages of RAW/BMP files.
+ */
+struct AtlasSpriteEntry {
+    /** Index of the atlas page which contains the sprite. */
+    unsigned short Page;
+    /** Position of the sprite data within atlas page. */
+    unsigned short X;
+    unsigned short Y;
+    /** Width of the sprite data. */
+    unsigned short SWidth;
+    /** Height of the sprite data. */
+    unsigned short SHeight;
+    /** Width of the animation frame, before trimming. */
+    unsigned short FrameWidth;
+    /** Height of the animation frame, before trimming. */
+    unsigned short FrameHeight;
+    /** Offset of the sprite within frame; width shift. */
+    short FrameOffsW;
+    /** Offset of the sprite within frame; height shift. */
+    short FrameOffsH;
+};
+
+#pragma pack()
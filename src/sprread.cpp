@@ -0,0 +1,190 @@
+/******************************************************************************/
+// PNG and PAL to RAW/DAT/SPR files converter for KeeperFX
+/******************************************************************************/
+/** @file sprread.cpp
+ *     Sprite catalogue reading support.
+ * @par Purpose:
+ *     Reads SmallSprite and JontySprite catalogues from DAT/TAB files,
+ *     allowing to draw the sprites the same way as an engine would.
+ * @par Comment:
+ *     None.
+ * @author   Tomasz Lis <listom@gmail.com>
+ * @par  Copying and copyrights:
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ */
+/******************************************************************************/
+
+#include "sprread.hpp"
+#include "sprformat.hpp"
+#include "prog_options.hpp"
+
+#include <cstring>
+
+/**
+ * Fills catalogue entry from TAB entry of Small Sprite format.
+ */
+template <typename SprEntry>
+static void small_entry_read(SpriteCatalogueEntry& spr, const unsigned char *buf)
+{
+    SprEntry tab_spr;
+    memcpy(&tab_spr, buf, sizeof(SprEntry));
+    spr.data = tab_spr.Data;
+    spr.width = tab_spr.SWidth;
+    spr.height = tab_spr.SHeight;
+    spr.frame_x = 0;
+    spr.frame_y = 0;
+}
+
+/**
+ * Fills catalogue entry from TAB entry of Jonty Sprite format.
+ */
+template <typename SprEntry>
+static void jonty_entry_read(SpriteCatalogueEntry& spr, const unsigned char *buf)
+{
+    SprEntry tab_spr;
+    memcpy(&tab_spr, buf, sizeof(SprEntry));
+    spr.data = tab_spr.Data;
+    spr.width = tab_spr.SWidth;
+    spr.height = tab_spr.SHeight;
+    spr.frame_x = tab_spr.FrameOffsW;
+    spr.frame_y = tab_spr.FrameOffsH;
+}
+
+/**
+ * Maps sprite catalogue files of given format into memory.
+ * Small Sprite TAB starts with unused entry, and its DAT starts with entries count;
+ * Jonty Sprite TAB ends with entry pointing at end of the DAT file.
+ */
+short SpriteCatalogueReader::open(const std::string& fname_dat, const std::string& fname_tab, int nfmt)
+{
+    close();
+    fmt = nfmt;
+    unsigned extra;
+    switch (fmt)
+    {
+    case OutFmt_SSPR:
+        entry_len = sizeof(SmallSpriteV1);
+        lead = 1;
+        extra = 1;
+        break;
+    case OutFmt_SSPR2:
+    case OutFmt_SSPR3:
+        entry_len = sizeof(SmallSpriteV2);
+        lead = 1;
+        extra = 1;
+        break;
+    case OutFmt_JSPR:
+        entry_len = sizeof(JontySpriteV1);
+        lead = 0;
+        extra = 1;
+        break;
+    case OutFmt_JSPR2:
+    case OutFmt_JSPR3:
+        entry_len = sizeof(JontySpriteV2);
+        lead = 0;
+        extra = 1;
+        break;
+    default:
+        LogErr("%s: Format cannot be read as sprite catalogue",fname_dat.c_str());
+        return ERR_BAD_FILE;
+    }
+    short ret = tab.open(fname_tab);
+    if (ret != ERR_OK) {
+        perror(fname_tab.c_str());
+        return ret;
+    }
+    ret = dat.open(fname_dat);
+    if (ret != ERR_OK) {
+        perror(fname_dat.c_str());
+        close();
+        return ret;
+    }
+    size_t num_entries = tab.size() / entry_len;
+    if ((tab.size() % entry_len != 0) || (num_entries < extra)) {
+        LogErr("%s: Incorrect size of TAB file",fname_tab.c_str());
+        close();
+        return ERR_BAD_FILE;
+    }
+    if (lead > 0)
+    {
+        if ((dat.size() < 2) || ((unsigned)(dat.data()[0] | (dat.data()[1] << 8)) != (num_entries & 0xffff))) {
+            LogErr("%s: Entries count in DAT doesn't match TAB file",fname_dat.c_str());
+            close();
+            return ERR_BAD_FILE;
+        }
+    }
+    num_sprites = num_entries - extra;
+    return ERR_OK;
+}
+
+/**
+ * Unmaps the catalogue files.
+ */
+void SpriteCatalogueReader::close(void)
+{
+    dat.close();
+    tab.close();
+    num_sprites = 0;
+}
+
+/**
+ * Reads TAB entry of sprite with given index; sprite indexes start at 0, whether the format has unused
+ * lead entry or not.
+ */
+short SpriteCatalogueReader::entry(unsigned idx, SpriteCatalogueEntry& spr)
+{
+    if (idx >= num_sprites)
+        return ERR_LIMIT_EXCEED;
+    const unsigned char *buf = tab.data() + (lead + idx) * entry_len;
+    switch (fmt)
+    {
+    case OutFmt_SSPR:
+        small_entry_read<SmallSpriteV1>(spr, buf);
+        break;
+    case OutFmt_SSPR2:
+    case OutFmt_SSPR3:
+        small_entry_read<SmallSpriteV2>(spr, buf);
+        break;
+    case OutFmt_JSPR:
+        jonty_entry_read<JontySpriteV1>(spr, buf);
+        break;
+    case OutFmt_JSPR2:
+    case OutFmt_JSPR3:
+        jonty_entry_read<JontySpriteV2>(spr, buf);
+        break;
+    default:
+        return ERR_BAD_FILE;
+    }
+    return ERR_OK;
+}
+
+/**
+ * Draws sprite with given index, decoding it directly from mapped DAT file.
+ * Only the sprite offset and row offsets table are checked to be within the file;
+ * the RLE data itself is expected to be well-formed.
+ */
+short SpriteCatalogueReader::blit(unsigned idx, const BlitTarget& dst, int x, int y)
+{
+    SpriteCatalogueEntry spr;
+    short ret = entry(idx, spr);
+    if (ret != ERR_OK)
+        return ret;
+    if ((spr.width <= 0) || (spr.height <= 0))
+        return ERR_OK;
+    if (spr.data >= dat.size())
+        return ERR_BAD_FILE;
+    const unsigned char *data = dat.data() + spr.data;
+    if ((fmt == OutFmt_SSPR3) || (fmt == OutFmt_JSPR3))
+    {
+        if (dat.size() - spr.data < 4 * (size_t)spr.height)
+            return ERR_BAD_FILE;
+        sspr3_blit(dst, data, spr.width, spr.height, x, y);
+    } else
+    {
+        sspr2_blit(dst, data, spr.width, spr.height, x, y);
+    }
+    return ERR_OK;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#include "filemap.hpp"
+#include "sprblit.hpp"
+
+/**
+ * Properties of a sprite within catalogue, common for all TAB entry formats.
+ */
+struct SpriteCatalogueEntry {
+    /** Offset of the sprite data in DAT file */
+    uint32_t data;
+    /** Dimensions of the sprite data */
+    int width;
+    int height;
+    /** Offset of the sprite within animation frame; zero for formats without frames */
+    int frame_x;
+    int frame_y;
+};
+
+/**
+ * Sprite catalogue DAT/TAB files pair, mapped into memory so that sprites are drawn
+ * directly from the file data, without copying it.
+ */
+class SpriteCatalogueReader
+{
+public:
+    SpriteCatalogueReader():fmt(-1),entry_len(0),lead(0),num_sprites(0){}
+    short open(const std::string& fname_dat, const std::string& fname_tab, int nfmt);
+    void close(void);
+    /** Gives amount of sprites in the catalogue */
+    unsigned count(void) const
+    { return num_sprites; }
+    short entry(unsigned idx, SpriteCatalogueEntry& spr);
+    short blit(unsigned idx, const BlitTarget& dst, int x, int y);
+private:
+    int fmt;
+    size_t entry_len;
+    unsigned lead;
+    unsigned num_sprites;
+    MappedFile dat;
+    MappedFile tab;
+};
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/**
+ * Gives amount of worker threads to be used for parallel processing.
+ */
+inline unsigned worker_threads_count(void)
+{
+    unsigned num = std::thread::hardware_concurrency();
+    if (num < 1)
+        num = 1;
+    return num;
+}
+
+/**
+ * Calls given function for every index in range 0..count-1, spreading the calls
+ * over worker threads. Indexes are taken in increasing order, one at a time,
+ * so the function should process a reasonably sized chunk of work.
+ */
+template <typename Func>
+void parallel_for(int count, Func func)
+{
+    unsigned num_threads = worker_threads_count();
+    if ((int)num_threads > count)
+        num_threads = count;
+    if (num_threads <= 1) {
+        for (int i = 0; i < count; i++)
+            func(i);
+        return;
+    }
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        int i;
+        while ((i = next++) < count)
+            func(i);
+    };
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < num_threads; t++)
+        threads.push_back(std::thread(worker));
+    worker();
+    for (auto thread = threads.begin(); thread != threads.end(); thread++)
+        thread->join();
+}
+
+/**
+ * Worker threads kept waiting for work, for tasks which are split into parallel jobs
+ * many times in a row, where starting new threads every time would cost more than the jobs.
+ */
+class WorkerPool
+{
+public:
+    WorkerPool():job(NULL),count(0),next(0),busy(0),generation(0),quit(false)
+    {
+        unsigned num_threads = worker_threads_count();
+        for (unsigned t = 1; t < num_threads; t++)
+            threads.push_back(std::thread(&WorkerPool::work, this));
+    }
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            quit = true;
+        }
+        start_cv.notify_all();
+        for (auto thread = threads.begin(); thread != threads.end(); thread++)
+            thread->join();
+    }
+    /**
+     * Calls given function for every index in range 0..count-1, on the pool threads
+     * and the calling one; returns when all calls are finished.
+     */
+    void run(int ncount, const std::function<void(int)>& func)
+    {
+        // One task at a time; callers from different threads wait for their turn
+        std::lock_guard<std::mutex> run_lock(run_mtx);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            job = &func;
+            count = ncount;
+            next = 0;
+            busy = threads.size();
+            generation++;
+        }
+        start_cv.notify_all();
+        runJobs();
+        std::unique_lock<std::mutex> lock(mtx);
+        done_cv.wait(lock, [this]() { return (busy == 0); });
+        job = NULL;
+    }
+private:
+    void runJobs(void)
+    {
+        int i;
+        while ((i = next++) < count)
+            (*job)(i);
+    }
+    void work(void)
+    {
+        unsigned done_generation = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                start_cv.wait(lock, [&]() { return quit || (generation != done_generation); });
+                if (quit)
+                    return;
+                done_generation = generation;
+            }
+            runJobs();
+            std::lock_guard<std::mutex> lock(mtx);
+            if (--busy == 0)
+                done_cv.notify_one();
+        }
+    }
+    std::vector<std::thread> threads;
+    std::mutex run_mtx;
+    std::mutex mtx;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    const std::function<void(int)> *job;
+    int count;
+    std::atomic<int> next;
+    /** Amount of pool threads which did not finish the current task yet */
+    unsigned busy;
+    /** Number of the current task, telling pool threads there is new work */
+    unsigned generation;
+    bool quit;
+};
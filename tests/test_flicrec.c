@@ -0,0 +1,374 @@
+/******************************************************************************/
+// PNG and PAL to RAW/DAT/SPR files converter for KeeperFX
+/******************************************************************************/
+/** @file test_flicrec.c
+ *     Test of FLIC recording kernels.
+ * @par Purpose:
+ *     Encodes the same frame sequences with every set of scanning kernels
+ *     forced, with and without damaged regions given, and with the blocks
+ *     split into parallel jobs; checks that the data is the same as from
+ *     plain C code scanning whole frames, one block after another.
+ * @par Comment:
+ *     Sets not supported by the CPU are skipped. The sequences are made
+ *     to have BRUN, SS2 and LC frames, odd widths, runs which cross vector
+ *     boundaries, and changes at first and last column. Parallel jobs are
+ *     run on one thread in reverse order, so that joining the bands does
+ *     not depend on the order in which they were finished.
+ * @author   Tomasz Lis <listom@gmail.com>
+ * @par  Copying and copyrights:
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ */
+/******************************************************************************/
+
+#include "bfflic.h"
+#include "bfmemut.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int verbose = 0;
+
+#define TEST_FILE_NAME "test_flicrec.fli"
+/** Amount of frames in every sequence. */
+#define TEST_FRAMES 12
+
+struct TestSize {
+    int width;
+    int height;
+};
+
+static const struct TestSize test_sizes[] = {
+    {1, 1}, {2, 2}, {15, 7}, {17, 3}, {33, 9}, {64, 16}, {67, 20}, {255, 5}, {319, 24},
+    {256, 64}, {333, 97},
+};
+
+static const char *kernel_names[] = {"scalar", "SSE2", "AVX2"};
+
+/** Way of recording a sequence; every one is compared to the first. */
+struct TestMode {
+    int kernels;
+    TbBool with_damage;
+    TbBool parallel;
+};
+
+static const struct TestMode test_modes[] = {
+    {AniKrn_SCALAR, false, false},
+    {AniKrn_SCALAR, true, false},
+    {AniKrn_SCALAR, false, true},
+    {AniKrn_SCALAR, true, true},
+    {AniKrn_SSE2, false, false},
+    {AniKrn_SSE2, true, false},
+    {AniKrn_AVX2, false, false},
+    {AniKrn_AVX2, true, false},
+    {AniKrn_AVX2, true, true},
+};
+
+/**
+ * Runs the frame encoding jobs one by one, from the last one to the first.
+ */
+static void reverse_parallel_jobs(AnimJobFunc job, void *ctx, int count)
+{
+    int i;
+    for (i = count - 1; i >= 0; i--)
+        job(ctx, i);
+}
+
+static unsigned test_seed;
+
+static unsigned test_rand(void)
+{
+    test_seed = test_seed * 1103515245 + 12345;
+    return (test_seed >> 8);
+}
+
+/**
+ * Fills columns from beg to end of a line with given colour.
+ */
+static void fill_span(ubyte *frm, int w, int y, int beg, int end, ubyte col)
+{
+    int x;
+    if (beg < 0) beg = 0;
+    if (end > w) end = w;
+    for (x = beg; x < end; x++)
+        frm[y * w + x] = col;
+}
+
+/**
+ * Changes the frame into next one of the sequence.
+ * Every frame number makes a different kind of change.
+ */
+static void make_frame(ubyte *frm, int w, int h, int num)
+{
+    int x, y, n;
+    switch (num)
+    {
+    case 0:
+        // Runs of various lengths, crossing 16 and 32 byte boundaries, with noise between
+        for (y = 0; y < h; y++)
+        {
+            x = 0;
+            while (x < w)
+            {
+                int len = 1 + test_rand() % 70;
+                if ((test_rand() & 3) == 0) {
+                    for (n = x; (n < x + len) && (n < w); n++)
+                        frm[y * w + n] = test_rand() & 3;
+                } else {
+                    fill_span(frm, w, y, x, x + len, test_rand());
+                }
+                x += len;
+            }
+        }
+        break;
+    case 1:
+        // First and last column of every line
+        for (y = 0; y < h; y++) {
+            frm[y * w + 0] ^= 0x55;
+            frm[y * w + w - 1] ^= 0xAA;
+        }
+        break;
+    case 2:
+        // Single pixel at last column of last line
+        frm[(h - 1) * w + w - 1]++;
+        break;
+    case 3:
+        // Nothing changes
+        break;
+    case 4:
+        // Spans ending just before, at and after vector boundaries
+        for (y = 0; y < h; y += 2) {
+            fill_span(frm, w, y, 15, 16, 7);
+            fill_span(frm, w, y, 31, 33, 9);
+            fill_span(frm, w, y, 47, 65, 11);
+        }
+        break;
+    case 5:
+        // Runs of 4 and 3 equal bytes across the line
+        for (y = 0; y < h; y++)
+            for (x = 0; x < w; x++)
+                frm[y * w + x] = ((x / 4) & 1) ? (x / 3) : (x / 4);
+        break;
+    case 6:
+        // Single byte change in every 2-byte word of a few lines
+        for (y = h / 3; y < h; y += 3)
+            for (x = y & 1; x < w; x += 2)
+                frm[y * w + x] += 1;
+        break;
+    case 7:
+        // Random pixels all over the frame
+        for (n = 0; n < w * h / 8 + 1; n++)
+            frm[test_rand() % (w * h)] = test_rand();
+        break;
+    case 8:
+        // Whole frame in one colour
+        memset(frm, 0x42, w * h);
+        break;
+    case 9:
+        // Long run over most of the lines, broken at odd columns
+        for (y = 0; y < h; y++) {
+            fill_span(frm, w, y, 0, w, 0x13);
+            if (y & 1)
+                frm[y * w + (y * 7 + 1) % w] = 0x14;
+        }
+        break;
+    case 10:
+        // Repeated pattern of pixel pairs on every line, best stored as SS2 words
+        for (y = 0; y < h; y++)
+            for (x = 2 * (y % 8); x < w; x++)
+                frm[y * w + x] = (x & 1) ? 0x21 : 0x12;
+        break;
+    default:
+        // Small rectangle at first columns of the middle lines
+        for (y = h / 4; y < h - h / 4; y++)
+            fill_span(frm, w, y, 0, 5, num);
+        break;
+    }
+}
+
+/**
+ * Records a sequence of frames into test file.
+ * If damage is set, every frame is recorded with the region which differs from previous one.
+ * If parallel is set, blocks of frames are encoded as jobs, split into bands.
+ */
+static TbBool encode_sequence(int w, int h, uint flags, TbBool with_damage, TbBool parallel)
+{
+    struct Animation anim;
+    struct AnimationContext anim_ctx;
+    struct AnimFrameDamage damage;
+    ubyte *scratch_buf;
+    ubyte *frmbuf;
+    ubyte *prvbuf;
+    ushort *spans;
+    TbBool ret;
+    int i, x, y;
+
+    scratch_buf = calloc(anim_scratch_size(w, h, 8), 1);
+    frmbuf = calloc(anim_frame_size(w, h+1, 8), 1);
+    prvbuf = calloc(anim_frame_size(w, h, 8), 1);
+    spans = calloc(2 * h, sizeof(ushort));
+    if ((scratch_buf == NULL) || (frmbuf == NULL) || (prvbuf == NULL) || (spans == NULL)) {
+        free(scratch_buf); free(frmbuf); free(prvbuf); free(spans);
+        return false;
+    }
+    memset(&anim_ctx, 0, sizeof(anim_ctx));
+    anim_ctx.Scratch = scratch_buf;
+    anim_ctx.Parallel = parallel ? reverse_parallel_jobs : NULL;
+
+    anim_flic_init(&anim, 0, 0);
+    anim_flic_set_context(&anim, &anim_ctx);
+    anim_flic_set_fname(&anim, "%s", TEST_FILE_NAME);
+    ret = (anim_flic_make_open(&anim, w, h, 8, AniFlg_RECORD | flags) == Lb_SUCCESS);
+    if (ret)
+    {
+        anim_flic_set_frame_buffer(&anim, frmbuf, 0, 0, w, 0);
+        test_seed = w * 31 + h;
+        for (i = 0; i < TEST_FRAMES; i++)
+        {
+            make_frame(frmbuf, w, h, i);
+            damage.FirstLine = 0;
+            damage.Lines = 0;
+            for (y = 0; y < h; y++)
+            {
+                int beg = w, end = 0;
+                for (x = 0; x < w; x++) {
+                    if (frmbuf[y * w + x] != prvbuf[y * w + x]) {
+                        if (beg > x) beg = x;
+                        end = x + 1;
+                    }
+                }
+                spans[2 * y + 0] = beg;
+                spans[2 * y + 1] = end;
+                if (beg < end) {
+                    if (damage.Lines == 0)
+                        damage.FirstLine = y;
+                    damage.Lines = y - damage.FirstLine + 1;
+                }
+            }
+            damage.Spans = &spans[2 * damage.FirstLine];
+            memcpy(prvbuf, frmbuf, w * h);
+            anim_make_prep_next_frame(&anim, frmbuf);
+            anim_make_next_frame_damage(&anim, NULL, with_damage ? &damage : NULL);
+        }
+        anim_flic_close(&anim);
+    }
+    free(scratch_buf);
+    free(frmbuf);
+    free(prvbuf);
+    free(spans);
+    return ret;
+}
+
+/**
+ * Reads whole test file into newly allocated buffer.
+ */
+static ubyte *read_test_file(long *p_len)
+{
+    FILE *fp;
+    ubyte *buf;
+    long len;
+
+    fp = fopen(TEST_FILE_NAME, "rb");
+    if (fp == NULL)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf = malloc(len + 1);
+    if ((buf != NULL) && (fread(buf, 1, len, fp) != (size_t)len)) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    *p_len = len;
+    return buf;
+}
+
+/**
+ * Compares the recorded files chunk by chunk; returns index of the first differing
+ * frame chunk, -1 for file header, or -2 if the files are the same.
+ */
+static int compare_chunks(const ubyte *ref, long ref_len, const ubyte *buf, long len)
+{
+    long pos, chunk_len;
+    int frame;
+
+    pos = sizeof(struct FLCFileHeader);
+    if ((len < pos) || (ref_len < pos) || (memcmp(ref, buf, pos) != 0))
+        return -1;
+    for (frame = 0; pos < ref_len; frame++)
+    {
+        chunk_len = ((struct FLCFrameChunk *)(ref + pos))->Size;
+        if ((chunk_len < (long)sizeof(struct FLCFrameChunk)) || (pos + chunk_len > ref_len) ||
+          (pos + chunk_len > len) || (memcmp(ref + pos, buf + pos, chunk_len) != 0))
+            return frame;
+        pos += chunk_len;
+    }
+    return (len == ref_len) ? -2 : frame;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_errors = 0;
+    int num_checks = 0;
+    unsigned i, n;
+    int frame;
+    int variant;
+
+    for (i = 0; i < sizeof(test_sizes)/sizeof(test_sizes[0]); i++)
+    {
+        int w = test_sizes[i].width;
+        int h = test_sizes[i].height;
+        for (variant = 0; variant < 2; variant++)
+        {
+            uint flags = (variant & 1) ? AniFlg_ALL_DELTA : 0;
+            ubyte *ref = NULL;
+            long ref_len = 0;
+
+            for (n = 0; n < sizeof(test_modes)/sizeof(test_modes[0]); n++)
+            {
+                const struct TestMode *mode = &test_modes[n];
+                ubyte *buf;
+                long len;
+
+                if (anim_make_set_kernels(mode->kernels) != mode->kernels) {
+                    if ((i == 0) && (variant == 0) && !mode->with_damage && !mode->parallel)
+                        printf("Kernels %s not supported, skipped.\n", kernel_names[mode->kernels]);
+                    continue;
+                }
+                if (!encode_sequence(w, h, flags, mode->with_damage, mode->parallel) || ((buf = read_test_file(&len)) == NULL)) {
+                    fprintf(stderr, "Recording %dx%d sequence with %s kernels failed.\n",
+                      w, h, kernel_names[mode->kernels]);
+                    num_errors++;
+                    continue;
+                }
+                if (ref == NULL) {
+                    ref = buf;
+                    ref_len = len;
+                    continue;
+                }
+                num_checks++;
+                frame = compare_chunks(ref, ref_len, buf, len);
+                if (frame == -1) {
+                    fprintf(stderr, "Sequence %dx%d flags %u: %s kernels, damage %d, parallel %d differ from reference in file header.\n",
+                      w, h, flags, kernel_names[mode->kernels], (int)mode->with_damage, (int)mode->parallel);
+                    num_errors++;
+                } else if (frame >= 0) {
+                    fprintf(stderr, "Sequence %dx%d flags %u: %s kernels, damage %d, parallel %d differ from reference at frame %d.\n",
+                      w, h, flags, kernel_names[mode->kernels], (int)mode->with_damage, (int)mode->parallel, frame);
+                    num_errors++;
+                }
+                free(buf);
+            }
+            free(ref);
+        }
+    }
+    anim_make_set_kernels(AniKrn_AVX2);
+    remove(TEST_FILE_NAME);
+    printf("Compared %d recordings, %d errors.\n", num_checks, num_errors);
+    return (num_errors > 0) ? 1 : 0;
+}
+/******************************************************************************/